@@ -0,0 +1,221 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Batch mode, see Batch.h
+///
+/// The workers take jobs in list order from a shared counter, so a long
+/// job only holds up its own worker. Finished results wait until the jobs
+/// before them have been written
+//===----------------------------------------------------------------------===//
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <Batch.h>
+#include <CPU.h>
+#include <Memory.h>
+
+namespace Sim6502 {
+
+namespace {
+
+const char * stopReasonName(CPU::StopReason reason) {
+  switch (reason) {
+    case CPU::Budget:        return "Budget";
+    case CPU::Idle:          return "Idle";
+    case CPU::Breakpoint:    return "Breakpoint";
+    case CPU::Watchpoint:    return "Watchpoint";
+    case CPU::IllegalOpcode: return "IllegalOpcode";
+    case CPU::LoopDetected:  return "LoopDetected";
+    case CPU::Halted:        return "Halted";
+  }
+  return "Unknown";
+}
+
+// A JSON string
+std::string quote(const std::string & text) {
+  std::string res = "\"";
+  for (unsigned char ch : text) {
+    if ((ch == '"') or (ch == '\\')) {
+      res += '\\';
+      res += ch;
+    } else if (ch < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", ch);
+      res += buf;
+    } else {
+      res += ch;
+    }
+  }
+  return res + "\"";
+}
+
+// A C style number up to max, false if not a number or too large
+bool number(const std::string & text, uint64_t max, uint64_t & value) {
+  char * end;
+  if (text.empty() or (text[0] == '-')) {
+    return false;
+  }
+  errno = 0;
+  value = strtoull(text.c_str(), &end, 0);
+  return (*end == '\0') and (errno != ERANGE) and (value <= max);
+}
+
+}
+
+
+Batch::Batch(std::string jobFile, bool jit) : jobFile(jobFile), jit(jit) {
+  std::ifstream file(jobFile);
+  if (not file) {
+    printf("error: could not open %s\n", jobFile.c_str());
+    exit(1);
+  }
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(file, line)) {
+    parse(line.substr(0, line.find('#')), ++lineNumber);
+  }
+}
+
+void Batch::parse(const std::string & line, int lineNumber) {
+  std::istringstream fields(line);
+  std::vector<std::string> words;
+  std::string word;
+  while (fields >> word) {
+    words.push_back(word);
+  }
+  if (words.empty()) {
+    return;
+  }
+
+  auto error = [&](const char * what, const std::string & text) {
+    printf("error: %s:%d: %s '%s'\n", jobFile.c_str(), lineNumber, what, text.c_str());
+    exit(1);
+  };
+  if (words.size() < 4) {
+    error("expected file, load address, boot address and budget in", line);
+  }
+
+  Job job;
+  uint64_t value;
+  job.fileName = words[0];
+  if (not number(words[1], 0xFFFF, value))
+    error("bad load address", words[1]);
+  job.loadAddr = value;
+  if (not number(words[2], 0xFFFF, value))
+    error("bad boot address", words[2]);
+  job.bootAddr = value;
+  std::string budget = words[3];
+  job.cycles = (budget.back() == 'c');
+  if (job.cycles) {
+    budget.pop_back();
+  }
+  if (not number(budget, UINT64_MAX, job.budget))
+    error("bad budget", words[3]);
+
+  for (size_t i = 4; i < words.size(); i++) {
+    auto equals = words[i].find('=');
+    uint64_t address, expected;
+    if ((equals == std::string::npos) or
+        not number(words[i].substr(0, equals), 0xFFFF, address) or
+        not number(words[i].substr(equals + 1), 0xFF, expected)) {
+      error("bad memory check", words[i]);
+    }
+    job.checks.push_back({address, expected});
+  }
+
+  auto & image = images[job.fileName];
+  if (not image) {
+    image.reset(new FileImage(job.fileName));
+  }
+  if (image->size() > 65536u - job.loadAddr) {
+    error("does not fit at the load address", job.fileName);
+  }
+  job.image = image.get();
+  jobs.push_back(job);
+}
+
+
+void Batch::run(int threads, FILE * out) {
+  if (threads <= 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min<size_t>(threads, std::max<size_t>(jobs.size(), 1));
+
+  std::atomic<size_t> nextJob{0};
+  std::mutex outputLock;
+  std::vector<std::string> results(jobs.size());
+  size_t nextOutput = 0;
+
+  auto worker = [&]() {
+    std::unique_ptr<Memory> mem(new Memory);
+    std::unique_ptr<CPU> cpu(new CPU(*mem));
+    if (jit) {
+      cpu->jitOn(); // the interpreter if not supported
+    }
+    size_t index;
+    while ((index = nextJob++) < jobs.size()) {
+      std::string result = runJob(*cpu, *mem, index);
+      std::lock_guard<std::mutex> lock(outputLock);
+      results[index] = result;
+      while ((nextOutput < jobs.size()) and not results[nextOutput].empty()) {
+        fprintf(out, "%s\n", results[nextOutput].c_str());
+        results[nextOutput++].clear();
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto & thread : workers) {
+    thread.join();
+  }
+  fflush(out);
+}
+
+
+std::string Batch::runJob(CPU & cpu, Memory & mem, size_t index) {
+  auto & job = jobs[index];
+  mem.clear();
+  mem.loadData(job.loadAddr, job.image->data(), job.image->size());
+  cpu.reset(job.bootAddr);
+  uint64_t instructions = cpu.getInstructionCount();
+  uint64_t cycles = cpu.getCycleCount();
+
+  auto start = std::chrono::steady_clock::now();
+  auto reason = job.cycles ? cpu.runCycles(job.budget) : cpu.run(job.budget);
+  std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+
+  std::string failed;
+  for (auto & check : job.checks) {
+    uint8_t value = mem.peek(check.first);
+    if (value != check.second) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "{\"address\":\"%04X\",\"expected\":\"%02X\",\"value\":\"%02X\"}",
+               check.first, check.second, value);
+      failed += (failed.empty() ? "" : ",") + std::string(buf);
+    }
+  }
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), "\"stop\":\"%s\",\"pc\":\"%04X\",\"instructions\":%llu,"
+           "\"cycles\":%llu,\"ms\":%.3f,\"pass\":%s,",
+           stopReasonName(reason), cpu.PC,
+           (unsigned long long)(cpu.getInstructionCount() - instructions),
+           (unsigned long long)(cpu.getCycleCount() - cycles), ms.count(),
+           failed.empty() ? "true" : "false");
+  return "{\"job\":" + std::to_string(index) + ",\"file\":" + quote(job.fileName) + "," +
+         buf + "\"failed\":[" + failed + "]}";
+}
+
+}
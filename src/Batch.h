@@ -0,0 +1,74 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Batch mode: many independent programs on a pool of threads
+///
+/// A job list has one job per line, # starts a comment:
+///
+///    file  load address  boot address  budget  [address=value ...]
+///
+/// The budget is an instruction count, or a cycle count when it ends in
+/// 'c'. The address=value pairs are memory checks done after the run.
+/// Numbers are C style (0x400, 1024). Each worker thread has its own CPU
+/// and Memory and takes the next job when done with one, the binaries
+/// are loaded once and shared. Results are written as JSON lines in job
+/// order, see run()
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <FileImage.h>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class CPU;
+class Memory;
+
+namespace Sim6502 {
+
+struct Job {
+  std::string fileName;
+  const FileImage * image{nullptr};
+  uint16_t loadAddr{0};
+  uint16_t bootAddr{0};
+  uint64_t budget{0};
+  bool cycles{false}; ///< budget is in cycles, not instructions
+  std::vector<std::pair<uint16_t, uint8_t>> checks; ///< address, expected value
+};
+
+class Batch {
+public:
+  // Read the job list and the binaries. Errors are printed and exit
+  Batch(std::string jobFile, bool jit = false);
+
+  size_t size() const { return jobs.size(); }
+  const Job & job(size_t index) const { return jobs[index]; }
+
+  // Run the jobs on threads workers (0: one per core) and write a line
+  // per job to out, e.g.
+  // {"job":0,"file":"a.bin","stop":"LoopDetected","pc":"3469",
+  //  "instructions":30646177,"cycles":96247465,"ms":110.2,"pass":true,"failed":[]}
+  // failed lists the checks that did not match as
+  // {"address":"0200","expected":"F0","value":"00"}
+  void run(int threads, FILE * out);
+
+private:
+  void parse(const std::string & line, int lineNumber);
+
+  // Load, run and check the job, returns its result line
+  std::string runJob(CPU & cpu, Memory & mem, size_t index);
+
+  std::string jobFile;
+  bool jit;
+  std::vector<Job> jobs;
+  std::map<std::string, std::unique_ptr<FileImage>> images; ///< by file name
+};
+
+}
@@ -11,27 +11,70 @@
 ///    getInstruction()
 ///    handleInstruction()
 ///
-/// Individual opcodes are implemented in a bit switch statement
-/// in handleInstruction (CPU.cpp)
+/// Individual opcodes are dispatched through the handler table built
+/// in the constructor from the opcodes of the variant
 /// Some debugging functionality added
 //===----------------------------------------------------------------------===//
 
+#include <algorithm>
 #include <cassert>
 #include <CPU.h>
+#include <JIT.h>
 #include <Opcodes.h>
 
 // Constructor
-CPU::CPU(Memory & memory) : mem(memory) {
+CPU::CPU(Memory & memory, Variant variant)
+    : mem(memory), variant(variant),
+      decoded(65536, {decodeExecute, 0, NotDecoded, 0, 1, 0}) {
+  selectHandlers(mem.isFlat() ? Flat : Paged);
+  mem.setCodeObserver(this);
+  mem.setWatchObserver(this);
+};
+
+CPU::~CPU() {
+  mem.setCodeObserver(nullptr);
+  mem.setWatchObserver(nullptr);
+  delete jit;
+}
+
+
+void CPU::selectHandlers(Bus bus) {
+  auto & set = InstructionSets[bus][variant];
   // set default to an invalid opcode
   for (int i = 0; i < 256; i++) {
-    instset[i] = {0xFF, "---", Implied};
+    instset[i] = {0xFF, "---", opINVALID, Implied, invalid};
   }
   // fill in the implemented opcodes
-  for (auto & opc : Opcodes) {
-    assert(instset[opc.opcode].opcode == 0xFF);
+  for (int i = 0; i < set.numOpcodes; i++) {
+    auto & opc = set.opcodes[i];
+    assert(instset[opc.opcode].operation == opINVALID);
     instset[opc.opcode] = opc;
   }
-};
+  opcodeCycles = set.cycles;
+  fusions = set.fusions;
+  numFusions = set.numFusions;
+  for (int i = 0; i < numFusions; i++) {
+    fusionStart[fusions[i].opcodes[0]] = true;
+  }
+  codeModified(0, 65536);
+}
+
+// Only called between instructions: the handlers of flat memory cannot
+// map ROM or I/O (there is no I/O or port handler to call)
+void CPU::flatChanged(bool flat) {
+  selectHandlers(flat ? Flat : Paged);
+}
+
+
+bool CPU::jitOn() {
+  if (not JIT::supported()) {
+    return false;
+  }
+  if (jit == nullptr) {
+    jit = new JIT(*this);
+  }
+  return true;
+}
 
 
 // Sets registers and flags to zero
@@ -39,34 +82,465 @@ CPU::CPU(Memory & memory) : mem(memory) {
 // Sets program counter (PC) to value read from memory
 void CPU::reset(uint16_t start) {
   A = X = Y = 0;
-  Status.mask = 0;
+  setStatus(0);
   if (start != 0) {
     PC = start;
   } else {
-    PC = mem.readWord(power_on_reset_addr);
+    PC = mem.peekWord(power_on_reset_addr);
   }
   S = 0xFF; // SP = SPBase + S
 }
 
 
-void CPU::run(unsigned int n) {
-  while (running and (instructions < n)) {
+// Decoded groups and translated blocks containing the address are dropped
+// so they are rebuilt ending before it. Removing break points keeps the
+// shorter groups and blocks.
+void CPU::addBreakpoint(uint16_t addr) {
+  if (not isBreakpoint(addr)) {
+    bpBits[addr >> 6] |= uint64_t(1) << (addr & 63);
+    bpCount++;
+    codeModified(addr, 1);
+  }
+}
+
+void CPU::removeBreakpoint(uint16_t addr) {
+  if (isBreakpoint(addr)) {
+    bpBits[addr >> 6] &= ~(uint64_t(1) << (addr & 63));
+    bpCount--;
+  }
+}
+
+void CPU::clearBreakpoints() {
+  std::fill(std::begin(bpBits), std::end(bpBits), 0);
+  bpCount = 0;
+  bpRegMask = bpRegValue = 0;
+}
+
+void CPU::setBreakpointRegs(int A, int X, int Y) {
+  bpRegMask = bpRegValue = 0;
+  int shift = 0;
+  for (int value : {A, X, Y}) {
+    if (value != AnyValue) {
+      bpRegMask |= 0xFF << shift;
+      bpRegValue |= (value & 0xFF) << shift;
+    }
+    shift += 8;
+  }
+}
+
+
+// The run loops only compare the instruction count with the horizon, it
+// is computed here for each stretch of instructions. No instruction takes
+// more than MaxCycles, so a stretch of (cycles to the next event /
+// MaxCycles) instructions does not pass the event, the last instructions
+// before it are run one at a time. An IRQ held off by the I flag does not
+// shorten the stretch, CLI, PLP and RTI end it when they clear the flag
+// (see unmasked()). Exceptions and halt() move the horizon to zero, and so
+// do new interrupts and events.
+CPU::StopReason CPU::run(uint64_t n) {
+  stopReason = Budget;
+  uint64_t end = (n < UINT64_MAX - instructions) ? instructions + n : UINT64_MAX;
+  while ((stopReason == Budget) and (instructions < end)) {
+    handleEvents();
+    if (stopReason != Budget) {
+      break;
+    }
+    horizon = end;
+    if (events.next() != Scheduler::Never) {
+      horizon = std::min(end, instructions +
+                         std::max<uint64_t>(1, (events.next() - cycles) / MaxCycles));
+    }
+    setStatus(Status.mask);
+    stretches++;
+    while ((this->*RunLoops[runPolicy()])()) {
+      // continue with debug on
+    }
+    Status.mask = getStatus();
+  }
+  return stopReason;
+}
+
+
+// Same stretches as run(), but ending at the cycle budget too.
+// Whole iterations of an idle loop are skipped by counting their cycles
+// and instructions, up to the next event and not with debug checks
+// enabled. The loop is only probed if it cannot pass the event. After an
+// event the CPU is not idle until the loop is probed again.
+CPU::StopReason CPU::runCycles(uint64_t n) {
+  uint64_t end = (n < UINT64_MAX - cycles) ? cycles + n : UINT64_MAX;
+  StopReason reason = Budget;
+  bool idle = false;
+  while ((reason == Budget) and (cycles < end)) {
+    uint64_t until = std::min(end, events.next());
+    uint64_t loopCycles, loopInstructions;
+    if ((runPolicy() == Plain) and (cycles + MaxIdleLoop * MaxCycles < until) and
+        not interruptPending()) {
+      idle = idleLoop(loopCycles, loopInstructions);
+      if (stopReason != Budget) { // the probe ran into a loop or exception
+        return stopReason;
+      }
+      if (idle) {
+        uint64_t skip = (until - cycles) / loopCycles;
+        cycles += skip * loopCycles;
+        instructions += skip * loopInstructions;
+      }
+    }
+    if (cycles < end) {
+      uint64_t left = (cycles < until) ? until - cycles : 0;
+      reason = run(std::max<uint64_t>(1, left / MaxCycles));
+    }
+    idle = idle and (until == end);
+  }
+  return (idle and (reason == Budget)) ? Idle : reason;
+}
+
+
+void CPU::handleEvents() {
+  if (events.next() <= cycles) {
+    events.runDue(cycles);
+  }
+  if (nmiPending) {
+    nmiPending = false;
+    interrupt(nmi_vector_addr);
+  } else if ((irqLines != 0) and not Status.bits.I) {
+    interrupt(irq_vector_addr);
+  }
+}
+
+
+// Like BRK, but the pushed B flag is clear and PC is not advanced. Takes
+// seven cycles and is not counted as an instruction
+void CPU::interrupt(uint16_t vector) {
+  if (debugPrint) {
+    printf("%04X %s\n", PC, (vector == nmi_vector_addr) ? "NMI" : "IRQ");
+  }
+  stackPush(PC >> 8);
+  stackPush(PC & 0xFF);
+  stackPush((Status.mask & ~0x10) | 0x20);
+  Status.bits.I = 1;
+  if (variant == CMOS65C02) {
+    Status.bits.D = 0;
+  }
+  PC = mem.readWord(vector);
+  cycles += 7;
+  interrupts++;
+}
+
+
+bool CPU::idleLoop(uint64_t & loopCycles, uint64_t & loopInstructions) {
+  uint16_t start = PC;
+  uint8_t a = A, x = X, y = Y, s = S, p = Status.mask;
+  uint64_t startCycles = cycles;
+  uint64_t startInstructions = instructions;
+  stopReason = Budget;
+  setStatus(Status.mask);
+  bool idle = false;
+  for (int i = 0; (i < MaxIdleLoop) and idleInstruction(); i++) {
+    executeDecoded(instructions + 1); // never a fused group
+    if (stopReason != Budget) {
+      break;
+    }
+    if (PC == start) {
+      idle = (A == a) and (X == x) and (Y == y) and (S == s) and (getStatus() == p);
+      break;
+    }
+  }
+  Status.mask = getStatus();
+  loopCycles = cycles - startCycles;
+  loopInstructions = instructions - startInstructions;
+  return idle;
+}
+
+
+bool CPU::idleInstruction() {
+  auto & opc = instset[mem.peek(PC)];
+  uint16_t addr = operand(opc.mode, PC);
+  switch (opc.mode) {
+    case ZeroPageX: addr = address<Paged, ZeroPageX>(addr); break;
+    case ZeroPageY: addr = address<Paged, ZeroPageY>(addr); break;
+    case AbsoluteX: addr = address<Paged, AbsoluteX>(addr); break;
+    case AbsoluteY: addr = address<Paged, AbsoluteY>(addr); break;
+    case IndexedIndirect: addr = address<Paged, IndexedIndirect>(addr); break;
+    case IndirectIndexed: addr = address<Paged, IndirectIndexed>(addr); break;
+    case ZeroPageIndirect: addr = address<Paged, ZeroPageIndirect>(addr); break;
+    case Absolute: case ZeroPage: break;
+    default: addr = 0; break; // no data access
+  }
+  if (mem.isIo(addr)) { // devices change without events
+    return false;
+  }
+  switch (opc.operation) {
+    case opSTA:
+    case opSTX:
+    case opSTY:
+    case opSTZ:
+    case opSAX: {
+      uint8_t value = (opc.operation == opSTA) ? A : (opc.operation == opSTX) ? X :
+                      (opc.operation == opSTY) ? Y : (opc.operation == opSAX) ? A & X : 0;
+      return mem.peek(addr) == value;
+    }
+    case opINC:
+    case opDEC:
+    case opTRB:
+    case opTSB:
+    case opRMB:
+    case opSMB:
+    case opSLO:
+    case opRLA:
+    case opSRE:
+    case opRRA:
+    case opDCP:
+    case opISC:
+      return false;
+    case opASL:
+    case opLSR:
+    case opROL:
+    case opROR:
+      return opc.mode == Accumulator;
+    case opPHA:
+    case opPHP:
+    case opPHX:
+    case opPHY:
+    case opPLA:
+    case opPLP:
+    case opPLX:
+    case opPLY:
+    case opJSR:
+    case opRTS:
+    case opRTI:
+    case opBRK:
+    case opTXS:
+    case opSTP:
+    case opINVALID:
+      return false;
+    default:
+      return true;
+  }
+}
+
+
+// Without debug, register break points, pair statistics or watch points
+// the fast loops run until the horizon, the trace address or a break point
+// address
+template <int policy>
+bool CPU::runLoop() {
+  const bool fast = (policy & (Debug | RegBreakpoints | PairStats | Watchpoints)) == 0;
+  const int stops = policy & (StopAtTrace | Breakpoints);
+
+  while (instructions < horizon) {
+    uint16_t addr = PC;
     uint8_t instruction = getInstruction();
-    handleInstruction(instruction);
-    instructions++;
+    if (fast and (jit != nullptr)) {
+      runJit<stops>();
+    } else if (fast) {
+#ifdef THREADED_CORE
+      runThreaded<stops>();
+#else
+      runDecoded<stops>();
+#endif
+    } else if (policy & Debug) {
+      traceInstruction(instruction);
+      instructions++;
+    } else {
+      executeDecoded(instructions + 1); // never a fused group
+    }
+
+    if (policy & PairStats) {
+      if (addr == pairNext) {
+        pairCount[pairPrev << 8 | instruction]++;
+      }
+      pairPrev = instruction;
+      pairNext = addr + length(instset[instruction].mode);
+    }
+
+    if ((policy & Watchpoints) and (stopReason == Watchpoint)) {
+      watchHit.pc = addr;
+      return false;
+    }
 
-    if (bpCheck()) {
-      printf("<< BREAK >>\n");
+    bool traceStart = (policy & StopAtTrace) and (PC == trcAddr);
+    if (traceStart) {
+      debugOn();
+    }
+
+    if ((policy & (Breakpoints | RegBreakpoints)) and bpCheck<policy>()) {
+      halt(Breakpoint);
+      return false;
+    }
+
+    if (traceStart) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#define RUN_LOOPS(n) \
+  &CPU::runLoop<n>,     &CPU::runLoop<n + 1>, &CPU::runLoop<n + 2>, &CPU::runLoop<n + 3>, \
+  &CPU::runLoop<n + 4>, &CPU::runLoop<n + 5>, &CPU::runLoop<n + 6>, &CPU::runLoop<n + 7>
+
+const CPU::RunLoop CPU::RunLoops[64] = {
+  RUN_LOOPS(0),  RUN_LOOPS(8),  RUN_LOOPS(16), RUN_LOOPS(24),
+  RUN_LOOPS(32), RUN_LOOPS(40), RUN_LOOPS(48), RUN_LOOPS(56)
+};
+
+
+// Same as handleInstruction() but with the instructions taken from the
+// decode cache
+template <int policy>
+void CPU::runDecoded() {
+  while (instructions < horizon) {
+    executeDecoded(horizon);
+
+    if (stopHere<policy>()) {
       return;
     }
   }
 }
 
+
+Decoded & CPU::decode(uint16_t addr) {
+  uint8_t opcode = mem.peek(addr);
+  auto & opc = instset[opcode];
+  auto & inst = decoded[addr];
+
+  inst.handler = opc.handler;
+  inst.operand = operand(opc.mode, addr);
+  inst.opcode = opcode;
+  inst.length = length(opc.mode);
+  inst.count = 1;
+  inst.cycles = opcodeCycles[opcode];
+
+  mem.markCode(addr);
+  mem.markCode(addr + inst.length - 1);
+  fuse(addr);
+  recognizeLoop(addr);
+  return inst;
+}
+
+
+// Sequences are not fused across the trace address or break points, or if
+// they end with a branch to itself (loop detection). The operands of the instructions
+// after the first are decoded into their own cache entries.
+void CPU::fuse(uint16_t addr) {
+  if (not fusionStart[mem.peek(addr)]) {
+    return;
+  }
+  for (int i = 0; i < numFusions; i++) {
+    auto & fusion = fusions[i];
+    uint32_t next = addr;
+    uint32_t last = addr;
+    int matched = 0;
+    while ((matched < fusion.count) and (next < 0xFFF0)) {
+      if ((mem.peek(next) != fusion.opcodes[matched]) or
+          ((matched > 0) and stopsAt(next))) {
+        break;
+      }
+      last = next;
+      next += length(instset[fusion.opcodes[matched]].mode);
+      matched++;
+    }
+    if ((matched < fusion.count) or (next - addr > MaxDecodedLength)) {
+      continue;
+    }
+    auto & lastOpc = instset[fusion.opcodes[fusion.count - 1]];
+    if ((lastOpc.mode == Relative) and (operand(Relative, last) == last)) {
+      continue;
+    }
+
+    uint32_t inner = addr + length(instset[fusion.opcodes[0]].mode);
+    for (int k = 1; k < fusion.count; k++) {
+      if (decoded[inner].opcode == NotDecoded) {
+        decode(inner);
+      }
+      inner += length(instset[fusion.opcodes[k]].mode);
+    }
+    auto & inst = decoded[addr];
+    inst.handler = fusion.handler;
+    inst.opcode = FusedGroup;
+    inst.length = next - addr;
+    inst.count = fusion.count;
+    inst.cycles = 0;
+    for (int k = 0; k < fusion.count; k++) {
+      inst.cycles += opcodeCycles[fusion.opcodes[k]];
+    }
+    mem.markCode(next - 1);
+    return;
+  }
+}
+
+
+// Executes the first instruction only, the caller counts one instruction
+void CPU::decodeExecute(CPU * cpu, uint16_t unused) {
+  auto & inst = cpu->decode(cpu->PC);
+  uint8_t opcode = cpu->mem.peek(cpu->PC);
+  cpu->cycles += cpu->opcodeCycles[opcode];
+  cpu->instset[opcode].handler(cpu, inst.operand);
+}
+
+
+// The first access stops run(), the run loop fills in the address of the
+// instruction
+void CPU::watchTriggered(uint16_t address, uint8_t value, bool write) {
+  if (stopReason != Watchpoint) {
+    watchHit = {address, value, write, PC};
+    halt(Watchpoint);
+  }
+}
+
+
+// An instruction or fused group can start up to MaxDecodedLength - 1
+// bytes before the modified memory
+void CPU::codeModified(uint16_t address, uint32_t length) {
+  if (jit != nullptr) {
+    jit->invalidate(address, length);
+  }
+  const int before = MaxDecodedLength - 1;
+  if (length >= 65536 - before) {
+    decoded.assign(65536, {decodeExecute, 0, NotDecoded, 0, 1, 0});
+    return;
+  }
+  for (uint32_t i = 0; i < length + before; i++) {
+    auto & inst = decoded[uint16_t(address - before + i)];
+    if ((int)i - before + inst.length > 0) {
+      inst = {decodeExecute, 0, NotDecoded, 0, 1, 0};
+    }
+  }
+}
+
+void CPU::printPairStats(int n) {
+  std::vector<std::pair<uint64_t, int>> pairs;
+  uint64_t total = 0;
+  for (int i = 0; i < (int)pairCount.size(); i++) {
+    if (pairCount[i] != 0) {
+      pairs.push_back({pairCount[i], i});
+      total += pairCount[i];
+    }
+  }
+  std::sort(pairs.begin(), pairs.end(), std::greater<std::pair<uint64_t, int>>());
+
+  printf("instruction pairs: %llu\n", (unsigned long long)total);
+  for (int i = 0; (i < n) and (i < (int)pairs.size()); i++) {
+    uint8_t first = pairs[i].second >> 8;
+    uint8_t second = pairs[i].second & 0xFF;
+    bool fused = false;
+    for (int f = 0; f < numFusions; f++) {
+      fused |= (fusions[f].opcodes[0] == first) and (fusions[f].opcodes[1] == second);
+    }
+    printf("%02X %02X  %s %s %12llu %5.1f%% %s\n", first, second,
+           instset[first].mnem, instset[second].mnem,
+           (unsigned long long)pairs[i].first, 100.0 * pairs[i].first / total,
+           fused ? "fused" : "");
+  }
+}
+
+
 // Prints PC, SP, registers and flags
 void CPU::printRegisters() {
   if (not debugPrint)
     return;
 
+  Status.mask = getStatus();
   printf(" ; 0x%04X(%03X): A:%02X  X:%02X  Y:%02X ", PC, getSPAddr(), A, X, Y);
   printf(" [%c%c%c%c%c%c%c] ",
       Status.bits.C ? 'c' : ' ' ,
@@ -79,20 +553,23 @@ void CPU::printRegisters() {
 }
 
 // Make a disassembler-like listing of the current command
-void CPU::disAssemble(uint16_t addr, Opcode opc, uint8_t byte, uint8_t byte2, uint16_t word) {
+void CPU::disAssemble(uint16_t addr, const Opcode & opc) {
   if (not debugPrint)
     return;
 
-  int nbops = operands(opc.mode);
+  uint8_t byte = mem.peek(addr + 1);
+  uint8_t byte2 = mem.peek(addr + 2);
+  uint16_t word = byte + byte2 * 256;
+  int nbops = length(opc.mode);
   if (nbops == 1) {
-    printf("%04X %02X       ", addr, opc.opcode);
+    printf("%04X %02X       ", addr, mem.peek(addr));
   } else if (nbops == 2) {
-    printf("%04X %02X %02X    ", addr, opc.opcode, byte);
+    printf("%04X %02X %02X    ", addr, mem.peek(addr), byte);
   } else {
-    printf("%04X %02X %02X %02X ", addr, opc.opcode, byte, byte2);
+    printf("%04X %02X %02X %02X ", addr, mem.peek(addr), byte, byte2);
   }
 
-  printf("%s ", opc.mnem.c_str());
+  printf("%s ", opc.mnem);
 
   switch (opc.mode) {
     case IndexedIndirect:
@@ -114,7 +591,7 @@ void CPU::disAssemble(uint16_t addr, Opcode opc, uint8_t byte, uint8_t byte2, ui
     }
     break;
     case ZeroPage: {
-      uint8_t val = mem.readByte(byte);
+      uint8_t val = mem.peek(byte);
       printf("$%02X(%3d)    ", byte, val);
     }
     break;
@@ -139,32 +616,16 @@ void CPU::disAssemble(uint16_t addr, Opcode opc, uint8_t byte, uint8_t byte2, ui
     case Indirect:
       printf("($%04X)     ", word);
       break;
-  }
-}
-
-// 1, 2 or 3 byte opcode ?
-int CPU::operands(AMode mode) {
-  switch (mode) {
-    case Implied:
-    case Accumulator:
-      return 1;
-      break;
-
-    case IndexedIndirect:
-    case IndirectIndexed:
-    case Relative:
-    case ZeroPage:
-    case ZeroPageX:
-    case ZeroPageY:
-    case Immediate:
-      return 2;
+    case ZeroPageIndirect:
+      printf("($%02X)       ", byte);
       break;
-
-    case Absolute:
-    case AbsoluteX:
-    case AbsoluteY:
-    case Indirect:
-      return 3;
+    case AbsoluteIndexedIndirect:
+      printf("($%04X,X)   ", word);
       break;
+    case ZeroPageRelative: {
+      uint16_t addr = PC + int8_t(byte2) + 3;
+      printf("$%02X,$%04X   ", byte, addr);
+    }
+    break;
   }
 }
@@ -11,8 +11,21 @@
 ///    getInstruction()
 ///    handleInstruction()
 ///
-/// Individual opcodes are implemented in a big switch statement
-/// in handleInstruction (CPU.cpp)
+/// Individual opcodes are dispatched through a 256 entry table of
+/// handlers. The handlers are generated from OPCODE_TABLE (Opcodes.h) by
+/// instantiating CPU::execute<variant, bus, operation, mode>
+/// (CPUInstructions.cpp), each variant (NMOS 6502, 65C02, 2A03) has its
+/// own table selected by the constructor. While only RAM is mapped the
+/// table of handlers reading it directly is used (Bus, Memory::isFlat())
+/// Instructions are decoded once into a cache indexed by address, writes
+/// to memory holding decoded instructions invalidate the cache entries.
+/// Common instruction sequences are fused into a single cache entry.
+/// Loops copying, filling or comparing memory are executed at once, see
+/// CPULoops.cpp
+/// The C, Z, V and N flags are evaluated lazily, instructions store the
+/// values the flags are derived from instead of updating Status.
+/// Devices raise IRQ and NMI and schedule events at cycle counts, run()
+/// handles them between stretches of instructions ending at the next event
 /// Support for line-by-line disassembly and register output
 //===----------------------------------------------------------------------===//
 
@@ -20,47 +33,150 @@
 
 #include <Memory.h>
 #include <Opcodes.h>
+#include <Scheduler.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
-class CPU {
+class JIT;
+
+class CPU : public CodeObserver, public WatchObserver {
 public:
 
-  // Load instructions into array, reset cpu registers
-  CPU(Memory & memory);
+  // Load the instructions of the variant into array, reset cpu registers
+  CPU(Memory & memory, Variant variant = NMOS6502);
+
+  ~CPU();
+
+  // Why run() and runCycles() returned
+  enum StopReason {
+    Budget,        ///< the instructions or cycles were executed
+    Idle,          ///< the cycles were used polling in an idle loop
+    Breakpoint,    ///< a break point was hit
+    Watchpoint,    ///< a watched address was accessed, see getWatchHit()
+    IllegalOpcode, ///< opcode not implemented, PC is after the opcode
+    LoopDetected,  ///< instruction jumped or branched to itself
+    Halted,        ///< halt() was called
+  };
+
+  // fetch-execute loop for n more instructions or until a break point or
+  // exception. Runs a loop with only the enabled debug checks compiled in
+  StopReason run(uint64_t n);
 
-  // fetch-execute loop until instruction count, break point or exception
-  void run(unsigned int n) ;
+  // Run for (at least) n more cycles, stops at the first instruction
+  // boundary at or after n cycles, a break point or an exception.
+  // Fast-forwards through idle loops (see idleLoop()) and returns Idle
+  StopReason runCycles(uint64_t n);
+
+  // Stop run() after the current instruction (or translated block), e.g.
+  // from a memory access hook
+  void halt(StopReason reason = Halted) {
+    stopReason = reason;
+    horizon = 0;
+  }
 
   // Reset CPU - clear registers, set program counter
   void reset(uint16_t addr);
 
 
+  // IRQ input, level triggered: taken between instructions while any
+  // source holds the line and the I flag is clear. Devices use their own
+  // source bit and release the line when the interrupt is acknowledged
+  void setIRQ(bool active, uint32_t source = 1) {
+    irqLines = active ? (irqLines | source) : (irqLines & ~source);
+    if (active) {
+      horizon = 0; // take it after the current instruction
+    }
+  }
+
+  // NMI input, edge triggered: taken once when the line becomes active
+  void setNMI(bool active) {
+    if (active and not nmiLine) {
+      nmiPending = true;
+      horizon = 0;
+    }
+    nmiLine = active;
+  }
+
+  // Call callback at the first instruction boundary at or after cycle,
+  // see Scheduler. Returns an id for cancelEvent()
+  uint64_t schedule(uint64_t cycle, Scheduler::Callback callback) {
+    horizon = 0; // the next event may be earlier than the horizon
+    return events.schedule(cycle, callback);
+  }
+
+  void cancelEvent(uint64_t id) { events.cancel(id); }
+
+
   // Enables disassembly and register printing
   void debugOn() { debugPrint = true; }
 
+  // Enables the basic block compiler, returns false if not supported
+  bool jitOn();
+
+  // Count pairs of adjacent executed instructions (slows down execution)
+  void pairStatsOn() { pairCount.assign(65536, 0); }
+
+  // Print the n most executed instruction pairs
+  void printPairStats(int n);
+
   // return the number of executed instructions
   uint64_t getInstructionCount() { return instructions; }
 
-  void clearInstructionCount() { instructions = 0; }
+  // return the number of elapsed cycles
+  uint64_t getCycleCount() { return cycles; }
+
+  // return the number of IRQs and NMIs taken
+  uint64_t getInterruptCount() { return interrupts; }
 
+  Variant getVariant() { return variant; }
 
+
+  static constexpr uint16_t NoTraceAddr{0xFFFF};
+
+  // Fused instructions and translated blocks end at the trace address,
+  // NoTraceAddr disables tracing
   void setTraceAddr(uint16_t addr) {
     trcAddr = addr;
+    codeModified(0, 65536);
   }
 
-  void setBreakpointAddr(uint16_t addr) {
-    bpAddrCheck = true;
-    bpAddr = addr;
-  }
+  // Execution break points: run() stops when PC reaches the address,
+  // after executing at least one instruction
+  void addBreakpoint(uint16_t addr);
 
-  void setBreakpointRegs(uint8_t A, uint8_t X, uint8_t Y) {
-    bpRegCheck = true;
-    bpA = A;
-    bpX = X;
-    bpY = Y;
-  }
+  void removeBreakpoint(uint16_t addr);
+
+  void clearBreakpoints();
+
+  static constexpr int AnyValue{-1};
+
+  // Break when the registers have these values (AnyValue matches all).
+  // With break point addresses this is a condition on them, else it is
+  // checked after every instruction
+  void setBreakpointRegs(int A, int X, int Y);
+
+  // Watch points: run() stops after the instruction reading or writing
+  // (Memory::Read, Memory::Write) the address. Opcode and operand fetches
+  // are not watched. Execution uses the step loop while watch points are set
+  void addWatchpoint(uint16_t addr, int access) { mem.addWatch(addr, access); }
+
+  void removeWatchpoint(uint16_t addr, int access) { mem.removeWatch(addr, access); }
+
+  void clearWatchpoints() { mem.clearWatches(); }
+
+  // The access that stopped run() with Watchpoint
+  struct WatchHit {
+    uint16_t address; ///< watched address
+    uint8_t value;    ///< value read or written
+    bool write;       ///< write access?
+    uint16_t pc;      ///< address of the accessing instruction
+  };
+
+  const WatchHit & getWatchHit() { return watchHit; }
 
 
   //
@@ -69,18 +185,50 @@ public:
   //
 
   // Returns the number of implemented opcodes
-  int getNumOpcodes() { return Opcodes.size(); }
+  int getNumOpcodes() { return InstructionSets[Paged][variant].numOpcodes; }
 
   // get value of Stack Pointer (SP)
   uint16_t getSPAddr() { return SPBase + S; }
 
   // reads the next instruction from memory
-  uint8_t getInstruction() { return mem.readByte(PC); }
+  uint8_t getInstruction() { return mem.peek(PC); }
+
+  // Stretches of instructions run() has run, see run()
+  uint64_t getStretchCount() { return stretches; }
 
-  // execute an instruction
+  // Is the loop starting at addr executed at once (see recognizeLoop())?
+  bool isLoop(uint16_t addr) { return decoded[addr].opcode == LoopGroup; }
+
+  // execute an instruction, returns false if it stopped execution
+  // (illegal opcode or loop). Events and interrupts are not handled
   bool handleInstruction(uint8_t instruction);
 
-  // CPU registers
+  // fetch-execute loop using the decode cache up to the horizon, no debug.
+  // Stops at the trace address if policy is StopAtTrace, at break point
+  // addresses if policy is Breakpoints
+  template <int policy> void runDecoded();
+
+  // direct threaded version of runDecoded()
+  template <int policy> void runThreaded();
+
+  // runThreaded() for one variant and bus, its handlers are inlined
+  template <int policy, Variant variant, Bus bus> void runThreadedVariant();
+
+  // version of runDecoded() executing blocks translated by the JIT
+  template <int policy> void runJit();
+
+  // invalidate decoded instructions overlapping the modified memory
+  void codeModified(uint16_t address, uint32_t length) override;
+
+  // switch to the handlers reading memory through the other Bus
+  void flatChanged(bool flat) override;
+
+  // record the access and stop after the current instruction
+  void watchTriggered(uint16_t address, uint8_t value, bool write) override;
+
+  // CPU registers. C, Z, V and N in Status are up to date when run() or
+  // handleInstruction() return, changes to Status are picked up when they
+  // are called
   uint8_t A, X, Y, S;
   uint16_t PC;
   union {
@@ -99,304 +247,467 @@ public:
 
 
 private:
+  friend class JIT;
+
+  // Checks compiled into a run loop, see runLoop()
+  enum RunPolicy {
+    Plain          = 0,
+    StopAtTrace    = 1, ///< return when PC reaches the trace address
+    Debug          = 2, ///< disassembly and register output
+    Breakpoints    = 4, ///< return when PC reaches a break point address
+    PairStats      = 8, ///< count instruction pairs
+    RegBreakpoints = 16, ///< register check after each instruction
+    Watchpoints    = 32, ///< watched memory accesses
+  };
+
   const uint16_t SPBase{0x0100}; // Stack Pointer base address
   const uint16_t power_on_reset_addr{0xFFFC};
+  const uint16_t nmi_vector_addr{0xFFFA};
+  const uint16_t irq_vector_addr{0xFFFE};
 
   Memory & mem;
 
+  const Variant variant;
+
   Opcode instset[256];
+  const uint8_t * opcodeCycles; ///< Cycles or CyclesCMOS
+
+  const Fusion * fusions;       ///< fused sequences of the variant
+  int numFusions;
+
+  std::vector<Decoded> decoded; ///< decode cache, indexed by address
+
+  JIT * jit{nullptr}; ///< basic block compiler, if enabled
+
+  // Lazily evaluated flags, see getStatus()
+  uint8_t resultZ{1};  ///< Z is set if zero
+  uint8_t resultN{0};  ///< N is bit 7
+  uint8_t carry{0};    ///< C, 0 or 1
+  uint8_t overflow{0}; ///< V is set if not zero
+
+  static constexpr int MaxDecodedLength{12}; ///< bytes of a fused group or loop
+  bool fusionStart[256]{}; ///< opcode starts a fused sequence?
+
+  static constexpr int MaxLoopInstructions{8};
+
+  // The instructions of a recognized loop, the last branches back to the
+  // first, see recognizeLoop()
+  struct Loop {
+    uint8_t count;                          ///< number of instructions
+    uint8_t opcodes[MaxLoopInstructions];
+    uint16_t operands[MaxLoopInstructions];
+    int8_t delta[2];                        ///< X and Y change per iteration
+    uint8_t test;                           ///< sets the flags for the branch back
+  };
+
+  std::unordered_map<uint16_t, Loop> loops; ///< recognized loops by address
+
+  std::vector<uint64_t> pairCount; ///< by opcode pair, if enabled
+  uint8_t pairPrev{0};             ///< opcode of previous instruction
+  uint16_t pairNext{0};            ///< address following previous instruction
 
   // Program behaviour - debug print and breakpoints
-  bool running{true};       ///< set to false when illegal/unimplemented inst.
+  StopReason stopReason{Budget}; ///< why the run loops stopped, see halt()
+  uint64_t horizon{0};      ///< run loops stop at this instruction count
   bool debugPrint{false};   ///< whether to print disassembly and registers
-  bool bpAddrCheck{false};  ///< check for breakpoint on address?
-  bool bpRegCheck{false};   ///< check for breakpoint on registers?
-  uint16_t bpAddr;          ///< break point PC address
-  uint8_t bpA, bpX, bpY;    ///< break point register values
+  uint64_t bpBits[65536 / 64]{}; ///< break point addresses, one bit each
+  int bpCount{0};           ///< number of break point addresses
+  uint32_t bpRegMask{0};    ///< registers (A | X << 8 | Y << 16) compared
+  uint32_t bpRegValue{0};   ///< and their values
+  WatchHit watchHit{};      ///< last watched access
   uint64_t instructions{0}; ///< instruction count
-  uint16_t trcAddr{0xFFFF}; ///< start trace PC address
+  uint64_t cycles{0};       ///< cycle count
+
+  Scheduler events;         ///< device events by cycle
+  uint32_t irqLines{0};     ///< IRQ sources holding the line
+  bool nmiLine{false};      ///< NMI line state, for edge detection
+  bool nmiPending{false};   ///< NMI edge not yet taken
+  uint64_t interrupts{0};   ///< interrupts taken
+  uint64_t stretches{0};    ///< run loop calls of run()
+  uint16_t trcAddr{NoTraceAddr}; ///< start trace PC address
 
 
   // push an 8-bit value onto the stack (wraps around)
   void stackPush(uint8_t val) {
-    mem.writeByte(getSPAddr(), val);
+    mem.writeStack(S, val);
     S--;
   }
 
   // pop a 8-bit value from the stack (wraps around)
-  uint8_t stackPop() {
+  template <Bus bus> uint8_t stackPop() {
     S++;
-    return mem.readByte(getSPAddr());
+    return (bus == Flat) ? mem.mem[SPBase | S] : mem.readStack(S);
   }
 
+  template <Bus bus> uint8_t read(uint16_t addr) {
+    return (bus == Flat) ? mem.mem[addr] : mem.readByte(addr);
+  }
+
+  // Little endian word, wraps around at $FFFF
+  template <Bus bus> uint16_t readWord(uint16_t addr) {
+    return read<bus>(addr) | read<bus>(uint16_t(addr + 1)) << 8;
+  }
+
+  // Pointer in zero page, the high byte of a pointer at $FF is read from
+  // $00
+  template <Bus bus> uint16_t zeroPageWord(uint8_t addr) {
+    return readMemory<bus, ZeroPage>(addr) |
+           readMemory<bus, ZeroPage>(uint8_t(addr + 1)) << 8;
+  }
+
+  static constexpr bool isZeroPage(AMode mode) {
+    return (mode == ZeroPage) or (mode == ZeroPageX) or (mode == ZeroPageY) or
+           (mode == ZeroPageRelative);
+  }
 
-  // returns the number of operands for opcode (to adjust PC)
-  int operands(AMode mode);
+  // Data accesses of an instruction, zero page accesses skip the page
+  // pointers (see Memory::readZeroPage())
+  template <Bus bus, AMode mode> uint8_t readMemory(uint16_t addr) {
+    return (bus == Paged and isZeroPage(mode)) ? mem.readZeroPage(addr) : read<bus>(addr);
+  }
+
+  template <AMode mode> void writeMemory(uint16_t addr, uint8_t value) {
+    if (isZeroPage(mode)) {
+      mem.writeZeroPage(addr, value);
+    } else {
+      mem.writeByte(addr, value);
+    }
+  }
+
+
+  // 1, 2 or 3 byte opcode? (opcode + operands, to adjust PC)
+  static constexpr int length(AMode mode) {
+    return (mode == Implied or mode == Accumulator) ? 1 :
+           (mode == Absolute or mode == AbsoluteX or mode == AbsoluteY or
+            mode == Indirect or mode == AbsoluteIndexedIndirect or
+            mode == ZeroPageRelative) ? 3 : 2;
+  }
 
   // output disassembled instructions
-  void disAssemble(uint16_t addr, Opcode opc, uint8_t byte, uint8_t byte2, uint16_t word);
+  void disAssemble(uint16_t addr, const Opcode & opc);
 
   // append registers and flags to disassembly
   void printRegisters();
 
 
-  // Break Point determination
-  bool bpCheck() {
-    if (bpAddrCheck and bpRegCheck) {
-      if ((PC >= bpAddr) and (bpA == A) and (bpX == X) and (bpY == Y)) {
-        return true;
-      }
-    } else if (bpAddrCheck) {
-      if (PC >= bpAddr) {
-        return true;
-      }
-    } else if (bpRegCheck) {
-      if ((bpA == A) and (bpX == X) and (bpY == Y)) {
-        return true;
-      }
+  // Would an interrupt be taken at this instruction boundary?
+  bool interruptPending() {
+    return nmiPending or ((irqLines != 0) and not Status.bits.I);
+  }
+
+  // After CLI, PLP and RTI, the only instructions clearing I: a held IRQ
+  // ends the stretch so it is taken after the instruction
+  void unmasked() {
+    if ((irqLines != 0) and not Status.bits.I) {
+      horizon = std::min(horizon, instructions + 1);
     }
-    return false;
   }
 
+  // Calls the events due and takes a pending interrupt. Called between
+  // stretches of instructions, Status is up to date
+  void handleEvents();
+
+  // Push PC and status (B clear), set I (and clear D on the 65C02) and
+  // continue at the vector
+  void interrupt(uint16_t vector);
+
+  // Checks needed by the current debug settings
+  int runPolicy() {
+    return (debugPrint ? Debug : (trcAddr != NoTraceAddr) ? StopAtTrace : Plain) |
+           ((bpCount > 0) ? Breakpoints : (bpRegMask != 0) ? RegBreakpoints : Plain) |
+           (pairCount.empty() ? Plain : PairStats) |
+           (mem.hasWatches() ? Watchpoints : Plain);
+  }
+
+  bool isBreakpoint(uint16_t addr) {
+    return (bpBits[addr >> 6] >> (addr & 63)) & 1;
+  }
+
+  // Fused groups and translated blocks end before these addresses
+  bool stopsAt(uint16_t addr) {
+    return (addr == trcAddr) or isBreakpoint(addr);
+  }
+
+  // Does a fast loop with this policy return at PC?
+  template <int policy> bool stopHere() {
+    return ((policy & StopAtTrace) and (PC == trcAddr)) or
+           ((policy & Breakpoints) and isBreakpoint(PC));
+  }
+
+  // Fetch-execute loop for one policy up to the horizon. Returns true when
+  // it stopped at the trace address and turned on debug
+  template <int policy> bool runLoop();
+
+  // The run loops indexed by policy
+  typedef bool (CPU::*RunLoop)();
+  static const RunLoop RunLoops[64];
+
+  // handleInstruction() for the run loop, flags are not copied to Status
+  void traceInstruction(uint8_t instruction);
+
+  // Break Point determination, the register condition matches if unset
+  template <int policy> bool bpCheck() {
+    return ((policy & RegBreakpoints) or isBreakpoint(PC)) and
+           (((A | X << 8 | Y << 16) & bpRegMask) == bpRegValue);
+  }
+
+
+  // Status register with the lazily evaluated flags filled in
+  uint8_t getStatus() {
+    return (Status.mask & 0x3C) | carry | ((resultZ == 0) << 1) |
+           ((overflow != 0) << 6) | (resultN & 0x80);
+  }
+
+  // Set the status register and the lazily evaluated flags
+  void setStatus(uint8_t mask) {
+    Status.mask = mask;
+    carry = mask & 0x01;
+    resultZ = (~mask) & 0x02;
+    overflow = mask & 0x40;
+    resultN = mask;
+  }
 
   // Updates zero (Z) and negative (N) flags based on value
   void updateStatusZN(uint8_t value) {
-    Status.bits.Z = 0;
-    Status.bits.N = 0;
-    if (value == 0) {
-      Status.bits.Z = 1;
-    }
-    if (value & 0x80) {
-      Status.bits.N = 1;
-    }
+    resultZ = value;
+    resultN = value;
   }
 
   // Update flags based on compare operation
   void updateCompare(uint8_t & reg, uint8_t value) {
-    Status.bits.C = 0;
-    Status.bits.N = 0;
-    Status.bits.Z = 0;
-    unsigned int tmp = reg - value;
-  	if (reg >= value) {
-      Status.bits.C = 1;
-    }
-  	if (tmp & 0x80) {
-      Status.bits.N = 1;
-    }
-  	if (reg == value) {
-      Status.bits.Z = 1;
-    }
-  	return;
+    carry = (reg >= value);
+    updateStatusZN(reg - value);
   }
 
   // Common helpers for similar opcodes
-  int addcarry(uint8_t & reg, uint8_t val);
-  int subcarry(uint8_t & unused, uint8_t M);
-  int16_t jumpRelative(uint8_t val);
-  void ror(uint16_t addr);
-  void rol(uint16_t addr);
-  void lsr(uint16_t addr);
-  void asl(uint16_t addr);
-  void andMem(uint16_t addr);
-  void eorMem(uint16_t addr);
-  void oraMem(uint16_t addr);
+  template <Variant variant> int addcarry(uint8_t & reg, uint8_t val);
+  template <Variant variant> int subcarry(uint8_t & unused, uint8_t M);
+  template <Variant variant> void arr(uint8_t val);
+
+  // Set reg and the flags from a DecimalALU::Result
+  template <Variant variant> void decimalResult(uint8_t & reg, uint32_t result);
+
+  int16_t jumpRelative(uint8_t val) {
+    return int8_t(val);
+  }
+
+  // Operations that can leave PC at the instruction (a loop), see execute()
+  static constexpr bool canLoop(Operation op) {
+    return op == opBCC or op == opBCS or op == opBEQ or op == opBMI or
+           op == opBNE or op == opBPL or op == opBVC or op == opBVS or
+           op == opJMP or op == opJSR or op == opRTS or op == opRTI or
+           op == opBRK or op == opBRA or op == opBBR or op == opBBS;
+  }
+
+  // Taken branch, one cycle more and another if target is on another page
+  void branch(uint16_t target) {
+    cycles += ((target ^ PC) > 0xFF) ? 2 : 1;
+    PC = target;
+  }
+
+  uint8_t ror(uint8_t val) {
+    uint8_t oldCarry = carry;
+    carry = (val & 0x01); // bit 0 -> Carry
+    val = (val >> 1) | (oldCarry << 7);
+    updateStatusZN(val);
+    return val;
+  }
+
+  uint8_t rol(uint8_t val) {
+    uint8_t oldCarry = carry;
+    carry = (val >> 7); // bit 7 -> Carry
+    val = (val << 1) | oldCarry;
+    updateStatusZN(val);
+    return val;
+  }
+
+  uint8_t lsr(uint8_t val) {
+    carry = val & 0x01;
+    val = val >> 1;
+    updateStatusZN(val);
+    return val;
+  }
+
+  uint8_t asl(uint8_t val) {
+    carry = (val >> 7);
+    val = val << 1;
+    updateStatusZN(val);
+    return val;
+  }
 
   void transfer(uint8_t & src, uint8_t & dst) {
     dst = src;
     updateStatusZN(dst);
   }
 
-  static int load(CPU * cpu, uint8_t & reg) {
-    cpu->updateStatusZN(reg);
-    return 0;
-  }
-
-  static int inc(CPU * cpu, uint8_t & reg) {
-    reg = reg + 1;
-    cpu->updateStatusZN(reg);
-    return 0;
-  }
-
-  static int dec(CPU * cpu, uint8_t & reg) {
-    reg = reg - 1;
-    cpu->updateStatusZN(reg);
-    return 0;
-  }
-
-  static int na(CPU * cpu, uint8_t & reg) {
-    printf("Not implemented\n");
-    exit(0);
-    return 0;
-  }
-
-  // https://www.masswerk.at/6502/6502_instruction_set.html
-  std::vector<Opcode> Opcodes {
-    {BRK,     "BRK", Implied,      na},
-    {ORAIXID, "ORA", IndexedIndirect, na},
-    {ORAZP,   "ORA", ZeroPage,     na},
-    {ASLZP,   "ASL", ZeroPage,     na},
-    {PHP,     "PHP", Implied,      na},
-    {ORAI,    "ORA", Immediate,    na},
-    {ASLACC,  "ASL", Accumulator , na},
-    {ORAA,    "ORA", Absolute,     na},
-    {ASLA,    "ASL", Absolute,     na},
-
-    {BPL,     "BPL", Relative,     na},
-    {ORAIDIX, "ORA", IndirectIndexed, na},
-    {ORAZX,   "ORA", ZeroPageX,    na},
-    {ASLZX,   "ASL", ZeroPageX,    na},
-    {CLC,     "CLC", Implied,      na},
-    {ORAAY,   "ORA", AbsoluteY,    na},
-    {ORAAX,   "ORA", AbsoluteX,    na},
-    {ASLAX,   "ASL", AbsoluteX,    na},
-
-    {JSR,     "JSR", Absolute,     na},
-    {ANDIXID, "AND", IndexedIndirect, na},
-    {BITZP,   "BIT", ZeroPage,     na},
-    {ANDZP,   "AND", ZeroPage,     na},
-    {ROLZP,   "ROL", ZeroPage,     na},
-    {PLP,     "PLP", Implied,      na},
-    {ANDI,    "AND", Immediate,    na},
-    {ROLACC,  "ROL", Accumulator,  na},
-    {BITA,    "BIT", Absolute,     na},
-    {ANDA,    "AND", Absolute,     na},
-    {ROLA,    "ROL", Absolute,     na},
-
-    {BMI,     "BMI", Relative,     na},
-    {ANDIDIX, "AND", IndirectIndexed, na},
-    {ANDZX,   "AND", ZeroPageX,    na},
-    {ROLZX,   "ROL", ZeroPageX,    na},
-    {SEC,     "SEC", Implied,      na},
-    {ANDAY,   "AND", AbsoluteY,    na},
-    {ANDAX,   "AND", AbsoluteX,    na},
-    {ROLAX,   "ROL", AbsoluteX,    na},
-
-    {RTI,     "RTI", Implied,      na},
-    {EORIXID, "EOR", IndexedIndirect, na},
-    {EORZP,   "EOR", ZeroPage,     na},
-    {LSRZP,   "LSR", ZeroPage,     na},
-    {PHA,     "PHA", Implied,      na},
-    {EORI,    "EOR", Immediate,    na},
-    {LSR,     "LSR", Implied,      na},
-    {JMPA,    "JMP", Absolute,     na},
-    {EORA,    "EOR", Absolute,     na},
-    {LSRA,    "LSR", Absolute,     na},
-
-    {BVC,     "BVC", Relative,     na},
-    {EORIDIX, "EOR", IndirectIndexed, na},
-    {EORZX,   "EOR", ZeroPageX,    na},
-    {LSRZX,   "LSR", ZeroPageX,    na},
-    {CLINT,   "CLI", Implied,      na},
-    {EORAY,   "LSR", AbsoluteY,    na},
-    {EORAX,   "LSR", AbsoluteX,    na},
-    {LSRAX,   "LSR", AbsoluteX,    na},
-
-    {RTS,     "RTS", Implied,      na},
-    {ADCIXID, "ADC", IndexedIndirect, na},
-    {ADCZP,   "ADC", ZeroPage,     na},
-    {RORZP,   "ROR", ZeroPage,     na},
-    {PLA,     "PLA", Implied,      na},
-    {ADCI,    "ADC", Immediate,    na},
-    {RORACC,  "ROR", Accumulator,  na},
-    {JMPI,    "JMP", Indirect,     na},
-    {ADCA,    "ADC", Absolute,     na},
-    {RORA,    "ROR", Absolute,     na},
-
-    {BVS,     "BVS", Relative,     na},
-    {ADCIDIX, "EOR", IndirectIndexed, na},
-    {ADCZX,   "ADC", ZeroPageX,    na},
-    {RORZX,   "ROR", ZeroPageX,    na},
-    {SEI,     "SEI", Implied,      na},
-    {ADCAY,   "ADC", AbsoluteY,    na},
-    {ADCAX,   "ADC", AbsoluteX,    na},
-    {RORAX,   "ROR", AbsoluteX,    na},
-
-    {STAIXID, "STA", IndexedIndirect, na},
-    {STYZP,   "STY", ZeroPage,     na},
-    {STAZP,   "STA", ZeroPage,     na},
-    {STXZP,   "STX", ZeroPage,     na},
-    {DEY,     "DEY", Implied,      dec},
-    {TXA,     "TXA", Implied,      na},
-    {STYA,    "STY", Absolute,     na},
-    {STAA,    "STA", Absolute,     na},
-    {STXA,    "STX", Absolute,     na},
-
-    {BCC,     "BCC", Relative,     na},
-    {STAIDIX, "STA", IndirectIndexed, na},
-    {STYZX,   "STY", ZeroPageX,    na},
-    {STAZX,   "STA", ZeroPageX,    na},
-    {STXZY,   "STX", ZeroPageY,    na},
-    {TYA,     "TYA", Implied,      na},
-    {STAAY,   "STA", AbsoluteY,    na},
-    {TXS,     "TXS", Implied,      na},
-    {STAAX,   "STA", AbsoluteX,    na},
-
-    {LDYI,    "LDY", Immediate,    load},
-    {LDAIXID, "LDA", IndexedIndirect, load},
-    {LDXI,    "LDX", Immediate,    load},
-    {LDYZP,   "LDY", ZeroPage,     load},
-    {LDAZP,   "LDA", ZeroPage,     load},
-    {LDXZP,   "LDX", ZeroPage,     load},
-    {TAY,     "TAY", Implied,      na},
-    {LDAI,    "LDA", Immediate,    load},
-    {TAX,     "TAX", Implied,      na},
-    {LDYA,    "LDY", Absolute,     load},
-    {LDAA,    "LDA", Absolute,     load},
-    {LDXA,    "LDX", Absolute,     load},
-
-    {BCS,     "BCS", Relative,     load},
-    {LDAIDIX, "LDA", IndirectIndexed, load},
-    {LDYZX,   "LDY", ZeroPageX,    load},
-    {LDAZX,   "LDA", ZeroPageX,    load},
-    {LDXZY,   "LDX", ZeroPageY,    load},
-    {CLV,     "CLV", Implied,      na},
-    {LDAAY,   "LDA", AbsoluteY,    load},
-    {TSX,     "TSX", Implied,      na},
-    {LDYAX,   "LDY", AbsoluteX,    load},
-    {LDAAX,   "LDA", AbsoluteX,    load},
-    {LDXAY,   "LDX", AbsoluteY,    load},
-
-    {CPYI,    "CPY", Immediate,    na},
-    {CMPIXID, "CMP", IndexedIndirect, na},
-    {CPYZP,   "CPY", ZeroPage,     na},
-    {CMPZP,   "CMP", ZeroPage,     na},
-    {DECZP,   "DEC", ZeroPage,     na},
-    {INY,     "INY", Implied,      inc},
-    {CMPI,    "CMP", Immediate,    na},
-    {DEX,     "DEX", Implied,      dec},
-    {CPYA,    "CPY", Absolute,     na},
-    {CMPA,    "CMP", Absolute,     na},
-    {DECA,    "DEC", Absolute,     na},
-
-    {BNE,     "BNE", Relative,     na},
-    {CMPIDIX, "CMP", IndirectIndexed, na},
-    {CMPZX,   "CMP", ZeroPageX,    na},
-    {DECZX,   "DEC", ZeroPageX,    na},
-    {CLD,     "CLD", Implied,      na},
-    {CMPAY,   "CMP", AbsoluteY,    na},
-    {CMPAX,   "CMP", AbsoluteX,    na},
-    {DECAX,   "DEC", AbsoluteX,    na},
-
-    {CPXI,    "CPX", Immediate,    na},
-    {SBCIXID, "SCB", IndexedIndirect, na},
-    {CPXZP,   "CPX", ZeroPage,     na},
-    {SBCZP,   "SBC", ZeroPage,     na},
-    {INCZP,   "INC", ZeroPage,     na},
-    {INX,     "INX", Implied,      inc},
-    {SBCI,    "SBC", Immediate,    na},
-    {SBCA,    "SBC", Absolute,     na},
-    {INCA,    "INC", Absolute,     na},
-    {NOP,     "NOP", Implied,      na},
-    {CPXA,    "CPX", Absolute,     na},
-
-    {BEQ,     "BEQ", Relative,     na},
-    {SBCIDIX, "SBC", IndirectIndexed, na},
-    {SBCZX,   "SBC", ZeroPageX,    na},
-    {INCZX,   "INC", ZeroPageX,    na},
-    {SED,     "SED", Implied,      na},
-    {SBCAY,   "SBC", AbsoluteY,    na},
-    {SBCAX,   "SBC", AbsoluteX,    na},
-    {INCAX,   "INC", AbsoluteX,    na}
+  // Operand of the instruction at addr: the operand bytes or, for Relative
+  // mode, the branch target. Only the bytes the addressing mode needs
+  // are read. ZeroPageRelative has the zero page address in the low byte
+  // and the branch offset in the high byte.
+  uint16_t operand(AMode mode, uint16_t addr) {
+    switch (mode) {
+      case Implied:
+      case Accumulator:
+        return 0;
+      case Absolute:
+      case AbsoluteX:
+      case AbsoluteY:
+      case Indirect:
+      case AbsoluteIndexedIndirect:
+      case ZeroPageRelative:
+        return mem.peekWord(addr + 1);
+      case Relative:
+        return addr + 2 + jumpRelative(mem.peek(addr + 1));
+      default:
+        return mem.peek(addr + 1);
+    }
+  }
+
+  // Effective address from the operand. For Immediate mode this is the
+  // value itself, see load()
+  template <Bus bus, AMode mode> uint16_t address(uint16_t operand) {
+    switch (mode) {
+      case ZeroPageX:
+        return uint8_t(operand + X);
+      case ZeroPageY:
+        return uint8_t(operand + Y);
+      case AbsoluteX:
+        return operand + X;
+      case AbsoluteY:
+        return operand + Y;
+      case Indirect:
+        return readWord<bus>(operand);
+      case IndexedIndirect:
+        return zeroPageWord<bus>(operand + X);
+      case IndirectIndexed:
+        return zeroPageWord<bus>(operand) + Y;
+      case ZeroPageIndirect:
+        return zeroPageWord<bus>(operand);
+      case AbsoluteIndexedIndirect:
+        return readWord<bus>(operand + X);
+      case ZeroPageRelative:
+        return uint8_t(operand);
+      default: // Immediate, ZeroPage, Absolute, Relative, ...
+        return operand;
+    }
+  }
+
+  // JMP ($xxFF) on the NMOS 6502 reads the high byte of the target from
+  // $xx00, the address is not carried into the high byte
+  template <Bus bus> uint16_t indirectNMOS(uint16_t operand) {
+    return read<bus>(operand) |
+           read<bus>((operand & 0xFF00) | uint8_t(operand + 1)) << 8;
+  }
+
+  // Read the value an instruction operates on. Indexing across a page
+  // boundary costs a cycle
+  template <Bus bus, AMode mode> uint8_t load(uint16_t addr) {
+    if (mode == Immediate) {
+      return addr;
+    }
+    if (mode == AbsoluteX or mode == AbsoluteY or mode == IndirectIndexed) {
+      uint8_t index = (mode == AbsoluteX) ? X : Y;
+      cycles += ((addr ^ uint16_t(addr - index)) > 0xFF);
+    }
+    return readMemory<bus, mode>(addr);
+  }
+
+  // Decode the instruction at addr into the decode cache
+  Decoded & decode(uint16_t addr);
+
+  // Replace the decoded instruction at addr with a fused group if it
+  // starts one of the sequences in FUSED_PAIR_TABLE or FUSED_TRIPLE_TABLE
+  void fuse(uint16_t addr);
+
+  // Replace the decoded instruction at addr with a loop group if it starts
+  // a loop that can be executed at once (CPULoops.cpp)
+  void recognizeLoop(uint16_t addr);
+
+  // Handler of loop groups: executes the iterations of the loop at PC
+  // that branch back at once, within the run loop horizon, then the
+  // next iteration one instruction at a time
+  static void loopGroup(CPU * cpu, uint16_t unused);
+
+  // Executes up to n iterations of the loop at PC at once, fewer if they
+  // would not branch back or cannot be done with copy(), fill() or
+  // comparisons of host memory
+  void skipIterations(const Loop & loop, uint64_t n);
+
+  // Executes one iteration of the loop at start, stops early if it leaves
+  // the loop or modifies it
+  void loopIteration(uint16_t start, const Loop & loop);
+
+  // Execute the decoded instruction or group at PC without exceeding the
+  // instruction count n
+  void executeDecoded(uint64_t n) {
+    Decoded & inst = decoded[PC];
+    uint8_t count = inst.count;
+    if (instructions + count > n) { // only the first instruction of a group
+      uint8_t opcode = mem.peek(PC);
+      cycles += opcodeCycles[opcode];
+      instset[opcode].handler(this, inst.operand);
+      count = 1;
+    } else {
+      cycles += inst.cycles;
+      inst.handler(this, inst.operand);
+    }
+    instructions += count;
+  }
+
+  static constexpr int MaxIdleLoop{8}; ///< instructions of an idle loop
+
+  // Runs one iteration of the loop at PC if it is idle: it returns to PC
+  // with the same registers and flags, only reading memory or writing
+  // values memory already holds. Nothing changes until something outside
+  // the CPU writes memory. Returns false if it is not idle (after at most
+  // MaxIdleLoop instructions)
+  bool idleLoop(uint64_t & loopCycles, uint64_t & loopInstructions);
+
+  // Can the instruction at PC be part of an idle loop?
+  bool idleInstruction();
+
+  // Handler of cache entries not yet decoded: decodes and executes, adds
+  // the cycles of the executed instruction
+  static void decodeExecute(CPU * cpu, uint16_t unused);
+
+  // Specialized handler for one operation in one addressing mode on one
+  // variant, reading memory through bus
+  template <Variant variant, Bus bus, Operation op, AMode mode>
+  static void execute(CPU * cpu, uint16_t operand);
+
+  // Handler executing two or three instructions, the operands of the
+  // instructions after the first are taken from the decode cache
+  template <Variant variant, Bus bus, Operation op1, AMode mode1, Operation op2,
+            AMode mode2, Operation op3, AMode mode3>
+  static void fused(CPU * cpu, uint16_t operand);
+
+  // Handler for opcodes not implemented by the variant
+  static void invalid(CPU * cpu, uint16_t unused);
+
+  // Fill the handler table from the opcodes of the variant reading memory
+  // through bus, drops the decoded instructions and translated blocks
+  // calling the other handlers
+  void selectHandlers(Bus bus);
+
+  // The opcodes, fused sequences and cycle table of a variant
+  struct InstructionSet {
+    const Opcode * opcodes;
+    int numOpcodes;
+    const Fusion * fusions;
+    int numFusions;
+    const uint8_t * cycles;
   };
 
+  // The opcodes of each variant and bus, generated from OPCODE_TABLE and
+  // ILLEGAL_OPCODE_TABLE or CMOS_OPCODE_TABLE
+  static const Opcode NmosOpcodes[], CmosOpcodes[], RicohOpcodes[];
+  static const Opcode NmosFlatOpcodes[], CmosFlatOpcodes[], RicohFlatOpcodes[];
+
+  // The fused instruction sequences of each variant and bus, generated from
+  // FUSED_PAIR_TABLE and FUSED_TRIPLE_TABLE
+  static const Fusion NmosFusions[], CmosFusions[], RicohFusions[];
+  static const Fusion NmosFlatFusions[], CmosFlatFusions[], RicohFlatFusions[];
+
+  // Indexed by Bus and Variant
+  static const InstructionSet InstructionSets[][3];
 };
@@ -10,60 +10,29 @@
 //===----------------------------------------------------------------------===//
 
 #include <CPU.h>
+#include <DecimalALU.h>
 #include <Memory.h>
 
 
-int16_t CPU::jumpRelative(uint8_t val) {
-  int16_t jump;
-  if (val & 0x80) {
-    jump = - (256 - val);
-  } else {
-    jump = val;
-  }
-  return jump;
-}
-
-
+// Decimal mode is not available on the 2A03, see DecimalALU. With
+// ALU_TABLES decimal mode looks up the precomputed results
+template <Variant variant>
 int CPU::addcarry(uint8_t & reg, uint8_t val) {
-  unsigned int tmp = reg + val + Status.bits.C;
-  Status.bits.O = 0; // Clear overflow
-  Status.bits.N = 0;
-  Status.bits.Z = 0;
-
-
-  if ((tmp & 0xFF) == 0x00)
-    Status.bits.Z = 1;
-
-  if (Status.bits.D) { // DECIMAL MODE
-    if (((reg & 0xF) + (val & 0xF) + Status.bits.C) > 9)
-      tmp += 6;
-
-    if (tmp & 0x80)
-      Status.bits.N = 1;
-    if (!((reg ^ val) & 0x80) && ((reg ^ tmp) & 0x80)) {
-      Status.bits.O = 1;
-    }
-    if (tmp > 0x99) {
-      tmp += 96;
-    }
-   Status.bits.C = 0;
-    if (tmp > 0x99) {
-      Status.bits.C = 1;  // Set carry
-    }
+  if (VariantTraits<variant>::decimal and Status.bits.D) { // DECIMAL MODE
+#ifdef ALU_TABLES
+    decimalResult<variant>(reg, DecimalALU::get().adc(reg, val, carry));
+#else
+    decimalResult<variant>(reg, DecimalALU::add(reg, val, carry));
+#endif
+    return 0;
+  }
 
-  } else { // NORMAL (?) MODE
-    if (tmp & 0x80)
-      Status.bits.N = 1;
+  unsigned int tmp = reg + val + carry;
 
-    if (!((reg ^ val) & 0x80) && ((reg ^ tmp) & 0x80)) {
-      Status.bits.O = 1;
-    }
-
-    Status.bits.C = 0;
-    if (tmp > 255) {
-      Status.bits.C = 1; // Set carry
-    }
-  }
+  resultZ = tmp & 0xFF;
+  resultN = tmp;
+  overflow = ~(reg ^ val) & (reg ^ tmp) & 0x80;
+  carry = (tmp > 255);
 
   reg = tmp & 0xFF;
 
@@ -73,92 +42,76 @@ int CPU::addcarry(uint8_t & reg, uint8_t val) {
 
 
 
+template <Variant variant>
 int CPU::subcarry(uint8_t & unused, uint8_t M) {
-  unsigned int tmp = A - M - (Status.bits.C ^ 1);
-
-  Status.bits.N = 0;
-  if (tmp & 0x80)
-    Status.bits.N = 1;
-
-  Status.bits.Z = 0;
-  if ((tmp & 0xFF) == 0x00)
-    Status.bits.Z = 1;
-
-  Status.bits.O = 0;
-  if (((A ^ tmp) & 0x80) && ((A ^ M) & 0x80))
-    Status.bits.O =  1;
+  if (VariantTraits<variant>::decimal and Status.bits.D) { // DECIMAL MODE
+#ifdef ALU_TABLES
+    decimalResult<variant>(A, DecimalALU::get().sbc(A, M, carry));
+#else
+    decimalResult<variant>(A, DecimalALU::subtract(A, M, carry));
+#endif
+    return 0;
+  }
 
-	if (Status.bits.D == 1) {
-		if ( ((A & 0x0F) - (Status.bits.C ^ 1)) < (M & 0x0F))
-      tmp -= 6;
-		if (tmp > 0x99) {
-			tmp -= 0x60;
-		}
-	}
+  unsigned int tmp = A - M - (carry ^ 1);
 
-  Status.bits.C = 0;
-  if (tmp < 0x100)
-    Status.bits.C = 1;
+  resultN = tmp;
+  resultZ = tmp & 0xFF;
+  overflow = (A ^ tmp) & (A ^ M) & 0x80;
+  carry = (tmp < 0x100);
 
 	A = (tmp & 0xFF);
   return 0;
 }
 
 
-void CPU::ror(uint16_t addr) {
-  uint8_t val = mem.readByte(addr);
-  uint8_t oldCarry = Status.bits.C;
-  Status.bits.C = (val & 0x01); // bit 0 -> Carry
-  val = val >> 1;
-  if (oldCarry) {
-    val = val + 128;
+// The 65C02 sets N and Z from the decimal result and takes a cycle more
+template <Variant variant>
+void CPU::decimalResult(uint8_t & reg, uint32_t result) {
+  reg = DecimalALU::value(result);
+  if (VariantTraits<variant>::cmos) {
+    updateStatusZN(reg);
+    cycles++;
+  } else {
+    resultZ = DecimalALU::resultZ(result);
+    resultN = DecimalALU::resultN(result);
   }
-  mem.writeByte(addr, val);
-  updateStatusZN(val);
+  carry = DecimalALU::carry(result);
+  overflow = DecimalALU::overflow(result);
 }
 
 
-void CPU::rol(uint16_t addr) {
-  uint8_t val = mem.readByte(addr);
-  uint8_t oldCarry = Status.bits.C;
-  Status.bits.C = (val >> 7); // bit 7 -> Carry
-  val = val << 1;
-  val = val + oldCarry;
-  mem.writeByte(addr, val);
-  updateStatusZN(val);
-}
-
-
-void CPU::lsr(uint16_t addr) {
-  uint8_t val = mem.readByte(addr);
-  Status.bits.C = val & 0x01;
-  val = val >> 1;
-  mem.writeByte(addr, val);
-  updateStatusZN(val);
-}
-
-void CPU::asl(uint16_t addr) {
-  uint8_t val = mem.readByte(addr);
-  Status.bits.C = (val >> 7);
-  val = val << 1;
-  mem.writeByte(addr, val);
-  updateStatusZN(val);
-}
-
-void CPU::andMem(uint16_t addr) {
-  uint8_t val = mem.readByte(addr);
-  A = A & val;
-  updateStatusZN(A);
+// Undocumented ARR: AND, then ROR A. C is bit 6 and V is bit 6 XOR bit 5
+// of the result. In decimal mode N and Z are from the rotated value and
+// the nibbles are adjusted like after an ADC (as in VICE)
+template <Variant variant>
+void CPU::arr(uint8_t val) {
+  uint8_t tmp = A & val;
+  uint8_t res = (tmp >> 1) | (carry << 7);
+  updateStatusZN(res);
+  if (VariantTraits<variant>::decimal and Status.bits.D) {
+    overflow = (res ^ tmp) & 0x40;
+    if ((tmp & 0x0F) + (tmp & 0x01) > 0x05) {
+      res = (res & 0xF0) | ((res + 0x06) & 0x0F);
+    }
+    carry = ((tmp & 0xF0) + (tmp & 0x10)) > 0x50;
+    if (carry) {
+      res += 0x60;
+    }
+  } else {
+    carry = (res >> 6) & 1;
+    overflow = (res ^ (res << 1)) & 0x40;
+  }
+  A = res;
 }
 
-void CPU::eorMem(uint16_t addr) {
-  uint8_t val = mem.readByte(addr);
-  A = A ^ val;
-  updateStatusZN(A);
-}
 
-void CPU::oraMem(uint16_t addr) {
-  uint8_t val = mem.readByte(addr);
-  A = A | val;
-  updateStatusZN(A);
-}
+template int CPU::addcarry<NMOS6502>(uint8_t &, uint8_t);
+template int CPU::addcarry<CMOS65C02>(uint8_t &, uint8_t);
+template int CPU::addcarry<Ricoh2A03>(uint8_t &, uint8_t);
+template int CPU::subcarry<NMOS6502>(uint8_t &, uint8_t);
+template int CPU::subcarry<CMOS65C02>(uint8_t &, uint8_t);
+template int CPU::subcarry<Ricoh2A03>(uint8_t &, uint8_t);
+template void CPU::arr<NMOS6502>(uint8_t);
+template void CPU::arr<CMOS65C02>(uint8_t);
+template void CPU::arr<Ricoh2A03>(uint8_t);
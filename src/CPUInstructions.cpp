@@ -3,7 +3,7 @@
 ///
 /// \file
 ///
-/// \brief 6502 CPU emulator - handleInstruction() methos
+/// \brief 6502 CPU emulator - instruction handlers
 ///
 /// Handles program counter (PC), stack pointer (SP), the three registers
 /// X,Y,A and status flags.
@@ -11,8 +11,15 @@
 ///    getInstruction()
 ///    handleInstruction()
 ///
-/// Individual opcodes are implemented in a bit switch statement
-/// in handleInstruction (CPU.cpp)
+/// Every opcode has its own handler, an instantiation of
+/// CPU::execute<variant, bus, operation, addressing mode>. The handlers are
+/// generated from OPCODE_TABLE (Opcodes.h) so operand fetch, the operation
+/// and the flag updates are all inlined into one small function per opcode.
+/// The differences between the variants are resolved at compile time, each
+/// variant has its own table of handlers. So is the way memory is read:
+/// with only RAM mapped the Flat handlers index it directly.
+/// Fused handlers for common instruction sequences are generated from
+/// FUSED_PAIR_TABLE and FUSED_TRIPLE_TABLE the same way.
 /// Some debugging functionality added
 //===----------------------------------------------------------------------===//
 
@@ -21,812 +28,678 @@
 
 bool CPU::handleInstruction(uint8_t opcode) {
   uint16_t addr = PC;
-  uint8_t byte = mem.readByte(PC + 1);
-  uint8_t byte2 = mem.readByte(PC + 2);
-  uint16_t word = mem.readWord(PC + 1);
+  stopReason = Budget;
+  setStatus(Status.mask);
+  traceInstruction(opcode);
+  Status.mask = getStatus();
+  if (stopReason == Watchpoint) {
+    watchHit.pc = addr;
+  }
+  return stopReason == Budget;
+}
+
+
+void CPU::traceInstruction(uint8_t opcode) {
+  uint16_t addr = PC;
   auto & Opc = instset[opcode];
 
-  disAssemble(addr, Opc, byte, byte2, word);
-  PC += operands(Opc.mode); // Works for all but jump instructions?
+  disAssemble(addr, Opc);
 
-  switch (Opc.opcode) {
-    //
-    // Set/Clear flags
-    case CLC: // CLC - CLear Carry
-       Status.bits.C = 0;
-       break;
+  cycles += opcodeCycles[opcode];
+  Opc.handler(this, operand(Opc.mode, PC));
 
-     case SEC: // Set Carry
-       Status.bits.C = 1;
-       break;
+  printRegisters();
 
-     case CLD: // CLear Decimal
-       Status.bits.D = 0;
-       break;
+  if (debugPrint) {
+    printf("\n");
+    //mem.dump(0x8000, 16);
+  }
 
-     case CLV: // Clear Overflow
-       Status.bits.O = 0;
-       break;
+  if (PC == trcAddr) {
+    debugOn();
+  }
+}
 
-     case SED: // Set Decimal
-       Status.bits.D = 1;
-       break;
 
-     case CLINT: // Clear Interrupt
-       Status.bits.I = 0;
-       break;
+template <Variant variant, Bus bus, Operation op, AMode mode>
+void CPU::execute(CPU * cpu, uint16_t operand) {
+  typedef VariantTraits<variant> Traits;
+  uint16_t start = cpu->PC;
+  uint16_t addr = (op == opJMP and mode == Indirect and not Traits::cmos) ?
+                  cpu->indirectNMOS<bus>(operand) : cpu->address<bus, mode>(operand);
+  cpu->PC += length(mode);
 
-     case SEI: // Set Interrupt
-       Status.bits.I = 1;
-       break;
+  // The 65C02 shifts with AbsoluteX addressing like an indexed read
+  if (Traits::cmos and (mode == AbsoluteX) and
+      (op == opASL or op == opLSR or op == opROL or op == opROR)) {
+    cpu->cycles += ((addr ^ operand) > 0xFF);
+  }
 
+  switch (op) {
     //
-    // Load/Store
-    case LDAI:
-      A = byte;
-      Opc.pf(this, A);
-      break;
-
-    case LDAZP:
-      A = mem.readByte(byte);
-      Opc.pf(this, A);
+    // Set/Clear flags
+    case opCLC: // CLear Carry
+      cpu->carry = 0;
       break;
 
-    case LDAZX:
-      A = mem.readByte(uint8_t(byte + X));
-      Opc.pf(this, A);
+    case opSEC: // Set Carry
+      cpu->carry = 1;
       break;
 
-    case LDAA:
-      A = mem.readByte(word);
-      Opc.pf(this, A);
+    case opCLD: // CLear Decimal
+      cpu->Status.bits.D = 0;
       break;
 
-    case LDAAX:
-      A = mem.readByte(word + X);
-      Opc.pf(this, A);
+    case opCLV: // Clear Overflow
+      cpu->overflow = 0;
       break;
 
-    case LDAAY:
-      A = mem.readByte(word + Y);
-      Opc.pf(this, A);
+    case opSED: // Set Decimal
+      cpu->Status.bits.D = 1;
       break;
 
-    case LDAIXID: // Indexed, Indirect ?
-      A = mem.readByte(mem.readWord(uint8_t(byte + X)));
-      Opc.pf(this, A);
+    case opCLI: // Clear Interrupt
+      cpu->Status.bits.I = 0;
+      cpu->unmasked();
       break;
 
-    case LDAIDIX: {// Indirect, Indexed ?
-      uint16_t addr = mem.readWord(byte) + Y;
-      A = mem.readByte(addr);
-      Opc.pf(this, A);
-      }
+    case opSEI: // Set Interrupt
+      cpu->Status.bits.I = 1;
       break;
 
-    case STAZP:
-      mem.writeByte(byte, A);
+    //
+    // Load/Store
+    case opLDA:
+      cpu->A = cpu->load<bus, mode>(addr);
+      cpu->updateStatusZN(cpu->A);
       break;
 
-    case STAZX:
-      mem.writeByte(uint8_t(byte + X), A);
+    case opLDX:
+      cpu->X = cpu->load<bus, mode>(addr);
+      cpu->updateStatusZN(cpu->X);
       break;
 
-    case STAA:
-      mem.writeByte(word, A);
+    case opLDY:
+      cpu->Y = cpu->load<bus, mode>(addr);
+      cpu->updateStatusZN(cpu->Y);
       break;
 
-    case STAAX:
-      mem.writeByte(word + X, A);
+    case opSTA:
+      cpu->writeMemory<mode>(addr, cpu->A);
       break;
 
-    case STAAY:
-      mem.writeByte(word + Y, A);
+    case opSTX:
+      cpu->writeMemory<mode>(addr, cpu->X);
       break;
 
-    case STAIXID: // Indexed, Indirect
-      mem.writeByte(mem.readWord(uint8_t(byte + X)), A);
+    case opSTY:
+      cpu->writeMemory<mode>(addr, cpu->Y);
       break;
 
-    case STAIDIX: // Indirect, Indexed
-      mem.writeByte(mem.readWord(byte) + Y, A);
+    case opSTZ: // 65C02 STore Zero
+      cpu->writeMemory<mode>(addr, 0);
       break;
 
-    // X
-    case LDXI:
-      X = byte;
-      Opc.pf(this, X);
+    //
+    // Add/Subtract
+    case opADC: // Add with carry
+      cpu->addcarry<variant>(cpu->A, cpu->load<bus, mode>(addr));
       break;
 
-    case LDXZP:
-      X = mem.readByte(byte);
-      Opc.pf(this, X);
+    case opSBC: // Subtract with carry
+      cpu->subcarry<variant>(cpu->A, cpu->load<bus, mode>(addr));
       break;
 
-    case LDXZY:
-      X = mem.readByte((byte + Y) % 256);
-      assert(((byte+Y) % 256) == (uint8_t(byte + Y)));
-      Opc.pf(this, X);
+    //
+    // Increment/Decrement
+    case opINX:
+      cpu->X++;
+      cpu->updateStatusZN(cpu->X);
       break;
 
-    case LDXA:
-      X = mem.readByte(word);
-      Opc.pf(this, X);
+    case opINY:
+      cpu->Y++;
+      cpu->updateStatusZN(cpu->Y);
       break;
 
-    case LDXAY:
-      X = mem.readByte(word + Y);
-      Opc.pf(this, X);
+    case opDEX:
+      cpu->X--;
+      cpu->updateStatusZN(cpu->X);
       break;
 
-    case STXZP:
-      mem.writeByte(byte, X);
+    case opDEY:
+      cpu->Y--;
+      cpu->updateStatusZN(cpu->Y);
       break;
 
-    case STXZY:
-      mem.writeByte(uint8_t(byte + Y), X);
+    case opINC: // INC memory, A on the 65C02
+      if (mode == Accumulator) {
+        cpu->A++;
+        cpu->updateStatusZN(cpu->A);
+      } else {
+        uint8_t val = cpu->readMemory<bus, mode>(addr) + 1;
+        cpu->writeMemory<mode>(addr, val);
+        cpu->updateStatusZN(val);
+      }
       break;
 
-    case STXA:
-      mem.writeByte(word, X);
+    case opDEC: // DEC memory, A on the 65C02
+      if (mode == Accumulator) {
+        cpu->A--;
+        cpu->updateStatusZN(cpu->A);
+      } else {
+        uint8_t val = cpu->readMemory<bus, mode>(addr) - 1;
+        cpu->writeMemory<mode>(addr, val);
+        cpu->updateStatusZN(val);
+      }
       break;
 
-
     //
-    case LDYI:
-      Y = byte;
-      Opc.pf(this, Y);
-      break;
-
-    case LDYZP:
-      Y = mem.readByte(byte);
-      Opc.pf(this, Y);
-      break;
-
-    case LDYZX:
-      Y = mem.readByte(uint8_t(byte + X));
-      Opc.pf(this, Y);
-      break;
-
-    case LDYA:
-      Y = mem.readByte(word);
-      Opc.pf(this, Y);
-      break;
-
-    case LDYAX:
-      Y = mem.readByte(word + X);
-      Opc.pf(this, Y);
-      break;
-
-    case STYZP:
-      mem.writeByte(byte, Y);
+    // Compare
+    case opCMP:
+      cpu->updateCompare(cpu->A, cpu->load<bus, mode>(addr));
       break;
 
-    case STYZX:
-      mem.writeByte(uint8_t(byte + X), Y);
+    case opCPX:
+      cpu->updateCompare(cpu->X, cpu->load<bus, mode>(addr));
       break;
 
-    case STYA:
-      mem.writeByte(word, Y);
+    case opCPY:
+      cpu->updateCompare(cpu->Y, cpu->load<bus, mode>(addr));
       break;
 
     //
-    // Add/Subtract
-
-    // Add
-    case ADCI: // Add with carry Imm
-      addcarry(A, byte);
-      break;
-
-    case ADCZP: //Add wih carry - ZP
-      addcarry(A, mem.readByte(byte));
-    break;
-
-    case ADCZX: //Add wih carry - ZP,X
-      addcarry(A, mem.readByte(uint8_t(byte + X)));
-    break;
-
-    case ADCA: // Add with carry - Absolute
-      addcarry(A, mem.readByte(word));
+    // Branch/Jump/Return - for Relative mode addr is the branch target
+    case opBNE: // Branch if not Zero
+      if (cpu->resultZ != 0) {
+        cpu->branch(addr);
+      }
       break;
 
-    case ADCAX: // Add with carry - Absolute,X
-      addcarry(A, mem.readByte(word + X));
+    case opBEQ: // Branch if Zero
+      if (cpu->resultZ == 0) {
+        cpu->branch(addr);
+      }
       break;
 
-    case ADCAY: // Add with carry - Absolute,Y
-      addcarry(A, mem.readByte(word + Y));
+    case opBPL: // Branch if positive
+      if (cpu->resultN < 0x80) {
+        cpu->branch(addr);
+      }
       break;
 
-    case ADCIXID: // Add with carry - Indexed, indirect
-      addcarry(A, mem.readByte(mem.readWord(uint8_t(byte + X))));
+    case opBMI: // Branch if negative
+      if (cpu->resultN >= 0x80) {
+        cpu->branch(addr);
+      }
       break;
 
-    case ADCIDIX: // Add with carry - Indexed, indirect
-      addcarry(A, mem.readByte(mem.readWord(byte) + Y));
+    case opBCC: // Branch if carry clear
+      if (cpu->carry == 0) {
+        cpu->branch(addr);
+      }
       break;
 
-    // Subtract
-    case SBCI: // Subtract with carry - Imm
-      subcarry(A, byte);
+    case opBCS: // Branch if carry set
+      if (cpu->carry != 0) {
+        cpu->branch(addr);
+      }
       break;
 
-    case SBCZP: // Subtract with carry - ZP
-      subcarry(A, mem.readByte(byte));
+    case opBVC: // Branch if overflow clear
+      if (cpu->overflow == 0) {
+        cpu->branch(addr);
+      }
       break;
 
-    case SBCZX: // Subtract with carry - ZP,X
-      subcarry(A, mem.readByte(uint8_t(byte + X)));
+    case opBVS: // Branch if overflow set
+      if (cpu->overflow != 0) {
+        cpu->branch(addr);
+      }
       break;
 
-    case SBCA: // Subtract with carry - Absolute
-      subcarry(A, mem.readByte(word));
+    case opBRA: // 65C02 BRanch Always
+      cpu->branch(addr);
       break;
 
-    case SBCAX: // Subtract with carry - Absolute,X
-      subcarry(A, mem.readByte(word + X));
-      break;
+    case opBBR: // 65C02 Branch on Bit Reset/Set, addr is the zero page address
+    case opBBS: {
+      int bit = (cpu->mem.peek(start) >> 4) & 7;
+      bool set = (cpu->readMemory<bus, mode>(addr) >> bit) & 1;
+      if (set == (op == opBBS)) {
+        cpu->branch(cpu->PC + cpu->jumpRelative(operand >> 8));
+      }
+    }
+    break;
 
-    case SBCAY: // Subtract with carry - Absolute,Y
-      subcarry(A, mem.readByte(word + Y));
+    /// Group: Jumps & Calls (Complete)
+    case opJSR: // pushes the address of its last byte
+      cpu->PC--;
+      cpu->stackPush(cpu->PC >> 8);
+      cpu->stackPush(cpu->PC & 0xFF);
+      cpu->PC = addr;
       break;
 
-    case SBCIXID: // Add with carry - Indexed, indirect
-      subcarry(A, mem.readByte(mem.readWord(uint8_t(byte + X))));
+    case opJMP: // Jump absolute and indirect
+      cpu->PC = addr;
       break;
 
-    case SBCIDIX: // Add with carry - Indexed, indirect
-      subcarry(A, mem.readByte(mem.readWord(byte) + Y));
+    case opRTS:
+      cpu->PC = cpu->stackPop<bus>();
+      cpu->PC += (cpu->stackPop<bus>() << 8) + 1;
       break;
 
     //
-    // Increment
-    case INX:
-      Opc.pf(this, X);
-      break;
-
-    case INY:
-      Opc.pf(this, Y);
+    // Logical
+    case opAND:
+      cpu->A = cpu->A & cpu->load<bus, mode>(addr);
+      cpu->updateStatusZN(cpu->A);
       break;
 
-    case DEX:
-      Opc.pf(this, X);
+    case opORA:
+      cpu->A = cpu->A | cpu->load<bus, mode>(addr);
+      cpu->updateStatusZN(cpu->A);
       break;
 
-    case DEY:
-      Opc.pf(this, Y);
+    case opEOR:
+      cpu->A = cpu->A ^ cpu->load<bus, mode>(addr);
+      cpu->updateStatusZN(cpu->A);
       break;
 
-    case INCZP: { // INC memory zeropage
-      uint8_t val = mem.readByte(byte);
-      val++;
-      mem.writeByte(byte, val);
-      updateStatusZN(val);
-    }
-    break;
-
-    case INCZX: { // INC memory zeropage
-      uint8_t val = mem.readByte(uint8_t(byte + X));
-      val++;
-      mem.writeByte(uint8_t(byte + X), val);
-      updateStatusZN(val);
-    }
-    break;
-
-    case INCA: { // INC memory absolute
-      uint8_t val = mem.readByte(word);
-      val++;
-      mem.writeByte(word, val);
-      updateStatusZN(val);
-    }
-    break;
-
-    case INCAX: { // INC memory absolute
-      uint8_t val = mem.readByte(word + X);
-      val++;
-      mem.writeByte(word + X, val);
-      updateStatusZN(val);
-    }
-    break;
-
-
-    case DECZP: { // DEC memory zeropage
-      uint8_t val = mem.readByte(byte);
-      val--;
-      mem.writeByte(byte, val);
-      updateStatusZN(val);
-    }
-    break;
-
-    case DECZX: { // DEC memory zeropage
-      uint8_t val = mem.readByte(uint8_t(byte + X));
-      val--;
-      mem.writeByte(uint8_t(byte + X), val);
-      updateStatusZN(val);
+    case opBIT: { // BIT # (65C02) only sets Z
+      uint8_t M = cpu->load<bus, mode>(addr);
+      cpu->resultZ = cpu->A & M;
+      if (mode != Immediate) {
+        cpu->resultN = M;
+        cpu->overflow = M & 0x40;
+      }
     }
     break;
 
-    case DECA: { // DEC memory absolute X
-      uint8_t val = mem.readByte(word);
-      val--;
-      mem.writeByte(word, val);
-      updateStatusZN(val);
+    case opTSB: // 65C02 Test and Set/Reset Bits, Z as BIT
+    case opTRB: {
+      uint8_t M = cpu->readMemory<bus, mode>(addr);
+      cpu->resultZ = cpu->A & M;
+      cpu->writeMemory<mode>(addr, (op == opTSB) ? (M | cpu->A) : (M & ~cpu->A));
     }
     break;
 
-    case DECAX: { // DEC memory absolute X
-      uint8_t val = mem.readByte(word + X);
-      val--;
-      mem.writeByte(word + X, val);
-      updateStatusZN(val);
+    case opRMB: // 65C02 Reset/Set Memory Bit
+    case opSMB: {
+      uint8_t bit = 1 << ((cpu->mem.peek(start) >> 4) & 7);
+      uint8_t M = cpu->readMemory<bus, mode>(addr);
+      cpu->writeMemory<mode>(addr, (op == opSMB) ? (M | bit) : (M & ~bit));
     }
     break;
 
-
     //
-    // Compare
-    case CMPI:
-      updateCompare(A, byte);
-      break;
-
-    case CPXI:
-      updateCompare(X, byte);
-      break;
-
-    case CMPZP: // Compare A register zero-page
-      updateCompare(A, mem.readByte(byte));
-      break;
-
-    case CMPZX: // Compare A register zero-page
-      updateCompare(A, mem.readByte(uint8_t(byte + X)));
-      break;
-
-    case CMPA: // Compare A register Absolute
-      updateCompare(A, mem.readByte(word));
-      break;
-
-    case CMPAX: // Compare A register AbsoluteY
-      updateCompare(A, mem.readByte(word + X));
-      break;
-
-    case CMPAY: // Compare A register AbsoluteY
-      updateCompare(A, mem.readByte(word + Y));
-      break;
-
-    case CMPIXID: // Compare A Indexed, indirect
-    updateCompare(A, mem.readByte(mem.readWord(uint8_t(byte + X))));
-    break;
-
-    case CMPIDIX: // Compare A Indirect,indexed
-    updateCompare(A, mem.readByte(mem.readWord(byte) + Y));
-    break;
-
-    case CPXZP: // Compare X register zero-page
-      updateCompare(X, mem.readByte(byte));
-      break;
-
-    case CPXA: // Compare X register Absolute
-      updateCompare(X, mem.readByte(word));
-      break;
-
-    case CPYI: // Compare Y register immediate
-      updateCompare(Y, byte);
-      break;
-
-    case CPYZP: // Compare Y register zero-page
-      updateCompare(Y, mem.readByte(byte));
-      break;
-
-    case CPYA: // Compare Y register Absolute
-      updateCompare(Y, mem.readByte(word));
-      break;
-
-
-    //
-    // Branch/Jump/Return
-    case BNE: // Branch if not Zero
-      if (Status.bits.Z == 0) {
-        PC += jumpRelative(byte);
+    // Shifts
+    case opASL:
+      if (mode == Accumulator) {
+        cpu->A = cpu->asl(cpu->A);
+      } else {
+        cpu->writeMemory<mode>(addr, cpu->asl(cpu->readMemory<bus, mode>(addr)));
       }
       break;
 
-    case BEQ: // Branch if Zero
-      if (Status.bits.Z == 1) {
-        PC += jumpRelative(byte);
+    case opLSR:
+      if (mode == Accumulator) {
+        cpu->A = cpu->lsr(cpu->A);
+      } else {
+        cpu->writeMemory<mode>(addr, cpu->lsr(cpu->readMemory<bus, mode>(addr)));
       }
       break;
 
-    case BPL: // Branch if positive
-      if (Status.bits.N == 0) {
-        PC += jumpRelative(byte);
+    case opROL:
+      if (mode == Accumulator) {
+        cpu->A = cpu->rol(cpu->A);
+      } else {
+        cpu->writeMemory<mode>(addr, cpu->rol(cpu->readMemory<bus, mode>(addr)));
       }
       break;
 
-    case BMI: // Branch if negative
-      if (Status.bits.N == 1) {
-        PC += jumpRelative(byte);
-      }
-    break;
-
-    case BCC: // Branch if carry clear
-      if (Status.bits.C == 0) {
-        PC += jumpRelative(byte);
-      }
-    break;
-
-    case BCS: // Branch if carry set
-      if (Status.bits.C == 1) {
-        PC += jumpRelative(byte);
-      }
-    break;
-
-    case BVC: // Branch if overflow clear
-      if (Status.bits.O == 0) {
-        PC += jumpRelative(byte);
-      }
-    break;
-
-    case BVS: // Branch if overflow set
-      if (Status.bits.O == 1) {
-        PC += jumpRelative(byte);
-      }
-    break;
-
-
-    /// Group: Jumps & Calls (Complete)
-    case JSR:
-        PC--;
-        mem.writeWord(getSPAddr() - 1, PC);
-        S -= 2;
-        PC = word;
-        break;
-
-    case JMPA: // Jump absolute
-      PC = word;
-      break;
-
-    case JMPI: { // Jump indirect
-        PC = mem.readWord(word);
+    case opROR:
+      if (mode == Accumulator) {
+        cpu->A = cpu->ror(cpu->A);
+      } else {
+        cpu->writeMemory<mode>(addr, cpu->ror(cpu->readMemory<bus, mode>(addr)));
       }
       break;
 
-    case RTS:
-      S+=2;
-      PC = mem.readWord(getSPAddr() - 1) + 1;
-      break;
-
-
     //
-    // Logical
-    case ANDI:
-      A = A & byte;
-      updateStatusZN(A);
-      break;
-
-    case ANDZP:
-      andMem(byte);
-      break;
-
-    case ANDZX:
-      andMem(uint8_t(byte + X));
-      break;
-
-    case ANDA:
-      andMem(word);
-      break;
-
-    case ANDAX:
-      andMem(word + X);
-      break;
-
-    case ANDAY:
-      andMem(word + Y);
-      break;
-
-    case ANDIXID:
-      andMem(mem.readWord(uint8_t(byte + X)));
-      break;
-
-    case ANDIDIX:
-      andMem(mem.readWord(byte) + Y);
-      break;
-
-    case ORAI:
-      A = A | byte;
-      updateStatusZN(A);
-      break;
-
-    case ORAZP:
-      oraMem(byte);
-      break;
-
-    case ORAZX:
-      oraMem(uint8_t(byte + X));
-      break;
-
-    case ORAA:
-      oraMem(word);
-      break;
-
-    case ORAAX:
-      oraMem(word + X);
-      break;
-
-    case ORAAY:
-      oraMem(word + Y);
-      break;
-
-    case ORAIXID:
-      oraMem(mem.readWord(uint8_t(byte + X)));
-      break;
-
-    case ORAIDIX:
-      oraMem(mem.readWord(byte) + Y);
-      break;
-
-
-    case EORI:
-      A = A ^ byte;
-      updateStatusZN(A);
-      break;
-
-    case EORZP:
-      eorMem(byte);
-      break;
-
-    case EORZX:
-      eorMem(uint8_t(byte + X));
-      break;
-
-    case EORA:
-      eorMem(word);
-      break;
-
-    case EORAX:
-      eorMem(word + X);
+    // Register Transfers (Complete)
+    case opTAY:
+      cpu->transfer(cpu->A, cpu->Y);
       break;
 
-    case EORAY:
-      eorMem(word + Y);
+    case opTYA:
+      cpu->transfer(cpu->Y, cpu->A);
       break;
 
-    case EORIXID:
-      eorMem(mem.readWord(uint8_t(byte + X)));
+    case opTAX:
+      cpu->transfer(cpu->A, cpu->X);
       break;
 
-    case EORIDIX:
-      eorMem(mem.readWord(byte) + Y);
+    case opTXA:
+      cpu->transfer(cpu->X, cpu->A);
       break;
 
-    case BITZP: {
-      uint8_t M = mem.readByte(byte);
-      uint8_t test = A & M;
-      updateStatusZN(test);
-      Status.bits.N = (M & 0x80) >> 7;
-      Status.bits.O = (M & 0x40) >> 6;
-    }
-    break;
-
-    case BITA: {
-      uint8_t M = mem.readByte(word);
-      uint8_t test = A & M;
-      updateStatusZN(test);
-      Status.bits.N = (M & 0x80) >> 7;
-      Status.bits.O = (M & 0x40) >> 6;
-    }
-    break;
-
-
-    // Shifts
-    case ASLACC: {
-        Status.bits.C = (A >> 7);
-        A = A << 1;
-        updateStatusZN(A);
-      }
+    // Stack operations
+    case opTSX: // Transfer Stack Pointer to X
+      cpu->transfer(cpu->S, cpu->X);
       break;
 
-    case ASLZP:
-      asl(byte);
+    case opTXS: // Transfer X to Stack Pointer
+      cpu->S = cpu->X;
       break;
 
-
-    case ASLZX:
-      asl(uint8_t(byte + X));
+    case opPHA:
+      cpu->stackPush(cpu->A);
       break;
 
-    case ASLA:
-      asl(word);
+    case opPHP: // pushed with B and the reserved bit set
+      cpu->stackPush(cpu->getStatus() | 0x30);
       break;
 
-    case ASLAX:
-      asl(word + X);
+    case opPLA:
+      cpu->A = cpu->stackPop<bus>();
+      cpu->updateStatusZN(cpu->A);
       break;
 
-    case LSR:
-      Status.bits.C = A & 0x01;
-      A = A >> 1;
-      updateStatusZN(A);
+    case opPLP:
+      cpu->setStatus(cpu->stackPop<bus>());
+      cpu->unmasked();
       break;
 
-    case LSRZP:
-      lsr(byte);
+    case opPHX: // 65C02 stack operations
+      cpu->stackPush(cpu->X);
       break;
 
-    case LSRZX:
-      lsr(uint8_t(byte + X));
+    case opPHY:
+      cpu->stackPush(cpu->Y);
       break;
 
-    case LSRA:
-      lsr(word);
+    case opPLX:
+      cpu->X = cpu->stackPop<bus>();
+      cpu->updateStatusZN(cpu->X);
       break;
 
-    case LSRAX:
-      lsr(word + X);
+    case opPLY:
+      cpu->Y = cpu->stackPop<bus>();
+      cpu->updateStatusZN(cpu->Y);
       break;
 
-    case ROLACC: {
-        uint8_t oldCarry = Status.bits.C;
-        Status.bits.C = (A >> 7); // bit 7 -> Carry
-        A = A << 1;
-        A = A + oldCarry;
-        updateStatusZN(A);
+    //
+    // System functions
+    case opNOP: // the undocumented NOPs read their operand
+      if ((mode != Implied) and (mode != Immediate)) {
+        cpu->load<bus, mode>(addr);
       }
       break;
 
-    case ROLZP:
-      rol(byte);
-      break;
-
-    case ROLZX:
-      rol(uint8_t(byte + X));
-      break;
-
-    case ROLA:
-      rol(word);
-      break;
-
-    case ROLAX:
-      rol(word + X);
-      break;
-
-    case RORACC: {
-        uint8_t oldCarry = Status.bits.C;
-        Status.bits.C = (A &0x01); // bit 0 -> Carry
-        A = A >> 1;
-        if (oldCarry) {
-          A = A + 128;
+    case opBRK: {
+        cpu->PC++;
+        cpu->stackPush(cpu->PC >> 8);
+        cpu->stackPush(cpu->PC & 0xFF);
+        cpu->stackPush(cpu->getStatus() | 0x30);
+        cpu->PC = cpu->readWord<bus>(0xFFFE);
+        cpu->Status.bits.I = 1;
+        if (Traits::cmos) {
+          cpu->Status.bits.D = 0;
         }
-        updateStatusZN(A);
       }
       break;
 
-    case RORZP:
-      ror(byte);
-      break;
-
-    case RORZX:
-      ror(uint8_t(byte + X));
+    case opRTI:
+      cpu->setStatus(cpu->stackPop<bus>());
+      cpu->PC = cpu->stackPop<bus>();
+      cpu->PC += cpu->stackPop<bus>() << 8;
+      cpu->unmasked();
       break;
 
-    case RORA:
-      ror(word);
+    case opWAI: // 65C02 WAit for Interrupt, also ends with IRQ masked
+      if ((cpu->irqLines == 0) and not cpu->nmiPending) {
+        cpu->PC = start;
+      }
       break;
 
-    case RORAX:
-      ror(word + X);
+    case opSTP: // 65C02 SToP until reset
+      cpu->PC = start;
+      cpu->halt(Halted);
       break;
 
     //
-    // Register Transfers (Complete)
-    case TAY:
-      transfer(A, Y);
-      break;
+    // NMOS undocumented: read-modify-write combined with an ALU operation
+    case opSLO: { // ASL + ORA
+      uint8_t val = cpu->asl(cpu->readMemory<bus, mode>(addr));
+      cpu->writeMemory<mode>(addr, val);
+      cpu->A |= val;
+      cpu->updateStatusZN(cpu->A);
+    }
+    break;
 
-    case TYA:
-      transfer(Y, A);
-      break;
+    case opRLA: { // ROL + AND
+      uint8_t val = cpu->rol(cpu->readMemory<bus, mode>(addr));
+      cpu->writeMemory<mode>(addr, val);
+      cpu->A &= val;
+      cpu->updateStatusZN(cpu->A);
+    }
+    break;
 
-    case TAX:
-      transfer(A, X);
-      break;
+    case opSRE: { // LSR + EOR
+      uint8_t val = cpu->lsr(cpu->readMemory<bus, mode>(addr));
+      cpu->writeMemory<mode>(addr, val);
+      cpu->A ^= val;
+      cpu->updateStatusZN(cpu->A);
+    }
+    break;
 
-    case TXA:
-      transfer(X, A);
-      break;
+    case opRRA: { // ROR + ADC
+      uint8_t val = cpu->ror(cpu->readMemory<bus, mode>(addr));
+      cpu->writeMemory<mode>(addr, val);
+      cpu->addcarry<variant>(cpu->A, val);
+    }
+    break;
 
-    // Stack operations
-    case TSX: // Transfer Stack Pointer to X
-      X = S;
-      updateStatusZN(X);
-      break;
+    case opDCP: { // DEC + CMP
+      uint8_t val = cpu->readMemory<bus, mode>(addr) - 1;
+      cpu->writeMemory<mode>(addr, val);
+      cpu->updateCompare(cpu->A, val);
+    }
+    break;
 
-    case TXS: // Transfer X to Stack Pointer
-      S = X;
-      break;
+    case opISC: { // INC + SBC
+      uint8_t val = cpu->readMemory<bus, mode>(addr) + 1;
+      cpu->writeMemory<mode>(addr, val);
+      cpu->subcarry<variant>(cpu->A, val);
+    }
+    break;
 
-    case PHA:
-      mem.writeByte(getSPAddr(), A);
-      S--;
+    case opSAX: // store A AND X
+      cpu->writeMemory<mode>(addr, cpu->A & cpu->X);
       break;
 
-    case PHP: {
-        uint8_t oldB = Status.bits.B;
-        uint8_t oldr = Status.bits.r;
-        Status.bits.B = 1;
-        Status.bits.r = 1;
-        mem.writeByte(getSPAddr(), Status.mask);
-        Status.bits.B = oldB;
-        Status.bits.r = oldr;
-        S--;
-      }
+    case opLAX: // LDA + LDX
+      cpu->A = cpu->X = cpu->load<bus, mode>(addr);
+      cpu->updateStatusZN(cpu->A);
       break;
 
-    case PLA:
-      S++;
-      A = mem.readByte(getSPAddr());
-      updateStatusZN(A);
+    case opLAS: // A, X and S = memory AND S
+      cpu->A = cpu->X = cpu->S = cpu->load<bus, mode>(addr) & cpu->S;
+      cpu->updateStatusZN(cpu->A);
       break;
 
-    case PLP:
-      S++;
-      Status.mask = mem.readByte(getSPAddr());
+    case opANC: // AND, C is bit 7 like ASL
+      cpu->A &= addr;
+      cpu->updateStatusZN(cpu->A);
+      cpu->carry = cpu->A >> 7;
       break;
 
-
-    // System functions
-    case NOP:
-      break;
-
-    case BRK: {
-        PC++;
-        stackPush(PC >> 8);
-        stackPush(PC & 0xFF);
-        uint8_t oldB = Status.bits.B;
-        uint8_t oldr = Status.bits.r;
-        Status.bits.B = 1;
-        Status.bits.r = 1;
-        stackPush(Status.mask);
-        Status.bits.B = oldB;
-        Status.bits.r = oldr;
-        PC = mem.readWord(0xFFFE);
-        Status.bits.I = 1;
-      }
+    case opALR: // AND + LSR
+      cpu->A = cpu->lsr(cpu->A & addr);
       break;
 
-    case RTI:
-      Status.mask = stackPop();
-      PC = stackPop();
-      PC += stackPop() << 8;
+    case opARR: // AND + ROR, C and V from bits 6 and 5
+      cpu->arr<variant>(addr);
       break;
 
-    case 0xFF:  // Commands that are invalid
-      running = false;
-      //if (not debugPrint)
-        printf("$%02x", opcode);
-      break;
+    case opSBX: { // X = (A AND X) - immediate, C and flags like CMP
+      uint8_t val = cpu->A & cpu->X;
+      cpu->updateCompare(val, addr);
+      cpu->X = val - addr;
+    }
+    break;
 
-    default:
-      Opc.pf(this, X);
-      running = false;
-      printf("unimplemented command ($%02x) exiting...\n", Opc.opcode);
+    case opINVALID: // the third instruction of a fused pair, see fused()
       break;
   }
 
-  printRegisters();
-
-  if (debugPrint) {
-    printf("\n");
-    //mem.dump(0x8000, 16);
+  // Only checked by jumps, branches and returns, the run loops don't
+  if (canLoop(op) and (cpu->PC == start)) {
+    cpu->halt(LoopDetected);
   }
+}
 
-  if (PC == trcAddr) {
-    debugOn();
-  }
 
-  if (addr == PC) {
-    printf("loop detected (PC: %04X), exiting ...\n", PC);
-    running = false;
+template <Variant variant, Bus bus, Operation op1, AMode mode1, Operation op2,
+          AMode mode2, Operation op3, AMode mode3>
+void CPU::fused(CPU * cpu, uint16_t operand) {
+  execute<variant, bus, op1, mode1>(cpu, operand);
+  execute<variant, bus, op2, mode2>(cpu, cpu->decoded[cpu->PC].operand);
+  if (op3 != opINVALID) {
+    execute<variant, bus, op3, mode3>(cpu, cpu->decoded[cpu->PC].operand);
   }
+}
 
-  return running;
+
+// Commands that are invalid
+void CPU::invalid(CPU * cpu, uint16_t unused) {
+  cpu->halt(IllegalOpcode);
+  cpu->PC++;
 }
+
+
+// The operation names are pasted before they are expanded (BRK, CLC, ...
+// are also opcode macros), so there is one entry macro per variant and bus
+#define ENTRY(variant, bus, opcode, name, operation, mode) \
+  {opcode, name, operation, mode, CPU::execute<variant, bus, operation, mode>},
+#define NMOS_ENTRY(opcode, operation, mode) \
+  ENTRY(NMOS6502, Paged, opcode, #operation, op##operation, mode)
+#define CMOS_ENTRY(opcode, operation, mode) \
+  ENTRY(CMOS65C02, Paged, opcode, #operation, op##operation, mode)
+#define RICOH_ENTRY(opcode, operation, mode) \
+  ENTRY(Ricoh2A03, Paged, opcode, #operation, op##operation, mode)
+#define NMOS_FLAT_ENTRY(opcode, operation, mode) \
+  ENTRY(NMOS6502, Flat, opcode, #operation, op##operation, mode)
+#define CMOS_FLAT_ENTRY(opcode, operation, mode) \
+  ENTRY(CMOS65C02, Flat, opcode, #operation, op##operation, mode)
+#define RICOH_FLAT_ENTRY(opcode, operation, mode) \
+  ENTRY(Ricoh2A03, Flat, opcode, #operation, op##operation, mode)
+
+const Opcode CPU::NmosOpcodes[] = {
+  OPCODE_TABLE(NMOS_ENTRY)
+  ILLEGAL_OPCODE_TABLE(NMOS_ENTRY)
+};
+
+const Opcode CPU::CmosOpcodes[] = {
+  OPCODE_TABLE(CMOS_ENTRY)
+  CMOS_OPCODE_TABLE(CMOS_ENTRY)
+};
+
+const Opcode CPU::RicohOpcodes[] = {
+  OPCODE_TABLE(RICOH_ENTRY)
+  ILLEGAL_OPCODE_TABLE(RICOH_ENTRY)
+};
+
+const Opcode CPU::NmosFlatOpcodes[] = {
+  OPCODE_TABLE(NMOS_FLAT_ENTRY)
+  ILLEGAL_OPCODE_TABLE(NMOS_FLAT_ENTRY)
+};
+
+const Opcode CPU::CmosFlatOpcodes[] = {
+  OPCODE_TABLE(CMOS_FLAT_ENTRY)
+  CMOS_OPCODE_TABLE(CMOS_FLAT_ENTRY)
+};
+
+const Opcode CPU::RicohFlatOpcodes[] = {
+  OPCODE_TABLE(RICOH_FLAT_ENTRY)
+  ILLEGAL_OPCODE_TABLE(RICOH_FLAT_ENTRY)
+};
+
+
+#define PAIR(variant, bus, opc1, op1, mode1, opc2, op2, mode2) \
+  {{opc1, opc2, 0}, 2, CPU::fused<variant, bus, op1, mode1, op2, mode2, opINVALID, Implied>},
+#define TRIPLE(variant, bus, opc1, op1, mode1, opc2, op2, mode2, opc3, op3, mode3) \
+  {{opc1, opc2, opc3}, 3, CPU::fused<variant, bus, op1, mode1, op2, mode2, op3, mode3>},
+#define NMOS_PAIR(opc1, op1, mode1, opc2, op2, mode2) \
+  PAIR(NMOS6502, Paged, opc1, op##op1, mode1, opc2, op##op2, mode2)
+#define NMOS_TRIPLE(opc1, op1, mode1, opc2, op2, mode2, opc3, op3, mode3) \
+  TRIPLE(NMOS6502, Paged, opc1, op##op1, mode1, opc2, op##op2, mode2, opc3, op##op3, mode3)
+#define NMOS_FLAT_PAIR(opc1, op1, mode1, opc2, op2, mode2) \
+  PAIR(NMOS6502, Flat, opc1, op##op1, mode1, opc2, op##op2, mode2)
+#define NMOS_FLAT_TRIPLE(opc1, op1, mode1, opc2, op2, mode2, opc3, op3, mode3) \
+  TRIPLE(NMOS6502, Flat, opc1, op##op1, mode1, opc2, op##op2, mode2, opc3, op##op3, mode3)
+#define CMOS_PAIR(opc1, op1, mode1, opc2, op2, mode2) \
+  PAIR(CMOS65C02, Paged, opc1, op##op1, mode1, opc2, op##op2, mode2)
+#define CMOS_TRIPLE(opc1, op1, mode1, opc2, op2, mode2, opc3, op3, mode3) \
+  TRIPLE(CMOS65C02, Paged, opc1, op##op1, mode1, opc2, op##op2, mode2, opc3, op##op3, mode3)
+#define CMOS_FLAT_PAIR(opc1, op1, mode1, opc2, op2, mode2) \
+  PAIR(CMOS65C02, Flat, opc1, op##op1, mode1, opc2, op##op2, mode2)
+#define CMOS_FLAT_TRIPLE(opc1, op1, mode1, opc2, op2, mode2, opc3, op3, mode3) \
+  TRIPLE(CMOS65C02, Flat, opc1, op##op1, mode1, opc2, op##op2, mode2, opc3, op##op3, mode3)
+#define RICOH_PAIR(opc1, op1, mode1, opc2, op2, mode2) \
+  PAIR(Ricoh2A03, Paged, opc1, op##op1, mode1, opc2, op##op2, mode2)
+#define RICOH_TRIPLE(opc1, op1, mode1, opc2, op2, mode2, opc3, op3, mode3) \
+  TRIPLE(Ricoh2A03, Paged, opc1, op##op1, mode1, opc2, op##op2, mode2, opc3, op##op3, mode3)
+#define RICOH_FLAT_PAIR(opc1, op1, mode1, opc2, op2, mode2) \
+  PAIR(Ricoh2A03, Flat, opc1, op##op1, mode1, opc2, op##op2, mode2)
+#define RICOH_FLAT_TRIPLE(opc1, op1, mode1, opc2, op2, mode2, opc3, op3, mode3) \
+  TRIPLE(Ricoh2A03, Flat, opc1, op##op1, mode1, opc2, op##op2, mode2, opc3, op##op3, mode3)
+
+// Triples first, they can start with the same instructions as a pair
+const Fusion CPU::NmosFusions[] = {
+  FUSED_TRIPLE_TABLE(NMOS_TRIPLE)
+  FUSED_PAIR_TABLE(NMOS_PAIR)
+};
+
+const Fusion CPU::NmosFlatFusions[] = {
+  FUSED_TRIPLE_TABLE(NMOS_FLAT_TRIPLE)
+  FUSED_PAIR_TABLE(NMOS_FLAT_PAIR)
+};
+
+const Fusion CPU::CmosFusions[] = {
+  FUSED_TRIPLE_TABLE(CMOS_TRIPLE)
+  FUSED_PAIR_TABLE(CMOS_PAIR)
+};
+
+const Fusion CPU::CmosFlatFusions[] = {
+  FUSED_TRIPLE_TABLE(CMOS_FLAT_TRIPLE)
+  FUSED_PAIR_TABLE(CMOS_FLAT_PAIR)
+};
+
+const Fusion CPU::RicohFusions[] = {
+  FUSED_TRIPLE_TABLE(RICOH_TRIPLE)
+  FUSED_PAIR_TABLE(RICOH_PAIR)
+};
+
+const Fusion CPU::RicohFlatFusions[] = {
+  FUSED_TRIPLE_TABLE(RICOH_FLAT_TRIPLE)
+  FUSED_PAIR_TABLE(RICOH_FLAT_PAIR)
+};
+
+#define INSTRUCTION_SET(opcodes, fusions, cycles) \
+  {opcodes, sizeof(opcodes) / sizeof(opcodes[0]), \
+   fusions, sizeof(fusions) / sizeof(fusions[0]), cycles}
+
+const CPU::InstructionSet CPU::InstructionSets[][3] = {
+  { // Paged
+    INSTRUCTION_SET(NmosOpcodes, NmosFusions, Cycles),             // NMOS6502
+    INSTRUCTION_SET(CmosOpcodes, CmosFusions, CyclesCMOS),         // CMOS65C02
+    INSTRUCTION_SET(RicohOpcodes, RicohFusions, Cycles),           // Ricoh2A03
+  },
+  { // Flat
+    INSTRUCTION_SET(NmosFlatOpcodes, NmosFlatFusions, Cycles),     // NMOS6502
+    INSTRUCTION_SET(CmosFlatOpcodes, CmosFlatFusions, CyclesCMOS), // CMOS65C02
+    INSTRUCTION_SET(RicohFlatOpcodes, RicohFlatFusions, Cycles),   // Ricoh2A03
+  },
+};
@@ -0,0 +1,442 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief 6502 CPU emulator - loops executed at once
+///
+/// Small loops copying, filling, comparing or searching memory (and delay
+/// loops) are recognized when their first instruction is decoded, like
+/// fused instruction sequences. The decode cache entry then executes the
+/// iterations branching back at once with memmove(), memset() and
+/// comparisons on the host memory, and the last iteration instruction by
+/// instruction. Registers, flags, memory, instruction and cycle counts are
+/// the same as when every instruction is executed.
+///
+/// A recognized loop is made of
+///    LDA, STA and CMP indexed by a counted register (LDA and CMP also
+///    immediate)
+///    INX, INY, DEX and DEY, each register counted once
+///    CPX and CPY immediate or zero page
+///    BNE or BEQ after a CMP leaving the loop
+///    a branch back to the first instruction testing the flags of a count
+///    or a compare of a counted register
+/// Such as the kernal copying screen lines: LDA ($AC),Y; STA ($D1),Y;
+/// LDA ($AE),Y; STA ($F3),Y; DEY; BPL.
+///
+/// Iterations are executed one at a time when the index registers wrap,
+/// or when stores overlap the loop, its pointers, other accesses (except
+/// a copy that is a memmove()) or pages with watch points.
+//===----------------------------------------------------------------------===//
+
+#include <CPU.h>
+#include <Memory.h>
+#include <algorithm>
+
+namespace {
+
+// Value of A for STA and CMP when no LDA precedes them in the loop
+const int EntryA = -1;
+
+bool isIndexed(AMode mode) {
+  return mode == ZeroPageX or mode == ZeroPageY or mode == AbsoluteX or
+         mode == AbsoluteY or mode == IndirectIndexed;
+}
+
+// Index register of an indexed mode, 0 for X and 1 for Y
+int indexRegister(AMode mode) {
+  return (mode == ZeroPageX or mode == AbsoluteX) ? 0 : 1;
+}
+
+// Register counted, 0 for X, 1 for Y, -1 for other operations
+int countedRegister(Operation op) {
+  switch (op) {
+    case opINX: case opDEX:
+      return 0;
+    case opINY: case opDEY:
+      return 1;
+    default:
+      return -1;
+  }
+}
+
+// Register counted or compared, the flags depend on it
+int testedRegister(Operation op) {
+  return (op == opCPX) ? 0 : (op == opCPY) ? 1 : countedRegister(op);
+}
+
+bool isBranch(Operation op) {
+  return op == opBNE or op == opBEQ or op == opBPL or op == opBMI or
+         op == opBCC or op == opBCS;
+}
+
+bool taken(Operation branch, bool zero, bool negative, bool carry) {
+  switch (branch) {
+    case opBNE: return not zero;
+    case opBEQ: return zero;
+    case opBPL: return not negative;
+    case opBMI: return negative;
+    case opBCC: return not carry;
+    default:    return carry; // opBCS
+  }
+}
+
+// Addresses an instruction accesses in the executed iterations
+struct Stream {
+  Operation op; ///< LDA, STA or CMP
+  AMode mode;
+  int base;     ///< address before indexing
+  int first;    ///< address in the first iteration
+  int delta;    ///< address change per iteration
+  int source;   ///< STA and CMP: the LDA that set A or EntryA
+  int lo, hi;   ///< accessed addresses
+};
+
+bool overlaps(int lo1, int hi1, int lo2, int hi2) {
+  return (lo1 <= hi2) and (lo2 <= hi1);
+}
+
+} // namespace
+
+
+// Two passes: the first checks the instructions and finds the branch
+// back, the second the index registers and the values of A
+void CPU::recognizeLoop(uint16_t addr) {
+  Loop loop{};
+  uint32_t pc = addr;
+  while (true) {
+    if ((loop.count == MaxLoopInstructions) or (pc > 0xFFFD) or stopsAt(pc)) {
+      return;
+    }
+    auto & opc = instset[mem.peek(pc)];
+    int step = loop.count++;
+    loop.opcodes[step] = mem.peek(pc);
+    loop.operands[step] = operand(opc.mode, pc);
+    pc += length(opc.mode);
+    if (pc - addr > MaxDecodedLength) {
+      return;
+    }
+
+    Operation op = opc.operation;
+    switch (op) {
+      case opLDA:
+      case opCMP:
+        if ((opc.mode != Immediate) and not isIndexed(opc.mode)) {
+          return;
+        }
+        loop.test = step;
+        break;
+      case opSTA:
+        if (not isIndexed(opc.mode)) {
+          return;
+        }
+        break;
+      case opINX: case opINY: case opDEX: case opDEY: {
+        int r = ((op == opINX) or (op == opDEX)) ? 0 : 1;
+        if (loop.delta[r] != 0) {
+          return;
+        }
+        loop.delta[r] = ((op == opINX) or (op == opINY)) ? 1 : -1;
+        loop.test = step;
+        break;
+      }
+      case opCPX:
+      case opCPY:
+        if ((opc.mode != Immediate) and (opc.mode != ZeroPage)) {
+          return;
+        }
+        loop.test = step;
+        break;
+      default: // the branch back or an exit after a compare
+        if (not isBranch(op) or
+            ((loop.operands[step] != addr) and
+             (((op != opBNE) and (op != opBEQ)) or (step == 0) or
+              (instset[loop.opcodes[step - 1]].operation != opCMP)))) {
+          return;
+        }
+        break;
+    }
+    if (isBranch(op) and (loop.operands[step] == addr)) {
+      break;
+    }
+  }
+
+  int source = EntryA;
+  bool loadsA = false, entryA = false, stores = false, compares = false;
+  for (int step = 0; step < loop.count; step++) {
+    auto & opc = instset[loop.opcodes[step]];
+    if (isIndexed(opc.mode) and (loop.delta[indexRegister(opc.mode)] == 0)) {
+      return;
+    }
+    switch (opc.operation) {
+      case opLDA:
+        loadsA = true;
+        source = step;
+        break;
+      case opSTA:
+        stores = true;
+        if (source == EntryA) {
+          entryA = true;
+        } else if ((instset[loop.opcodes[source]].mode != Immediate) and
+                   (loop.delta[indexRegister(instset[loop.opcodes[source]].mode)] !=
+                    loop.delta[indexRegister(opc.mode)])) {
+          return; // copies reversing the bytes
+        }
+        break;
+      case opCMP:
+        compares = true;
+        entryA |= (source == EntryA);
+        break;
+      default:
+        if (isBranch(opc.operation) and (step < loop.count - 1) and
+            (loop.operands[step] >= addr) and (loop.operands[step] < pc)) {
+          return; // exits must leave the loop
+        }
+        break;
+    }
+  }
+  Operation test = instset[loop.opcodes[loop.test]].operation;
+  Operation back = instset[loop.opcodes[loop.count - 1]].operation;
+  int r = testedRegister(test);
+  if ((stores and compares) or (entryA and loadsA) or (r < 0) or (loop.delta[r] == 0) or
+      (((back == opBCC) or (back == opBCS)) and (test != opCPX) and (test != opCPY))) {
+    return;
+  }
+
+  loops[addr] = loop;
+  auto & inst = decoded[addr];
+  inst.handler = loopGroup;
+  inst.opcode = LoopGroup;
+  inst.length = pc - addr;
+  inst.count = loop.count;
+  inst.cycles = 0;
+  for (int step = 0; step < loop.count; step++) {
+    inst.cycles += opcodeCycles[loop.opcodes[step]];
+  }
+  mem.markCode(pc - 1);
+}
+
+
+// The run loop counts the instructions of one iteration, the remaining
+// budget is at least one iteration
+void CPU::loopGroup(CPU * cpu, uint16_t unused) {
+  uint16_t start = cpu->PC;
+  auto & loop = cpu->loops[start];
+  uint64_t iterations = (cpu->horizon - cpu->instructions) / loop.count;
+  if (iterations > 1) {
+    cpu->skipIterations(loop, std::min<uint64_t>(iterations - 1, 256));
+  }
+  cpu->loopIteration(start, loop);
+}
+
+
+void CPU::skipIterations(const Loop & loop, uint64_t n) {
+  uint16_t start = PC;
+  uint8_t index[2] = {X, Y};
+  int k = n;
+
+  // 1 if register r is counted before the instruction at step
+  auto countedBefore = [&](int step, int r) {
+    for (int i = 0; i < step; i++) {
+      if (countedRegister(instset[loop.opcodes[i]].operation) == r) {
+        return 1;
+      }
+    }
+    return 0;
+  };
+
+  // Iterations branching back, from the tested register
+  auto & test = instset[loop.opcodes[loop.test]];
+  int r = testedRegister(test.operation);
+  int counted = 1;
+  uint8_t limit = 0;
+  if (test.mode != Implied) { // CPX or CPY
+    counted = countedBefore(loop.test, r);
+    limit = (test.mode == Immediate) ? loop.operands[loop.test] : mem.peek(loop.operands[loop.test]);
+  }
+  Operation back = instset[loop.opcodes[loop.count - 1]].operation;
+  int iterations = 0;
+  while (iterations < k) {
+    uint8_t value = index[r] + loop.delta[r] * (iterations + counted);
+    uint8_t result = value - limit;
+    if (not taken(back, result == 0, result & 0x80, value >= limit)) {
+      break;
+    }
+    iterations++;
+  }
+  k = iterations;
+
+  // Addresses accessed, the index registers must not wrap
+  Stream streams[MaxLoopInstructions];
+  int steps[MaxLoopInstructions];
+  int count = 0;
+  int source = EntryA;
+  for (int step = 0; step < loop.count; step++) {
+    auto & opc = instset[loop.opcodes[step]];
+    uint16_t operand = loop.operands[step];
+    if (isIndexed(opc.mode)) {
+      int reg = indexRegister(opc.mode);
+      uint8_t first = index[reg] + loop.delta[reg] * countedBefore(step, reg);
+      auto & s = streams[step];
+      s = {opc.operation, opc.mode, operand, 0, loop.delta[reg], source, 0, 0};
+      if (opc.mode == IndirectIndexed) {
+        s.base = mem.peek(operand) | mem.peek(uint8_t(operand + 1)) << 8;
+      }
+      s.first = s.base + first;
+      k = std::min(k, (s.delta > 0) ? 256 - first : first + 1);
+      steps[count++] = step;
+    }
+    if (opc.operation == opLDA) {
+      source = step;
+    }
+  }
+  if (k == 0) {
+    return;
+  }
+
+  // Ranges of the accessed addresses in k iterations
+  auto setRanges = [&]() {
+    for (int i = 0; i < count; i++) {
+      auto & s = streams[steps[i]];
+      s.lo = s.first + std::min(0, s.delta * (k - 1));
+      s.hi = s.first + std::max(0, s.delta * (k - 1));
+    }
+  };
+  setRanges();
+  int codeLo = start;
+  int codeHi = start + decoded[start].length - 1;
+  for (int i = 0; i < count; i++) {
+    auto & s = streams[steps[i]];
+    int top = ((s.mode == ZeroPageX) or (s.mode == ZeroPageY)) ? 0xFF : 0xFFFF;
+    int access = (s.op == opSTA) ? Memory::Write : Memory::Read;
+    if ((s.hi > top) or not mem.isPlain(s.lo, s.hi - s.lo + 1, access)) {
+      return;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    auto & w = streams[steps[i]];
+    if (w.op != opSTA) {
+      continue;
+    }
+    if (overlaps(w.lo, w.hi, codeLo, codeHi)) {
+      return;
+    }
+    if ((test.mode == ZeroPage) and overlaps(w.lo, w.hi, loop.operands[loop.test], loop.operands[loop.test])) {
+      return;
+    }
+    for (int j = 0; j < count; j++) {
+      auto & s = streams[steps[j]];
+      int pointer = loop.operands[steps[j]];
+      if ((s.mode == IndirectIndexed) and (overlaps(w.lo, w.hi, pointer, pointer) or
+                                           overlaps(w.lo, w.hi, uint8_t(pointer + 1),
+                                                    uint8_t(pointer + 1)))) {
+        return;
+      }
+      if ((i == j) or not overlaps(w.lo, w.hi, s.lo, s.hi)) {
+        continue;
+      }
+      if ((s.op == opSTA) or (w.source != steps[j])) {
+        return;
+      }
+      int distance = (w.first - s.first) * w.delta;
+      if ((distance > 0) and (distance < k)) {
+        k = distance; // later iterations read what earlier ones wrote
+      }
+    }
+  }
+
+  // Value of A (at EntryA) or of the operand at step in an iteration
+  auto value = [&](int step, int iteration) -> uint8_t {
+    if (step == EntryA) {
+      return A;
+    }
+    if (instset[loop.opcodes[step]].mode == Immediate) {
+      return loop.operands[step];
+    }
+    return mem.peek(streams[step].first + streams[step].delta * iteration);
+  };
+
+  // Compares leaving the loop end the iterations before the exit
+  int a = EntryA;
+  for (int step = 0; step < loop.count; step++) {
+    auto & opc = instset[loop.opcodes[step]];
+    if (opc.operation == opLDA) {
+      a = step;
+    }
+    if (opc.operation != opCMP) {
+      continue;
+    }
+    bool exitOnEqual = instset[loop.opcodes[step + 1]].operation == opBEQ;
+    bool streamA = (a != EntryA) and (instset[loop.opcodes[a]].mode != Immediate);
+    const uint8_t * first = nullptr;
+    const uint8_t * second = nullptr;
+    if (not exitOnEqual and streamA and (opc.mode != Immediate) and
+        (streams[a].delta > 0) and (streams[step].delta > 0)) {
+      first = mem.readPointer(streams[a].first, k);
+      second = mem.readPointer(streams[step].first, k);
+    }
+    if ((first != nullptr) and (second != nullptr)) {
+      k = std::mismatch(first, first + k, second).first - first;
+    } else {
+      for (int iteration = 0; iteration < k; iteration++) {
+        if ((value(a, iteration) == value(step, iteration)) == exitOnEqual) {
+          k = iteration;
+          break;
+        }
+      }
+    }
+  }
+  if (k == 0) {
+    return;
+  }
+  setRanges();
+
+  uint8_t lastA = value(source, k - 1);
+  uint64_t pageCrossings = 0;
+  for (int i = 0; i < count; i++) {
+    auto & s = streams[steps[i]];
+    int nextPage = (s.base | 0xFF) + 1;
+    if ((s.op != opSTA) and ((s.mode == AbsoluteX) or (s.mode == AbsoluteY) or
+        (s.mode == IndirectIndexed)) and (s.hi >= nextPage)) {
+      pageCrossings += s.hi - std::max(s.lo, nextPage) + 1;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    auto & w = streams[steps[i]];
+    if (w.op != opSTA) {
+      continue;
+    }
+    if (w.source == EntryA) {
+      mem.fill(w.lo, A, k);
+    } else if (instset[loop.opcodes[w.source]].mode == Immediate) {
+      mem.fill(w.lo, loop.operands[w.source], k);
+    } else {
+      mem.copy(w.lo, streams[w.source].lo, k);
+    }
+  }
+
+  uint16_t end = codeHi + 1;
+  cycles += k * (decoded[start].cycles + (((start ^ end) > 0xFF) ? 2 : 1)) + pageCrossings;
+  instructions += k * loop.count;
+  X += loop.delta[0] * k;
+  Y += loop.delta[1] * k;
+  A = lastA;
+}
+
+
+// Instructions not executed are taken off the counts of the run loop
+void CPU::loopIteration(uint16_t start, const Loop & loop) {
+  for (int step = 0; step < loop.count; step++) {
+    auto & opc = instset[loop.opcodes[step]];
+    uint16_t next = PC + length(opc.mode);
+    opc.handler(this, loop.operands[step]);
+    bool left = (PC != next) or (decoded[start].opcode != LoopGroup);
+    if (left and (step + 1 < loop.count)) {
+      for (int rest = step + 1; rest < loop.count; rest++) {
+        cycles -= opcodeCycles[loop.opcodes[rest]];
+      }
+      instructions -= loop.count - step - 1;
+      return;
+    }
+  }
+}
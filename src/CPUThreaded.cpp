@@ -0,0 +1,143 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief 6502 CPU emulator - direct threaded interpreter core
+///
+/// Alternative to the fetch-execute loop in CPU::run(). Uses the GCC/Clang
+/// labels-as-values extension so every opcode handler ends with its own
+/// indirect jump to the handler of the next opcode, instead of all opcodes
+/// sharing a single dispatch branch. The handlers are the same
+/// CPU::execute<variant, bus, operation, mode> instantiations used by
+/// handleInstruction, inlined for the documented opcodes. The undocumented
+/// and 65C02 opcodes are called through the handler table.
+/// Instructions are taken from the decode cache like in runDecoded().
+///
+/// Enabled at build time with 'make THREADED=1' (defines THREADED_CORE).
+/// Disassembly, register break points and pair statistics are handled by
+/// the instrumented loops only.
+//===----------------------------------------------------------------------===//
+
+#include <CPU.h>
+#include <Memory.h>
+#include <initializer_list>
+#include <utility>
+
+#if defined(THREADED_CORE) && defined(__GNUC__)
+
+namespace {
+
+// Handler addresses by decoded opcode, the opcodes not listed go to
+// tableOpcode
+struct DispatchTable {
+  void * label[LoopGroup + 1];
+
+  DispatchTable(void * tableOpcode, void * decodeInstruction, void * fusedGroup,
+                std::initializer_list<std::pair<int, void *>> handlers) {
+    for (int i = 0; i < 256; i++) {
+      label[i] = tableOpcode;
+    }
+    label[NotDecoded] = decodeInstruction;
+    label[FusedGroup] = fusedGroup;
+    label[LoopGroup] = fusedGroup;
+    for (auto & handler : handlers) {
+      label[handler.first] = handler.second;
+    }
+  }
+};
+
+}
+
+// The variant and bus are selected once per stretch of instructions
+template <int policy>
+void CPU::runThreaded() {
+  bool flat = mem.isFlat();
+  switch (variant) {
+    case NMOS6502:
+      flat ? runThreadedVariant<policy, NMOS6502, Flat>() :
+             runThreadedVariant<policy, NMOS6502, Paged>();
+      break;
+    case CMOS65C02:
+      flat ? runThreadedVariant<policy, CMOS65C02, Flat>() :
+             runThreadedVariant<policy, CMOS65C02, Paged>();
+      break;
+    case Ricoh2A03:
+      flat ? runThreadedVariant<policy, Ricoh2A03, Flat>() :
+             runThreadedVariant<policy, Ricoh2A03, Paged>();
+      break;
+  }
+}
+
+
+template <int policy, Variant variant, Bus bus>
+void CPU::runThreadedVariant() {
+  // Built once per instantiation, the label addresses are constants and
+  // the initialization of a local static is thread safe
+  #define OPCODE_LABEL(opcode, operation, mode) {opcode, &&op_##opcode},
+  static const DispatchTable table(&&table_opcode, &&decode_instruction, &&fused_group,
+                                   { OPCODE_TABLE(OPCODE_LABEL) });
+  #undef OPCODE_LABEL
+  void * const * dispatch = table.label;
+  Decoded * inst{nullptr};
+  uint8_t count{0};
+
+  // Fetch and jump to the next handler. Stops at the horizon (budget or
+  // halt()), at a break point or when the trace address is reached (debug
+  // is then handled by the instrumented loop).
+  #define DISPATCH()                                               \
+    if ((instructions >= horizon) or stopHere<policy>()) {         \
+      return;                                                      \
+    }                                                              \
+    inst = &decoded[PC];                                           \
+    goto *dispatch[inst->opcode];
+
+  #define NEXT()                                                   \
+    instructions++;                                                \
+    DISPATCH()
+
+  if (instructions >= horizon) {
+    return;
+  }
+  inst = &decoded[PC];
+  goto *dispatch[inst->opcode];
+
+  #define OPCODE_HANDLER(opcode, operation, mode)    \
+    op_##opcode:                                     \
+      cycles += inst->cycles;                        \
+      execute<variant, bus, op##operation, mode>(this, inst->operand); \
+      NEXT();
+  OPCODE_TABLE(OPCODE_HANDLER)
+  #undef OPCODE_HANDLER
+
+fused_group:
+  if (instructions + inst->count > horizon) {
+    uint8_t opcode = mem.peek(PC);
+    cycles += opcodeCycles[opcode];
+    instset[opcode].handler(this, inst->operand);
+    NEXT();
+  }
+  count = inst->count; // the handler can invalidate the entry
+  cycles += inst->cycles;
+  inst->handler(this, inst->operand);
+  instructions += count;
+  DISPATCH();
+
+decode_instruction:
+  inst = &decode(PC);
+  goto *dispatch[inst->opcode];
+
+table_opcode: // not in OPCODE_TABLE, or invalid()
+  cycles += inst->cycles;
+  inst->handler(this, inst->operand);
+  NEXT();
+  #undef NEXT
+  #undef DISPATCH
+}
+
+template void CPU::runThreaded<CPU::Plain>();
+template void CPU::runThreaded<CPU::StopAtTrace>();
+template void CPU::runThreaded<CPU::Breakpoints>();
+template void CPU::runThreaded<CPU::StopAtTrace | CPU::Breakpoints>();
+
+#endif
@@ -11,17 +11,24 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 namespace Sim6502 {
 
 class Config {
 public:
   bool debug{false};          ///< trace on?
+  bool jit{false};            ///< translate to native code?
+  bool pairStats{false};      ///< print most executed instruction pairs?
   int programIndex{4};        ///< which hardcoded program to run
   uint16_t loadAddr{0x0000};  ///< where to start loading
   uint16_t bootAddr{0x0000};  ///< where to start execution
   uint16_t traceAddr{0xFFFF}; ///< where to begin outputting trace
+  std::vector<uint16_t> breakAddrs; ///< where to stop execution
+  std::vector<uint16_t> watchAddrs; ///< stop on reads and writes here
   std::string filename = "";  ///< for loading binary files
+  std::string batchFile = ""; ///< job list for batch mode
+  int threads{0};             ///< batch workers, 0 for one per core
 };
 
 }
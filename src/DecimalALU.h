@@ -0,0 +1,88 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Decimal mode ADC and SBC of the NMOS 6502
+///
+/// add() and subtract() compute the result and the flag values of one
+/// instruction. The tables hold them for all (C, A, M), built on first use
+/// (1 MB). The CPU uses them when built with 'make ALU_TABLES=1' (defines
+/// ALU_TABLES), see CPU::addcarry()
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class DecimalALU {
+public:
+  // Result and flags packed in 32 bits: the value in bits 0-7, the value
+  // Z is derived from in bits 8-15, N in bits 16-23, C in bit 24 and V in
+  // bit 25. Z and N are from the binary sum, or intermediate result, like
+  // on the NMOS 6502
+  typedef uint32_t Result;
+
+  static uint8_t value(Result r) { return r; }
+  static uint8_t resultZ(Result r) { return r >> 8; }
+  static uint8_t resultN(Result r) { return r >> 16; }
+  static uint8_t carry(Result r) { return (r >> 24) & 1; }
+  static uint8_t overflow(Result r) { return (r >> 25) & 1; }
+
+  static Result add(uint8_t a, uint8_t m, uint8_t c) {
+    unsigned int tmp = a + m + c;
+    uint8_t z = tmp;
+    if (((a & 0xF) + (m & 0xF) + c) > 9) {
+      tmp += 6;
+    }
+    uint8_t n = tmp;
+    bool v = ~(a ^ m) & (a ^ tmp) & 0x80;
+    if (tmp > 0x99) {
+      tmp += 96;
+    }
+    return pack(tmp, z, n, tmp > 0x99, v);
+  }
+
+  static Result subtract(uint8_t a, uint8_t m, uint8_t c) {
+    unsigned int tmp = a - m - (c ^ 1);
+    uint8_t zn = tmp;
+    bool v = (a ^ tmp) & (a ^ m) & 0x80;
+    if (((a & 0x0F) - (c ^ 1)) < (m & 0x0F)) {
+      tmp -= 6;
+    }
+    if (tmp > 0x99) {
+      tmp -= 0x60;
+    }
+    return pack(tmp, zn, zn, tmp < 0x100, v);
+  }
+
+  // add() and subtract() by table lookup
+  Result adc(uint8_t a, uint8_t m, uint8_t c) const { return adcTable[index(a, m, c)]; }
+  Result sbc(uint8_t a, uint8_t m, uint8_t c) const { return sbcTable[index(a, m, c)]; }
+
+  // The tables, shared by all CPUs
+  static const DecimalALU & get() {
+    static const DecimalALU alu;
+    return alu;
+  }
+
+private:
+  DecimalALU() : adcTable(Entries), sbcTable(Entries) {
+    for (int i = 0; i < Entries; i++) {
+      adcTable[i] = add(i >> 8, i, i >> 16);
+      sbcTable[i] = subtract(i >> 8, i, i >> 16);
+    }
+  }
+
+  static constexpr int Entries{2 * 256 * 256}; ///< C, A, M
+
+  static int index(uint8_t a, uint8_t m, uint8_t c) { return c << 16 | a << 8 | m; }
+
+  static Result pack(uint8_t value, uint8_t z, uint8_t n, bool c, bool v) {
+    return value | z << 8 | n << 16 | c << 24 | v << 25;
+  }
+
+  std::vector<Result> adcTable;
+  std::vector<Result> sbcTable;
+};
@@ -0,0 +1,86 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Read-only contents of a ROM or program file
+///
+/// The file is mapped with mmap(), so emulator processes using the same
+/// ROM files share their pages. Files shorter than the requested size are
+/// read into a zero padded buffer instead (reading past the end of a
+/// mapping faults). Errors are printed and exit the program, announcing
+/// the file is up to the caller
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class FileImage {
+public:
+  // The whole file
+  FileImage(std::string fileName) : FileImage(fileName, 0, false) { }
+
+  // size bytes of the file, zero padded
+  FileImage(std::string fileName, uint32_t size) : FileImage(fileName, size, true) { }
+
+  ~FileImage() {
+    if (mapped != nullptr) {
+      munmap(mapped, length);
+    }
+  }
+
+  FileImage(const FileImage &) = delete;
+  FileImage & operator=(const FileImage &) = delete;
+
+  const uint8_t * data() const { return image; }
+  uint32_t size() const { return length; }
+
+private:
+  FileImage(std::string fileName, uint32_t size, bool fixedSize) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    struct stat st;
+    if ((fd < 0) or (fstat(fd, &st) != 0)) {
+      printf("error: could not open %s\n", fileName.c_str());
+      exit(1);
+    }
+    uint64_t fileSize = st.st_size;
+    if (not fixedSize and (fileSize > UINT32_MAX)) {
+      printf("error: %s is too large\n", fileName.c_str());
+      exit(1);
+    }
+    length = fixedSize ? size : fileSize;
+
+    if ((length > 0) and (fileSize >= length)) {
+      void * addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr != MAP_FAILED) {
+        mapped = addr;
+        image = (const uint8_t *)addr;
+        close(fd);
+        return;
+      }
+    }
+
+    buffer.resize(length);
+    uint32_t bytes = 0;
+    ssize_t n;
+    while ((bytes < length) and ((n = read(fd, buffer.data() + bytes, length - bytes)) > 0)) {
+      bytes += n;
+    }
+    close(fd);
+    image = buffer.data();
+  }
+
+  void * mapped{nullptr};
+  const uint8_t * image{nullptr};
+  uint32_t length{0};
+  std::vector<uint8_t> buffer; ///< when not mapped
+};
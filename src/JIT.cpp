@@ -0,0 +1,841 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Basic block compiler from 6502 to x86-64 machine code
+///
+/// Register usage in the generated code:
+///    rbx - pointer to the CPU object (registers, flags, counters)
+///    r12 - pointer to the 64K memory array, for zero page and stack
+///    r13 - pointer to the instruction horizon (CPU::horizon)
+///    eax, ecx, edx, rdi, rsi - scratch
+/// The 6502 registers and the lazily evaluated flags live in the CPU object
+/// so the interpreter handlers called from generated code see the current
+/// state.
+//===----------------------------------------------------------------------===//
+
+#include <CPU.h>
+#include <JIT.h>
+#include <algorithm>
+#include <sys/mman.h>
+
+// Status register bits
+const uint8_t FlagI = 0x04;
+const uint8_t FlagD = 0x08;
+
+
+JIT::JIT(CPU & Cpu)
+    : cpu(Cpu), entry(65536), count(65536), end(65536), invalidations(65536) {
+  buffer = (uint8_t *)mmap(nullptr, BufferSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    printf("error: could not allocate executable memory\n");
+    exit(1);
+  }
+
+  uint8_t * base = (uint8_t *)&cpu;
+  offA = (uint8_t *)&cpu.A - base;
+  offX = (uint8_t *)&cpu.X - base;
+  offY = (uint8_t *)&cpu.Y - base;
+  offS = (uint8_t *)&cpu.S - base;
+  offPC = (uint8_t *)&cpu.PC - base;
+  offStatus = (uint8_t *)&cpu.Status.mask - base;
+  offResultZ = (uint8_t *)&cpu.resultZ - base;
+  offResultN = (uint8_t *)&cpu.resultN - base;
+  offCarry = (uint8_t *)&cpu.carry - base;
+  offOverflow = (uint8_t *)&cpu.overflow - base;
+  offInstructions = (uint8_t *)&cpu.instructions - base;
+  offCycles = (uint8_t *)&cpu.cycles - base;
+}
+
+JIT::~JIT() {
+  munmap(buffer, BufferSize);
+}
+
+bool JIT::supported() {
+#if defined(__x86_64__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+JitCode JIT::lookup(uint16_t addr) {
+  if ((entry[addr] == nullptr) and (invalidations[addr] < MaxInvalidations)) {
+    entry[addr] = translate(addr);
+  }
+  return entry[addr];
+}
+
+
+void JIT::invalidate(uint16_t address, uint32_t length) {
+  if (length >= 65536) {
+    flush();
+    return;
+  }
+  uint32_t last = address + length - 1;
+  for (uint32_t page = address >> 8; page <= (last >> 8); page++) {
+    auto & blocks = pageBlocks[page];
+    for (size_t i = 0; i < blocks.size(); ) {
+      uint16_t start = blocks[i];
+      if ((entry[start] != nullptr) and (start <= last) and (end[start] > address)) {
+        entry[start] = nullptr;
+        if (invalidations[start] < MaxInvalidations) {
+          invalidations[start]++;
+        }
+        dirty = true;
+      }
+      if (entry[start] == nullptr) {
+        blocks[i] = blocks.back();
+        blocks.pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+}
+
+
+void JIT::flush() {
+  std::fill(entry.begin(), entry.end(), nullptr);
+  for (auto & blocks : pageBlocks) {
+    blocks.clear();
+  }
+  used = 0;
+  dirty = true;
+}
+
+
+JitCode JIT::translate(uint16_t start) {
+  if (used + (MaxBlockInstructions + 1) * MaxInstructionBytes > BufferSize) {
+    flush();
+  }
+  if (cpu.decode(start).opcode == LoopGroup) {
+    return nullptr; // executed at once by the interpreter
+  }
+  p = buffer + used;
+  uint8_t * code = p;
+
+  emit({0x53, 0x41, 0x54, 0x41, 0x55}); // push rbx; push r12; push r13
+  emit({0x48, 0x89, 0xFB});             // mov rbx, rdi
+  emit({0x49, 0xBC});                   // mov r12, imm64
+  emit64((uint64_t)cpu.mem.mem);
+  emit({0x49, 0xBD});                   // mov r13, &horizon
+  emit64((uint64_t)&cpu.horizon);
+  blockStart = start;
+  loopStart = p;
+  blockCycles = 0;
+
+  uint32_t pc = start;
+  uint16_t last = start;
+  int n = 0;
+  bool terminated = false;
+  while ((n < MaxBlockInstructions) and not terminated) {
+    if ((n > 0) and cpu.stopsAt(pc)) {
+      break;
+    }
+    uint8_t opcode = cpu.mem.peek(pc);
+    auto & opc = cpu.instset[opcode];
+    int len = CPU::length(opc.mode);
+    if ((opc.operation == opINVALID) or (pc + len > 0xFFFF)) {
+      break;
+    }
+    uint16_t operand = cpu.operand(opc.mode, pc);
+    blockCycles += cpu.opcodeCycles[opcode];
+
+    switch (opc.operation) { // other branches leave through side exits
+      case opBRK: case opJMP: case opJSR: case opRTS: case opRTI:
+      case opBRA: case opBBR: case opBBS: case opWAI: case opSTP:
+        terminated = true;
+        break;
+      case opBCC: case opBCS: case opBEQ: case opBMI:
+      case opBNE: case opBPL: case opBVC: case opBVS:
+        terminated = loopsToStart(pc, operand);
+        break;
+      default:
+        break;
+    }
+
+    if (not emitInstruction(opcode, pc, operand, n + 1)) {
+      emitCall(pc, operand, (void *)opc.handler);
+      switch (opc.operation) { // instructions that may write to code
+        case opSTA: case opSTX: case opSTY: case opINC: case opDEC:
+        case opPHA: case opPHP: case opSTZ: case opTRB: case opTSB:
+        case opRMB: case opSMB: case opPHX: case opPHY: case opSAX:
+        case opSLO: case opRLA: case opSRE: case opRRA: case opDCP:
+        case opISC:
+          emitDirtyCheck(pc, n + 1);
+          break;
+        case opASL: case opLSR: case opROL: case opROR:
+          if (opc.mode != Accumulator) {
+            emitDirtyCheck(pc, n + 1);
+          }
+          break;
+        default:
+          break;
+      }
+    }
+
+    cpu.mem.markCode(pc);
+    cpu.mem.markCode(pc + len - 1);
+    last = pc;
+    pc += len;
+    n++;
+  }
+
+  if (n == 0) {
+    return nullptr;
+  }
+  if (not terminated) {
+    emit({0x66, 0xC7, 0x83}); // mov word [rbx + PC], imm16
+    emit32(offPC);
+    emit16(pc);
+  }
+  emitExit(last, n, blockCycles);
+
+  used = p - buffer;
+  count[start] = n;
+  end[start] = pc;
+  for (uint32_t page = start >> 8; page <= ((pc - 1) >> 8); page++) {
+    pageBlocks[page].push_back(start);
+  }
+  return (JitCode)code;
+}
+
+
+// Native code for the instruction, returns false if not supported
+bool JIT::emitInstruction(uint8_t opcode, uint16_t addr, uint16_t operand,
+                          int instructions) {
+  auto & opc = cpu.instset[opcode];
+  uint16_t next = addr + CPU::length(opc.mode);
+  int32_t reg;
+
+  switch (opc.operation) {
+    case opLDA:
+    case opLDX:
+    case opLDY:
+      reg = (opc.operation == opLDA) ? offA : (opc.operation == opLDX) ? offX : offY;
+      if (not emitLoadOperand(opc.mode, operand)) {
+        return false;
+      }
+      emitPageCross(opc.mode, operand);
+      emit({0x88, 0x83}); // mov [rbx + reg], al
+      emit32(reg);
+      emitUpdateZN();
+      return true;
+
+    case opSTA:
+    case opSTX:
+    case opSTY:
+      return emitStore(opcode, addr, operand, instructions);
+
+    case opPHA:
+    case opPHP:
+      return emitPush(opcode, addr, instructions);
+
+    case opPLA:
+    case opPLP:
+      if (opc.operation == opPLP) {
+        emitIrqCheck(opcode, addr, instructions);
+      }
+      emit({0x0F, 0xB6, 0x8B}); // movzx ecx, byte [rbx + S]
+      emit32(offS);
+      emit({0xFE, 0xC1});       // inc cl
+      emit({0x88, 0x8B});       // mov [rbx + S], cl
+      emit32(offS);
+      emit({0x41, 0x0F, 0xB6, 0x84, 0x0C}); // movzx eax, byte [r12 + rcx + 0x100]
+      emit32(0x100);
+      if (opc.operation == opPLA) {
+        emit({0x88, 0x83});     // mov [rbx + A], al
+        emit32(offA);
+        emitUpdateZN();
+      } else {
+        emitSetStatus();
+      }
+      return true;
+
+    case opADC:
+    case opSBC:
+      return emitAddSubtract(opcode, addr, operand);
+
+    case opTAX: case opTAY: case opTXA: case opTYA: case opTSX: case opTXS: {
+      int32_t src, dst;
+      switch (opc.operation) {
+        case opTAX: src = offA; dst = offX; break;
+        case opTAY: src = offA; dst = offY; break;
+        case opTXA: src = offX; dst = offA; break;
+        case opTYA: src = offY; dst = offA; break;
+        case opTSX: src = offS; dst = offX; break;
+        default:    src = offX; dst = offS; break;
+      }
+      emit({0x0F, 0xB6, 0x83}); // movzx eax, byte [rbx + src]
+      emit32(src);
+      emit({0x88, 0x83});       // mov [rbx + dst], al
+      emit32(dst);
+      if (opc.operation != opTXS) {
+        emitUpdateZN();
+      }
+      return true;
+    }
+
+    case opINX: case opINY: case opDEX: case opDEY:
+      reg = (opc.operation == opINX or opc.operation == opDEX) ? offX : offY;
+      emit({0x0F, 0xB6, 0x83}); // movzx eax, byte [rbx + reg]
+      emit32(reg);
+      if (opc.operation == opINX or opc.operation == opINY) {
+        emit({0xFE, 0xC0});     // inc al
+      } else {
+        emit({0xFE, 0xC8});     // dec al
+      }
+      emit({0x88, 0x83});       // mov [rbx + reg], al
+      emit32(reg);
+      emitUpdateZN();
+      return true;
+
+    case opAND: case opORA: case opEOR:
+      if (not emitLoadOperand(opc.mode, operand)) {
+        return false;
+      }
+      emitPageCross(opc.mode, operand);
+      emit({0x0F, 0xB6, 0x93}); // movzx edx, byte [rbx + A]
+      emit32(offA);
+      if (opc.operation == opAND) {
+        emit({0x20, 0xD0});     // and al, dl
+      } else if (opc.operation == opORA) {
+        emit({0x08, 0xD0});     // or al, dl
+      } else {
+        emit({0x30, 0xD0});     // xor al, dl
+      }
+      emit({0x88, 0x83});       // mov [rbx + A], al
+      emit32(offA);
+      emitUpdateZN();
+      return true;
+
+    case opCMP: case opCPX: case opCPY:
+      if (not emitLoadOperand(opc.mode, operand)) {
+        return false;
+      }
+      emitPageCross(opc.mode, operand);
+      emitCompare((opc.operation == opCMP) ? offA : (opc.operation == opCPX) ? offX : offY);
+      return true;
+
+    case opCLC: case opSEC: case opCLV:
+      emit({0xC6, 0x83});       // mov byte [rbx + C/V], imm8
+      emit32((opc.operation == opCLV) ? offOverflow : offCarry);
+      emit8(opc.operation == opSEC);
+      return true;
+
+    case opCLD: case opCLI: {
+      uint8_t flag = (opc.operation == opCLD) ? FlagD : FlagI;
+      if (opc.operation == opCLI) {
+        emitIrqCheck(opcode, addr, instructions);
+      }
+      emit({0x80, 0xA3});       // and byte [rbx + Status], ~flag
+      emit32(offStatus);
+      emit8(~flag);
+      return true;
+    }
+
+    case opSED: case opSEI: {
+      uint8_t flag = (opc.operation == opSED) ? FlagD : FlagI;
+      emit({0x80, 0x8B});       // or byte [rbx + Status], flag
+      emit32(offStatus);
+      emit8(flag);
+      return true;
+    }
+
+    case opNOP: // the undocumented NOPs read memory
+      return opc.mode == Implied;
+
+    // taken if (flag value & mask) is non-zero, or zero
+    case opBCC: emitBranch(offCarry,    0xFF, false, next, operand, addr, instructions); return true;
+    case opBCS: emitBranch(offCarry,    0xFF, true,  next, operand, addr, instructions); return true;
+    case opBNE: emitBranch(offResultZ,  0xFF, true,  next, operand, addr, instructions); return true;
+    case opBEQ: emitBranch(offResultZ,  0xFF, false, next, operand, addr, instructions); return true;
+    case opBPL: emitBranch(offResultN,  0x80, false, next, operand, addr, instructions); return true;
+    case opBMI: emitBranch(offResultN,  0x80, true,  next, operand, addr, instructions); return true;
+    case opBVC: emitBranch(offOverflow, 0xFF, false, next, operand, addr, instructions); return true;
+    case opBVS: emitBranch(offOverflow, 0xFF, true,  next, operand, addr, instructions); return true;
+
+    case opJMP:
+      if (opc.mode != Absolute) {
+        return false;
+      }
+      emit({0x66, 0xC7, 0x83}); // mov word [rbx + PC], imm16
+      emit32(offPC);
+      emit16(operand);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+
+// Effective address into ecx (zero extended), clobbers edx
+bool JIT::emitAddress(int mode, uint16_t operand) {
+  switch (mode) {
+    case ZeroPage:
+    case Absolute:
+      emit8(0xB9);                     // mov ecx, imm32
+      emit32(operand);
+      return true;
+
+    case ZeroPageX:
+    case ZeroPageY:
+    case AbsoluteX:
+    case AbsoluteY:
+      emit({0x0F, 0xB6, 0x8B});        // movzx ecx, byte [rbx + X/Y]
+      emit32((mode == ZeroPageX or mode == AbsoluteX) ? offX : offY);
+      emit({0x81, 0xC1});              // add ecx, imm32
+      emit32(operand);
+      if (mode == ZeroPageX or mode == ZeroPageY) {
+        emit({0x0F, 0xB6, 0xC9});      // movzx ecx, cl
+      } else {
+        emit({0x0F, 0xB7, 0xC9});      // movzx ecx, cx
+      }
+      return true;
+
+    case IndexedIndirect:
+      emit({0x0F, 0xB6, 0x8B});        // movzx ecx, byte [rbx + X]
+      emit32(offX);
+      emit({0x81, 0xC1});              // add ecx, imm32
+      emit32(operand);
+      emit({0x0F, 0xB6, 0xC9});        // movzx ecx, cl
+      emitZeroPagePointer();
+      return true;
+
+    case IndirectIndexed:
+      if (operand == 0xFF) {
+        emit8(0xB9);                   // mov ecx, 0xFF
+        emit32(0xFF);
+        emitZeroPagePointer();
+      } else {
+        emit({0x41, 0x0F, 0xB7, 0x8C, 0x24}); // movzx ecx, word [r12 + disp32]
+        emit32(operand);
+      }
+      emit({0x0F, 0xB6, 0x93});        // movzx edx, byte [rbx + Y]
+      emit32(offY);
+      emit({0x01, 0xD1});              // add ecx, edx
+      emit({0x0F, 0xB7, 0xC9});        // movzx ecx, cx
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+
+// The pointer in zero page at ecx (0-$FF) into ecx, the high byte of a
+// pointer at $FF is read from $00. Clobbers edx
+void JIT::emitZeroPagePointer() {
+  emit({0x41, 0x0F, 0xB6, 0x14, 0x0C}); // movzx edx, byte [r12 + rcx]
+  emit({0xFE, 0xC1});                   // inc cl
+  emit({0x41, 0x0F, 0xB6, 0x0C, 0x0C}); // movzx ecx, byte [r12 + rcx]
+  emit({0xC1, 0xE1, 0x08});             // shl ecx, 8
+  emit({0x09, 0xD1});                   // or ecx, edx
+}
+
+
+// Operand value into eax (zero extended), clobbers ecx, edx, esi and edi.
+// Reads through the page's read pointer, pages without one (I/O) call
+// Memory::readByte()
+bool JIT::emitLoadOperand(int mode, uint16_t operand) {
+  if (mode == Immediate) {
+    emit8(0xB8);                       // mov eax, imm32
+    emit32(operand);
+    return true;
+  }
+  if (not emitAddress(mode, operand)) {
+    return false;
+  }
+  emit({0x89, 0xCE});                  // mov esi, ecx
+  emit({0xC1, 0xEE, 0x08});            // shr esi, 8
+  emit({0x48, 0xBF});                  // mov rdi, &reads
+  emit64((uint64_t)cpu.mem.reads);
+  emit({0x48, 0x8B, 0x3C, 0xF7});      // mov rdi, [rdi + rsi * 8]
+  emit({0x48, 0x85, 0xFF});            // test rdi, rdi
+  emit8(0x74);                         // jz slow
+  uint8_t * slow = p++;
+  emit({0x0F, 0xB6, 0xF1});            // movzx esi, cl
+  emit({0x0F, 0xB6, 0x04, 0x37});      // movzx eax, byte [rdi + rsi]
+  emit8(0xEB);                         // jmp done
+  uint8_t * done = p++;
+  patch8(slow);
+  emit({0x51, 0x52});                  // push rcx; push rdx
+  emit({0x48, 0xBF});                  // mov rdi, &mem
+  emit64((uint64_t)&cpu.mem);
+  emit({0x89, 0xCE});                  // mov esi, ecx
+  emit({0x48, 0xB8});                  // mov rax, readByte
+  emit64((uint64_t)&readByte);
+  emit({0xFF, 0xD0});                  // call rax
+  emit({0x0F, 0xB6, 0xC0});            // movzx eax, al
+  emit({0x5A, 0x59});                  // pop rdx; pop rcx
+  patch8(done);
+  return true;
+}
+
+
+uint8_t JIT::readByte(Memory * mem, uint16_t address) {
+  return mem->readByte(address);
+}
+
+
+// Add a cycle if an indexed read crossed a page. Expects the address in
+// ecx and, for IndirectIndexed, Y in edx (see emitAddress())
+void JIT::emitPageCross(int mode, uint16_t operand) {
+  if (mode == AbsoluteX or mode == AbsoluteY) {
+    emit({0x80, 0xF9});                // cmp cl, operand low byte
+    emit8(operand & 0xFF);
+  } else if (mode == IndirectIndexed) {
+    emit({0x38, 0xD1});                // cmp cl, dl
+  } else {
+    return;
+  }
+  emit({0x48, 0x83, 0x93});            // adc qword [rbx + cycles], 0
+  emit32(offCycles);
+  emit8(0x00);
+}
+
+
+// Store A, X or Y through the page's write pointer. Stores to pages
+// without one (such as code pages) go through the instruction handler so
+// the write is reported. Zero page stores write memory directly unless
+// they are below Memory::zeroPageSlow (the port, watch points or code).
+bool JIT::emitStore(uint8_t opcode, uint16_t addr, uint16_t operand, int instructions) {
+  auto & opc = cpu.instset[opcode];
+  if (not emitAddress(opc.mode, operand)) {
+    return false;
+  }
+  bool zeroPage = (opc.mode == ZeroPage) or (opc.mode == ZeroPageX) or (opc.mode == ZeroPageY);
+  emit({0x0F, 0xB6, 0x83});            // movzx eax, byte [rbx + reg]
+  emit32((opc.operation == opSTA) ? offA : (opc.operation == opSTX) ? offX : offY);
+  if (zeroPage) {
+    emit({0x48, 0xBA});                // mov rdx, &zeroPageSlow
+    emit64((uint64_t)&cpu.mem.zeroPageSlow);
+    emit({0x3B, 0x0A});                // cmp ecx, [rdx]
+    emit8(0x73);                       // jae fast
+  } else {
+    emit({0x48, 0xBF});                // mov rdi, &writes
+    emit64((uint64_t)cpu.mem.writes);
+    emit({0x89, 0xCE});                // mov esi, ecx
+    emit({0xC1, 0xEE, 0x08});          // shr esi, 8
+    emit({0x48, 0x8B, 0x3C, 0xF7});    // mov rdi, [rdi + rsi * 8]
+    emit({0x48, 0x85, 0xFF});          // test rdi, rdi
+    emit8(0x75);                       // jnz fast
+  }
+  uint8_t * fast = p++;
+  emitCall(addr, operand, (void *)opc.handler);
+  emitDirtyCheck(addr, instructions);
+  emit8(0xEB);                         // jmp done
+  uint8_t * done = p++;
+  patch8(fast);
+  if (zeroPage) {
+    emit({0x41, 0x88, 0x04, 0x0C});    // mov [r12 + rcx], al
+  } else {
+    emit({0x0F, 0xB6, 0xF1});          // movzx esi, cl
+    emit({0x88, 0x04, 0x37});          // mov [rdi + rsi], al
+  }
+  patch8(done);
+  return true;
+}
+
+
+// Push A or the status register (with B and the reserved bit set). Uses
+// the instruction handler if the stack page has page flags set.
+bool JIT::emitPush(uint8_t opcode, uint16_t addr, int instructions) {
+  auto & opc = cpu.instset[opcode];
+  emit({0x0F, 0xB6, 0x8B});            // movzx ecx, byte [rbx + S]
+  emit32(offS);
+  if (opc.operation == opPHA) {
+    emit({0x0F, 0xB6, 0x83});          // movzx eax, byte [rbx + A]
+    emit32(offA);
+  } else {
+    emitGetStatus();
+    emit({0x83, 0xC8, 0x30});          // or eax, B | r
+  }
+  emit({0x48, 0xBA});                  // mov rdx, &pageFlags[1]
+  emit64((uint64_t)&cpu.mem.pageFlags[1]);
+  emit({0x80, 0x3A, 0x00});            // cmp byte [rdx], 0
+  emit8(0x74);                         // je fast
+  uint8_t * fast = p++;
+  emitCall(addr, 0, (void *)opc.handler);
+  emitDirtyCheck(addr, instructions);
+  emit8(0xEB);                         // jmp done
+  uint8_t * done = p++;
+  patch8(fast);
+  emit({0x41, 0x88, 0x84, 0x0C});      // mov [r12 + rcx + 0x100], al
+  emit32(0x100);
+  emit({0xFE, 0x8B});                  // dec byte [rbx + S]
+  emit32(offS);
+  patch8(done);
+  return true;
+}
+
+
+// Set Z and N from al
+void JIT::emitUpdateZN() {
+  emit({0x88, 0x83});                   // mov [rbx + resultZ], al
+  emit32(offResultZ);
+  emit({0x88, 0x83});                   // mov [rbx + resultN], al
+  emit32(offResultN);
+}
+
+
+// Status register into eax (as CPU::getStatus()), clobbers edx
+void JIT::emitGetStatus() {
+  emit({0x0F, 0xB6, 0x83});             // movzx eax, byte [rbx + Status]
+  emit32(offStatus);
+  emit({0x83, 0xE0, 0x3C});             // and eax, I | D | B | r
+  emit({0x0A, 0x83});                   // or al, [rbx + carry]
+  emit32(offCarry);
+  emit({0x80, 0xBB});                   // cmp byte [rbx + resultZ], 0
+  emit32(offResultZ);
+  emit8(0x00);
+  emit({0x75, 0x03});                   // jne +3
+  emit({0x83, 0xC8, 0x02});             // or eax, Z
+  emit({0x80, 0xBB});                   // cmp byte [rbx + overflow], 0
+  emit32(offOverflow);
+  emit8(0x00);
+  emit({0x74, 0x03});                   // je +3
+  emit({0x83, 0xC8, 0x40});             // or eax, V
+  emit({0x0F, 0xB6, 0x93});             // movzx edx, byte [rbx + resultN]
+  emit32(offResultN);
+  emit({0x83, 0xE2, 0x80});             // and edx, N
+  emit({0x09, 0xD0});                   // or eax, edx
+}
+
+
+// Status register from al (as CPU::setStatus()), clobbers edx
+void JIT::emitSetStatus() {
+  emit({0x88, 0x83});                   // mov [rbx + Status], al
+  emit32(offStatus);
+  emit({0x88, 0x83});                   // mov [rbx + resultN], al
+  emit32(offResultN);
+  emit({0x89, 0xC2});                   // mov edx, eax
+  emit({0x83, 0xE2, 0x01});             // and edx, C
+  emit({0x88, 0x93});                   // mov [rbx + carry], dl
+  emit32(offCarry);
+  emit({0x89, 0xC2});                   // mov edx, eax
+  emit({0x83, 0xE2, 0x40});             // and edx, V
+  emit({0x88, 0x93});                   // mov [rbx + overflow], dl
+  emit32(offOverflow);
+  emit({0x89, 0xC2});                   // mov edx, eax
+  emit({0xF7, 0xD2});                   // not edx
+  emit({0x83, 0xE2, 0x02});             // and edx, Z
+  emit({0x88, 0x93});                   // mov [rbx + resultZ], dl
+  emit32(offResultZ);
+}
+
+
+// Compare register with al, set C, Z and N
+void JIT::emitCompare(int32_t reg) {
+  emit({0x0F, 0xB6, 0x93});             // movzx edx, byte [rbx + reg]
+  emit32(reg);
+  emit({0x38, 0xC2});                   // cmp dl, al
+  emit({0x0F, 0x93, 0xC1});             // setae cl
+  emit({0x88, 0x8B});                   // mov [rbx + carry], cl
+  emit32(offCarry);
+  emit({0x28, 0xC2});                   // sub dl, al
+  emit({0x88, 0x93});                   // mov [rbx + resultZ], dl
+  emit32(offResultZ);
+  emit({0x88, 0x93});                   // mov [rbx + resultN], dl
+  emit32(offResultN);
+}
+
+
+// Branch back to the start of the block: loops inside the native code
+// while the instruction budget allows it
+bool JIT::loopsToStart(uint16_t addr, uint16_t target) {
+  return (target == blockStart) and (addr != blockStart) and not cpu.stopsAt(blockStart);
+}
+
+
+// Branch taken if (byte [rbx + flag] & mask) is non-zero (or zero when
+// nonzero is false). Other than loops to the start of the block, taken
+// branches leave the block through a side exit.
+void JIT::emitBranch(int32_t flag, uint8_t mask, bool nonzero, uint16_t fallthrough,
+                     uint16_t target, uint16_t addr, int instructions) {
+  emit({0xF6, 0x83});                   // test byte [rbx + flag], mask
+  emit32(flag);
+  emit8(mask);
+  emit8(nonzero ? 0x74 : 0x75);         // jz/jnz not_taken
+  uint8_t * notTaken = p++;
+  int cycles = blockCycles + (((target ^ fallthrough) > 0xFF) ? 2 : 1);
+  if (loopsToStart(addr, target)) {
+    emit({0x48, 0x81, 0x83});           // add qword [rbx + instructions], imm32
+    emit32(offInstructions);
+    emit32(instructions);
+    emit({0x48, 0x81, 0x83});           // add qword [rbx + cycles], imm32
+    emit32(offCycles);
+    emit32(cycles);
+    emit({0x48, 0x8B, 0x83});           // mov rax, [rbx + instructions]
+    emit32(offInstructions);
+    emit({0x48, 0x05});                 // add rax, imm32
+    emit32(instructions);
+    emit({0x49, 0x3B, 0x45, 0x00});     // cmp rax, [r13]
+    emit8(0x77);                        // ja over_budget
+    uint8_t * overBudget = p++;
+    emit8(0xE9);                        // jmp loopStart
+    emit32(loopStart - (p + 4));
+    patch8(overBudget);
+    emit({0x66, 0xC7, 0x83});           // mov word [rbx + PC], target
+    emit32(offPC);
+    emit16(target);
+    emit8(0xB8);                        // mov eax, addr
+    emit32(addr);
+    emit({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop r13; pop r12; pop rbx; ret
+    patch8(notTaken);
+    emit({0x66, 0xC7, 0x83});           // mov word [rbx + PC], fallthrough
+    emit32(offPC);
+    emit16(fallthrough);
+  } else {
+    emit({0x66, 0xC7, 0x83});           // mov word [rbx + PC], target
+    emit32(offPC);
+    emit16(target);
+    emitExit(addr, instructions, cycles);
+    patch8(notTaken);
+  }
+}
+
+
+// ADC and SBC in binary mode, decimal mode uses the instruction handler.
+// D is tested before the operand is read, the handler does its own read
+// (I/O registers and watch points see one). The 2A03 has no decimal mode
+bool JIT::emitAddSubtract(uint8_t opcode, uint16_t addr, uint16_t operand) {
+  auto & opc = cpu.instset[opcode];
+  uint8_t * start = p;
+  uint8_t * done = nullptr;
+  if (cpu.variant != Ricoh2A03) {
+    emit({0xF6, 0x83});                 // test byte [rbx + Status], D
+    emit32(offStatus);
+    emit8(FlagD);
+    emit8(0x74);                        // jz binary
+    uint8_t * binary = p++;
+    emitCall(addr, operand, (void *)opc.handler);
+    emit8(0xE9);                        // jmp done
+    done = p;
+    p += 4;
+    patch8(binary);
+  }
+  if (not emitLoadOperand(opc.mode, operand)) {
+    p = start;                          // the handler is called instead
+    return false;
+  }
+  emitPageCross(opc.mode, operand);     // the handler counts its own
+  emit({0x0F, 0xB6, 0x93});             // movzx edx, byte [rbx + A]
+  emit32(offA);
+  emit({0x0F, 0xB6, 0x8B});             // movzx ecx, byte [rbx + carry]
+  emit32(offCarry);
+  emit({0x0F, 0xBA, 0xE1, 0x00});       // bt ecx, 0 (CF = C)
+  if (opc.operation == opADC) {
+    emit({0x10, 0xC2});                 // adc dl, al
+    emit({0x0F, 0x92, 0xC0});           // setc al
+  } else {
+    emit8(0xF5);                        // cmc (borrow = not C)
+    emit({0x18, 0xC2});                 // sbb dl, al
+    emit({0x0F, 0x93, 0xC0});           // setnc al
+  }
+  emit({0x0F, 0x90, 0xC4});             // seto ah
+  emit({0x88, 0x83});                   // mov [rbx + carry], al
+  emit32(offCarry);
+  emit({0x88, 0xA3});                   // mov [rbx + overflow], ah
+  emit32(offOverflow);
+  emit({0x88, 0x93});                   // mov [rbx + A], dl
+  emit32(offA);
+  emit({0x88, 0x93});                   // mov [rbx + resultZ], dl
+  emit32(offResultZ);
+  emit({0x88, 0x93});                   // mov [rbx + resultN], dl
+  emit32(offResultN);
+  if (done != nullptr) {
+    patch32(done);
+  }
+  return true;
+}
+
+
+// Call the interpreter handler for the instruction at addr
+void JIT::emitCall(uint16_t addr, uint16_t operand, void * handler) {
+  emit({0x66, 0xC7, 0x83});             // mov word [rbx + PC], addr
+  emit32(offPC);
+  emit16(addr);
+  emit({0x48, 0x89, 0xDF});             // mov rdi, rbx
+  emit8(0xBE);                          // mov esi, operand
+  emit32(operand);
+  emit({0x48, 0xB8});                   // mov rax, handler
+  emit64((uint64_t)handler);
+  emit({0xFF, 0xD0});                   // call rax
+}
+
+
+// Leave the block if the instruction at addr invalidated translated code.
+// The handler has already advanced PC.
+void JIT::emitDirtyCheck(uint16_t addr, int instructions) {
+  emit({0x48, 0xB8});                   // mov rax, &dirty
+  emit64((uint64_t)&dirty);
+  emit({0x80, 0x38, 0x00});             // cmp byte [rax], 0
+  emit8(0x74);                          // je clean
+  uint8_t * clean = p++;
+  emitExit(addr, instructions, blockCycles);
+  patch8(clean);
+}
+
+
+// Before a native CLI or PLP: while an IRQ is held the handler does the
+// instruction (ending the stretch if it clears I, see CPU::unmasked())
+// and the block is left
+void JIT::emitIrqCheck(uint8_t opcode, uint16_t addr, int instructions) {
+  emit({0x48, 0xB8});                   // mov rax, &irqLines
+  emit64((uint64_t)&cpu.irqLines);
+  emit({0x83, 0x38, 0x00});             // cmp dword [rax], 0
+  emit8(0x74);                          // je native
+  uint8_t * native = p++;
+  emitCall(addr, 0, (void *)cpu.instset[opcode].handler);
+  emitExit(addr, instructions, blockCycles);
+  patch8(native);
+}
+
+
+// Count the executed instructions and cycles and return the last
+// instruction address
+void JIT::emitExit(uint16_t last, int instructions, int cycles) {
+  emit({0x48, 0x81, 0x83});             // add qword [rbx + instructions], imm32
+  emit32(offInstructions);
+  emit32(instructions);
+  emit({0x48, 0x81, 0x83});             // add qword [rbx + cycles], imm32
+  emit32(offCycles);
+  emit32(cycles);
+  emit8(0xB8);                          // mov eax, last
+  emit32(last);
+  emit({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3}); // pop r13; pop r12; pop rbx; ret
+}
+
+
+// Fetch-execute loop running translated blocks. Falls back to the decode
+// cache for instructions that cannot be translated and when a block would
+// exceed the instruction budget.
+template <int policy>
+void CPU::runJit() {
+  while (instructions < horizon) {
+    JitCode code = (decoded[PC].opcode == LoopGroup) ? nullptr : jit->lookup(PC);
+    if ((code != nullptr) and (instructions + jit->blockLength(PC) <= horizon)) {
+      jit->dirty = false;
+      if (code(this) == PC) { // native jumps and branches to themselves
+        halt(LoopDetected);
+      }
+    } else {
+      executeDecoded(horizon);
+    }
+
+    if (stopHere<policy>()) {
+      return;
+    }
+  }
+}
+
+template void CPU::runJit<CPU::Plain>();
+template void CPU::runJit<CPU::StopAtTrace>();
+template void CPU::runJit<CPU::Breakpoints>();
+template void CPU::runJit<CPU::StopAtTrace | CPU::Breakpoints>();
@@ -0,0 +1,135 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Basic block compiler from 6502 to x86-64 machine code
+///
+/// Straight-line 6502 code up to a JMP, JSR, RTS, RTI or BRK is translated
+/// into one native function, taken conditional branches leave the function
+/// through side exits. Loads, stores, ADC/SBC in binary mode, register
+/// transfers, increments, logical operations, compares, flag and stack
+/// operations and branches are emitted as native code. Everything else is
+/// emitted as a call to the instruction handler used by the interpreter.
+/// Native stores to pages with page flags set (e.g. code pages) also go
+/// through the handler. A branch back to the start of the block loops
+/// natively until the run loop horizon is reached (see CPU::run()). Loops
+/// the interpreter executes at once (see CPU::recognizeLoop()) are left to
+/// it.
+///
+/// Cycles are counted per block exit from the base cycles of the executed
+/// instructions, page crossing and taken branch penalties are added by the
+/// native code.
+///
+/// Writes to memory covered by translated blocks (reported through
+/// CPU::codeModified()) invalidate the blocks. A block that is modified
+/// while it is running exits after the writing instruction. Blocks that
+/// keep being modified are not translated again, self-modifying code runs
+/// faster in the interpreter.
+///
+/// Only available on x86-64, see JIT::supported()
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+class CPU;
+
+// Translated block: returns the address of the last executed instruction
+typedef uint16_t (*JitCode)(CPU * cpu);
+
+class JIT {
+public:
+  JIT(CPU & cpu);
+
+  ~JIT();
+
+  // Can native code be generated on this host?
+  static bool supported();
+
+  // Native code for the block starting at addr, translates the block on
+  // first use. Returns nullptr if no block could be translated.
+  JitCode lookup(uint16_t addr);
+
+  // Number of 6502 instructions in the block starting at addr
+  uint16_t blockLength(uint16_t addr) { return count[addr]; }
+
+  // Drop translated blocks overlapping [address, address + length)
+  void invalidate(uint16_t address, uint32_t length);
+
+  // Drop all translated blocks
+  void flush();
+
+  bool dirty{false}; ///< set when a block was invalidated
+
+private:
+  const uint32_t BufferSize{4 * 1024 * 1024};
+  const int MaxBlockInstructions{64};
+  const int MaxInstructionBytes{192}; ///< upper bound for one instruction
+  const uint8_t MaxInvalidations{8}; ///< then leave the code to the interpreter
+
+  CPU & cpu;
+
+  uint8_t * buffer{nullptr}; ///< executable memory
+  uint32_t used{0};          ///< bytes of buffer in use
+  uint8_t * p{nullptr};      ///< emit position
+  uint16_t blockStart;       ///< 6502 address of the block being translated
+  uint8_t * loopStart;       ///< native code after the block prologue
+  int blockCycles;           ///< base cycles up to the current instruction
+
+  std::vector<JitCode> entry;   ///< translated block by start address
+  std::vector<uint16_t> count;  ///< instructions in block by start address
+  std::vector<uint32_t> end;    ///< end address (exclusive) by start address
+  std::vector<uint8_t> invalidations; ///< times the block at address was dropped
+  std::vector<uint16_t> pageBlocks[256]; ///< blocks touching each page
+
+  // offsets of CPU members relative to the CPU object
+  int32_t offA, offX, offY, offS, offPC, offStatus, offInstructions, offCycles;
+  int32_t offResultZ, offResultN, offCarry, offOverflow;
+
+  JitCode translate(uint16_t addr);
+
+  // emitters for native instructions
+  bool emitInstruction(uint8_t opcode, uint16_t addr, uint16_t operand, int instructions);
+  bool emitAddress(int mode, uint16_t operand);
+  void emitZeroPagePointer();
+  bool emitLoadOperand(int mode, uint16_t operand);
+  void emitPageCross(int mode, uint16_t operand);
+  bool emitStore(uint8_t opcode, uint16_t addr, uint16_t operand, int instructions);
+  bool emitPush(uint8_t opcode, uint16_t addr, int instructions);
+  bool emitAddSubtract(uint8_t opcode, uint16_t addr, uint16_t operand);
+  void emitUpdateZN();
+  void emitGetStatus();
+  void emitSetStatus();
+  void emitCompare(int32_t reg);
+  bool loopsToStart(uint16_t addr, uint16_t target);
+  void emitBranch(int32_t flag, uint8_t mask, bool nonzero, uint16_t fallthrough,
+                  uint16_t target, uint16_t addr, int instructions);
+  void emitCall(uint16_t addr, uint16_t operand, void * handler);
+  void emitDirtyCheck(uint16_t addr, int instructions);
+  void emitIrqCheck(uint8_t opcode, uint16_t addr, int instructions);
+  void emitExit(uint16_t last, int instructions, int cycles);
+
+  // Memory::readByte() for generated code, reads of pages without pointer
+  static uint8_t readByte(Memory * mem, uint16_t address);
+
+  void emit8(uint8_t byte) { *p++ = byte; }
+  void emit16(uint16_t val) { emit8(val & 0xFF); emit8(val >> 8); }
+  void emit32(uint32_t val) { emit16(val & 0xFFFF); emit16(val >> 16); }
+  void emit64(uint64_t val) { emit32(val & 0xFFFFFFFF); emit32(val >> 32); }
+  void patch8(uint8_t * at) { *at = p - at - 1; } ///< rel8 jump to here
+  void patch32(uint8_t * at) { ///< rel32 jump to here
+    uint32_t rel = p - at - 4;
+    for (int i = 0; i < 4; i++) {
+      at[i] = rel >> (8 * i);
+    }
+  }
+  void emit(std::initializer_list<uint8_t> bytes) {
+    for (auto byte : bytes) {
+      emit8(byte);
+    }
+  }
+};
@@ -0,0 +1,767 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Many 6502s running the same program in lockstep, see Lockstep.h
+///
+/// The loops over the lanes are written to be vectorized: no early exits,
+/// masks of 0x00 or 0xFF selecting the active lanes. Loads and stores
+/// through per lane addresses (indexed with different X or Y, pointers
+/// holding different addresses) are done one lane at a time.
+//===----------------------------------------------------------------------===//
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <Lockstep.h>
+
+namespace {
+
+constexpr int length(AMode mode) {
+  return ((mode == Implied) or (mode == Accumulator)) ? 1 :
+         ((mode == Absolute) or (mode == AbsoluteX) or (mode == AbsoluteY) or
+          (mode == Indirect)) ? 3 : 2;
+}
+
+}
+
+
+// The documented opcodes but decimal mode, BRK and RTI (interrupts). The
+// others have no handler, the lanes continue on scalar CPUs
+const Lockstep::Decoded * Lockstep::decodeTable() {
+  struct Entry {
+    uint8_t opcode;
+    Decoded decoded;
+  };
+#define LOCKSTEP_ENTRY(opcode, operation, mode) \
+  {opcode, {&Lockstep::execute<op##operation, mode>, length(mode)}},
+  static const Entry Documented[] = {
+    OPCODE_TABLE(LOCKSTEP_ENTRY)
+  };
+#undef LOCKSTEP_ENTRY
+
+  struct Table {
+    Decoded entries[256];
+    Table() {
+      for (auto & entry : entries) {
+        entry = {nullptr, 1};
+      }
+      for (auto & entry : Documented) {
+        entries[entry.opcode] = entry.decoded;
+      }
+      entries[SED].handler = entries[BRK].handler = entries[RTI].handler = nullptr;
+    }
+  };
+  static const Table table;
+  return table.entries;
+}
+
+
+Lockstep::Lockstep() : decoded(decodeTable()), mem(65536) {
+  std::fill(reasons, reasons + Lanes, CPU::Halted);
+}
+
+Lockstep::~Lockstep() { }
+
+
+void Lockstep::loadData(uint16_t address, const uint8_t * data, uint32_t length) {
+  assert(address + length <= 65536);
+  for (uint32_t i = 0; i < length; i++) {
+    memset(mem[address + i].lane, data[i], Lanes);
+    clearVaries(address + i);
+  }
+  for (int lane = 0; lane < Lanes; lane++) {
+    if (scalar[lane]) {
+      scalar[lane]->mem.loadData(address, data, length);
+    }
+  }
+}
+
+void Lockstep::loadSnippets(const std::vector<Snippet> & snippets) {
+  for (auto & snippet : snippets) {
+    loadData(snippet.address, snippet.data.data(), snippet.data.size());
+  }
+}
+
+void Lockstep::poke(int lane, uint16_t address, uint8_t value) {
+  if (scalar[lane]) {
+    scalar[lane]->mem.loadData(address, &value, 1);
+  }
+  mem[address].lane[lane] = value;
+  setVaries(address);
+}
+
+uint8_t Lockstep::peek(int lane, uint16_t address) const {
+  if (scalar[lane]) {
+    return scalar[lane]->mem.peek(address);
+  }
+  return mem[address].lane[lane];
+}
+
+
+void Lockstep::reset(uint16_t addr) {
+  for (int lane = 0; lane < Lanes; lane++) {
+    if (scalar[lane]) { // code the lane changed alone is checked by step()
+      for (int address = 0; address < 65536; address++) {
+        uint8_t value = scalar[lane]->mem.peek(address);
+        if (value != mem[address].lane[lane]) {
+          mem[address].lane[lane] = value;
+          setVaries(address);
+        }
+      }
+      scalar[lane].reset();
+    }
+    A[lane] = X[lane] = Y[lane] = 0;
+    S[lane] = 0xFF;
+    P[lane] = carry[lane] = resultN[lane] = overflow[lane] = 0;
+    resultZ[lane] = 1; // Z clear
+    PC[lane] = addr;
+    reasons[lane] = CPU::Budget;
+    done[lane] = 0;
+  }
+}
+
+
+void Lockstep::run(uint64_t n) {
+  budget = n;
+  steps = 0;
+  for (int lane = 0; lane < Lanes; lane++) {
+    idle[lane] = waiting[lane] = 0;
+    live[lane] = 0;
+    if (reasons[lane] == CPU::Budget) {
+      if (scalar[lane]) {
+        reasons[lane] = scalar[lane]->cpu.run(n);
+      } else {
+        live[lane] = 0xFF;
+      }
+    }
+  }
+
+  select();
+  while (first < Lanes) { // live lanes
+    if (steps == limit) {
+      stopAtBudget();
+    } else {
+      step();
+    }
+  }
+}
+
+
+Lockstep::Registers Lockstep::getRegisters(int lane) const {
+  if (scalar[lane]) {
+    auto & cpu = scalar[lane]->cpu;
+    return {cpu.A, cpu.X, cpu.Y, cpu.S, cpu.Status.mask, cpu.PC};
+  }
+  uint8_t p[Lanes];
+  status(p);
+  return {A[lane], X[lane], Y[lane], S[lane], p[lane], active[lane] ? pc : PC[lane]};
+}
+
+uint64_t Lockstep::getInstructionCount(int lane) const {
+  if (scalar[lane]) {
+    return done[lane] + scalar[lane]->cpu.getInstructionCount();
+  }
+  return done[lane] + (live[lane] ? steps - idle[lane] : 0);
+}
+
+
+void Lockstep::select() {
+  uint32_t lowest = 0x10000;
+  for (int lane = 0; lane < Lanes; lane++) {
+    lowest = std::min<uint32_t>(lowest, live[lane] ? PC[lane] : 0x10000);
+  }
+  pc = lowest;
+  uint8_t outside = 0;
+  uint64_t end = UINT64_MAX;
+  for (int lane = 0; lane < Lanes; lane++) {
+    active[lane] = (live[lane] and (PC[lane] == lowest)) ? 0xFF : 0x00;
+    outside |= live[lane] & ~active[lane];
+    if (live[lane]) {
+      end = std::min(end, (budget < UINT64_MAX - idle[lane]) ? budget + idle[lane] : UINT64_MAX);
+    }
+  }
+  diverged = outside;
+  full = std::count(active, active + Lanes, 0xFF) == Lanes;
+  limit = end;
+  first = std::find(active, active + Lanes, 0xFF) - active;
+}
+
+void Lockstep::stopAtBudget() {
+  syncPC();
+  for (int lane = 0; lane < Lanes; lane++) {
+    if (live[lane] and (steps - idle[lane] >= budget)) {
+      stop(lane, CPU::Budget);
+    }
+  }
+  select();
+}
+
+void Lockstep::syncPC() {
+  for (int lane = 0; lane < Lanes; lane++) {
+    PC[lane] = active[lane] ? pc : PC[lane];
+  }
+}
+
+
+void Lockstep::stop(int lane, CPU::StopReason reason) {
+  full = false;
+  done[lane] += steps - idle[lane];
+  live[lane] = active[lane] = 0;
+  reasons[lane] = reason;
+}
+
+// The lane gets a CPU and a copy of its memory, the flags are loaded from
+// Status by run()
+void Lockstep::peel(int lane) {
+  uint64_t remaining = budget - (steps - idle[lane]);
+  stop(lane, CPU::Budget);
+  scalar[lane].reset(new Scalar);
+  std::vector<uint8_t> image(65536);
+  for (int address = 0; address < 65536; address++) {
+    image[address] = mem[address].lane[lane];
+  }
+  auto & cpu = scalar[lane]->cpu;
+  scalar[lane]->mem.loadData(0x0000, image.data(), 65536);
+  uint8_t p[Lanes];
+  status(p);
+  cpu.A = A[lane];
+  cpu.X = X[lane];
+  cpu.Y = Y[lane];
+  cpu.S = S[lane];
+  cpu.PC = PC[lane];
+  cpu.Status.mask = p[lane];
+  reasons[lane] = cpu.run(remaining);
+}
+
+
+bool Lockstep::same(const uint8_t * v) const {
+  uint8_t differ = 0;
+  for (int lane = 0; lane < Lanes; lane++) {
+    differ |= (v[lane] ^ v[first]) & active[lane];
+  }
+  return differ == 0;
+}
+
+bool Lockstep::same(const uint16_t * v) const {
+  uint16_t differ = 0;
+  for (int lane = 0; lane < Lanes; lane++) {
+    differ |= (v[lane] ^ v[first]) & (active[lane] * 0x0101);
+  }
+  return differ == 0;
+}
+
+bool Lockstep::any(const uint8_t * v) const {
+  uint8_t set = 0;
+  for (int lane = 0; lane < Lanes; lane++) {
+    set |= v[lane];
+  }
+  return set != 0;
+}
+
+
+// Addresses of the instruction at pc for the active lanes
+template <AMode mode>
+Lockstep::Address Lockstep::address(uint16_t operand) {
+  uint16_t addresses[Lanes];
+  switch (mode) {
+    case ZeroPageX:
+    case ZeroPageY:
+    case AbsoluteX:
+    case AbsoluteY: {
+      const uint8_t * index = ((mode == ZeroPageX) or (mode == AbsoluteX)) ? X : Y;
+      bool zeroPage = (mode == ZeroPageX) or (mode == ZeroPageY);
+      if (same(index)) {
+        uint16_t addr = operand + index[first];
+        return uniform(zeroPage ? uint8_t(addr) : addr);
+      }
+      for (int lane = 0; lane < Lanes; lane++) {
+        uint16_t addr = operand + index[lane];
+        addresses[lane] = zeroPage ? uint8_t(addr) : addr;
+      }
+      return perLane(addresses);
+    }
+
+    case IndexedIndirect: // the pointers wrap in the zero page, like CPU
+      for (int lane = 0; lane < Lanes; lane++) {
+        uint8_t pointer = operand + X[lane];
+        addresses[lane] = mem[pointer].lane[lane] | mem[uint8_t(pointer + 1)].lane[lane] << 8;
+      }
+      return perLane(addresses);
+
+    case IndirectIndexed: {
+      auto & low = mem[uint8_t(operand)];
+      auto & high = mem[uint8_t(operand + 1)];
+      for (int lane = 0; lane < Lanes; lane++) {
+        addresses[lane] = (low.lane[lane] | high.lane[lane] << 8) + Y[lane];
+      }
+      return perLane(addresses);
+    }
+
+    default: // ZeroPage, Absolute
+      return uniform(operand);
+  }
+}
+
+// Not initializing lane[]
+Lockstep::Address Lockstep::uniform(uint16_t base) const {
+  Address addr;
+  addr.uniform = true;
+  addr.base = base;
+  return addr;
+}
+
+Lockstep::Address Lockstep::perLane(const uint16_t * addresses) const {
+  if (same(addresses)) {
+    return uniform(addresses[first]);
+  }
+  Address addr;
+  addr.uniform = false;
+  std::copy(addresses, addresses + Lanes, addr.lane);
+  return addr;
+}
+
+Lockstep::Address Lockstep::stack() const {
+  uint16_t addresses[Lanes];
+  for (int lane = 0; lane < Lanes; lane++) {
+    addresses[lane] = 0x100 | S[lane];
+  }
+  return perLane(addresses);
+}
+
+void Lockstep::load(const Address & addr, uint8_t * v) const {
+  if (addr.uniform) {
+    memcpy(v, mem[addr.base].lane, Lanes);
+    return;
+  }
+  for (int lane = 0; lane < Lanes; lane++) {
+    v[lane] = mem[addr.lane[lane]].lane[lane];
+  }
+}
+
+// Code in the written rows is compared between the lanes, see step()
+void Lockstep::store(const Address & addr, const uint8_t * v) {
+  if (addr.uniform) {
+    setVaries(addr.base);
+    auto & row = mem[addr.base];
+    if (full) {
+      memcpy(row.lane, v, Lanes);
+      return;
+    }
+    for (int lane = 0; lane < Lanes; lane++) {
+      row.lane[lane] = (row.lane[lane] & ~active[lane]) | (v[lane] & active[lane]);
+    }
+    return;
+  }
+  for (int lane = 0; lane < Lanes; lane++) {
+    if (active[lane]) {
+      mem[addr.lane[lane]].lane[lane] = v[lane];
+      setVaries(addr.lane[lane]);
+    }
+  }
+}
+
+void Lockstep::push(const uint8_t * v) {
+  store(stack(), v);
+  for (int lane = 0; lane < Lanes; lane++) {
+    S[lane] -= active[lane] & 1;
+  }
+}
+
+void Lockstep::pull(uint8_t * v) {
+  for (int lane = 0; lane < Lanes; lane++) {
+    S[lane] += active[lane] & 1;
+  }
+  load(stack(), v);
+}
+
+
+void Lockstep::assign(uint8_t * dst, const uint8_t * src) {
+  if (full) {
+    memcpy(dst, src, Lanes);
+    return;
+  }
+  for (int lane = 0; lane < Lanes; lane++) {
+    dst[lane] = (dst[lane] & ~active[lane]) | (src[lane] & active[lane]);
+  }
+}
+
+void Lockstep::setZN(const uint8_t * v) {
+  assign(resultZ, v);
+  assign(resultN, v);
+}
+
+// As CPU::getStatus()
+void Lockstep::status(uint8_t * v) const {
+  for (int lane = 0; lane < Lanes; lane++) {
+    v[lane] = (P[lane] & 0x3C) | carry[lane] | ((resultZ[lane] == 0) << 1) |
+              ((overflow[lane] != 0) << 6) | (resultN[lane] & 0x80);
+  }
+}
+
+
+void Lockstep::jump(uint16_t target) {
+  if (target != pc) {
+    pc = target;
+    return;
+  }
+  syncPC();
+  for (int lane = 0; lane < Lanes; lane++) {
+    if (active[lane]) {
+      stop(lane, CPU::LoopDetected);
+    }
+  }
+  split = true;
+}
+
+void Lockstep::jump(const uint16_t * targets) {
+  if (same(targets)) {
+    return jump(targets[first]);
+  }
+  for (int lane = 0; lane < Lanes; lane++) {
+    PC[lane] = active[lane] ? targets[lane] : PC[lane];
+  }
+  for (int lane = 0; lane < Lanes; lane++) {
+    if (active[lane] and (targets[lane] == pc)) {
+      stop(lane, CPU::LoopDetected);
+    }
+  }
+  split = true;
+}
+
+
+// One instruction for the active lanes at pc
+void Lockstep::step() {
+  auto & inst = decoded[mem[pc].lane[first]];
+  int len = inst.length;
+
+  // Lanes with other code than the first active lane continue alone
+  bool check = false;
+  for (int i = 0; i < len; i++) {
+    check |= varies(pc + i);
+  }
+  if (check) {
+    uint8_t differ[Lanes]{};
+    for (int i = 0; i < len; i++) {
+      auto & row = mem[uint16_t(pc + i)];
+      for (int lane = 0; lane < Lanes; lane++) {
+        differ[lane] |= (row.lane[lane] != row.lane[first]) ? active[lane] : 0;
+      }
+    }
+    syncPC();
+    for (int lane = 0; lane < Lanes; lane++) {
+      if (differ[lane]) {
+        peel(lane);
+      }
+    }
+  }
+
+  if (inst.handler == nullptr) {
+    syncPC();
+    for (int lane = 0; lane < Lanes; lane++) {
+      if (active[lane]) {
+        peel(lane);
+      }
+    }
+    select();
+    return;
+  }
+
+  uint16_t operand = 0;
+  if (len > 1) {
+    operand = mem[uint16_t(pc + 1)].lane[first];
+  }
+  if (len > 2) {
+    operand |= mem[uint16_t(pc + 2)].lane[first] << 8;
+  }
+  steps++;
+  split = false;
+  (this->*inst.handler)(operand, pc + len);
+
+  if (diverged) {
+    for (int lane = 0; lane < Lanes; lane++) {
+      uint8_t waited = live[lane] & ~active[lane] & 1;
+      idle[lane] += waited;
+      waiting[lane] = waited ? waiting[lane] + 1 : 0;
+    }
+    for (int lane = 0; lane < Lanes; lane++) {
+      if (live[lane] and not active[lane] and (waiting[lane] > MaxDrift)) {
+        peel(lane);
+      }
+    }
+  }
+  if (split or diverged) {
+    if (not split) {
+      syncPC();
+    }
+    select();
+  }
+}
+
+
+template <Operation operation, AMode mode>
+void Lockstep::execute(uint16_t operand, uint16_t next) {
+  uint8_t M[Lanes], R[Lanes], C[Lanes], V[Lanes];
+  Address addr;
+  uint8_t * reg = (operation == opCPX) or (operation == opLDX) or (operation == opSTX) ? X :
+                        (operation == opCPY) or (operation == opLDY) or (operation == opSTY) ? Y : A;
+
+  // The operand of the reading instructions
+  switch (operation) {
+    case opLDA: case opLDX: case opLDY: case opADC: case opSBC: case opAND:
+    case opORA: case opEOR: case opCMP: case opCPX: case opCPY: case opBIT:
+    case opASL: case opLSR: case opROL: case opROR: case opINC: case opDEC:
+      if (mode == Immediate) {
+        memset(M, operand, Lanes);
+      } else if (mode == Accumulator) {
+        memcpy(M, A, Lanes);
+      } else {
+        addr = address<mode>(operand);
+        load(addr, M);
+      }
+      break;
+    default:
+      break;
+  }
+
+  switch (operation) {
+    case opLDA:
+    case opLDX:
+    case opLDY:
+      assign(reg, M);
+      setZN(M);
+      break;
+
+    case opSTA:
+    case opSTX:
+    case opSTY:
+      store(address<mode>(operand), reg);
+      break;
+
+    case opSBC: // binary only, SED leaves lockstep
+      for (int lane = 0; lane < Lanes; lane++) {
+        M[lane] = ~M[lane];
+      }
+      // fall through
+    case opADC:
+      for (int lane = 0; lane < Lanes; lane++) { // in bytes, no widening
+        uint8_t sum = A[lane] + M[lane];
+        R[lane] = sum + carry[lane];
+        C[lane] = (sum < A[lane]) | (R[lane] < sum);
+        V[lane] = ~(A[lane] ^ M[lane]) & (A[lane] ^ R[lane]) & 0x80;
+      }
+      assign(A, R);
+      assign(carry, C);
+      assign(overflow, V);
+      setZN(R);
+      break;
+
+    case opAND:
+    case opORA:
+    case opEOR:
+      for (int lane = 0; lane < Lanes; lane++) {
+        R[lane] = (operation == opAND) ? A[lane] & M[lane] :
+                  (operation == opORA) ? A[lane] | M[lane] : A[lane] ^ M[lane];
+      }
+      assign(A, R);
+      setZN(R);
+      break;
+
+    case opCMP:
+    case opCPX:
+    case opCPY:
+      for (int lane = 0; lane < Lanes; lane++) {
+        R[lane] = reg[lane] - M[lane];
+        C[lane] = reg[lane] >= M[lane];
+      }
+      assign(carry, C);
+      setZN(R);
+      break;
+
+    case opBIT:
+      for (int lane = 0; lane < Lanes; lane++) {
+        R[lane] = A[lane] & M[lane];
+        V[lane] = M[lane] & 0x40;
+      }
+      assign(resultZ, R);
+      assign(resultN, M);
+      assign(overflow, V);
+      break;
+
+    case opASL:
+    case opLSR:
+    case opROL:
+    case opROR:
+    case opINC:
+    case opDEC:
+      for (int lane = 0; lane < Lanes; lane++) {
+        switch (operation) {
+          case opASL: R[lane] = M[lane] << 1; break;
+          case opLSR: R[lane] = M[lane] >> 1; break;
+          case opROL: R[lane] = (M[lane] << 1) | carry[lane]; break;
+          case opROR: R[lane] = (M[lane] >> 1) | (carry[lane] << 7); break;
+          case opINC: R[lane] = M[lane] + 1; break;
+          default:    R[lane] = M[lane] - 1; break;
+        }
+        C[lane] = ((operation == opASL) or (operation == opROL)) ? M[lane] >> 7 : M[lane] & 1;
+      }
+      if ((operation != opINC) and (operation != opDEC)) {
+        assign(carry, C);
+      }
+      if (mode == Accumulator) {
+        assign(A, R);
+      } else {
+        store(addr, R);
+      }
+      setZN(R);
+      break;
+
+    case opINX:
+    case opINY:
+    case opDEX:
+    case opDEY: {
+      uint8_t * r = ((operation == opINX) or (operation == opDEX)) ? X : Y;
+      uint8_t delta = ((operation == opINX) or (operation == opINY)) ? 1 : 0xFF;
+      for (int lane = 0; lane < Lanes; lane++) {
+        R[lane] = r[lane] + delta;
+      }
+      assign(r, R);
+      setZN(R);
+    }
+    break;
+
+    case opTAX: assign(X, A); setZN(A); break;
+    case opTAY: assign(Y, A); setZN(A); break;
+    case opTXA: assign(A, X); setZN(X); break;
+    case opTYA: assign(A, Y); setZN(Y); break;
+    case opTSX: assign(X, S); setZN(S); break;
+    case opTXS: assign(S, X); break;
+
+    case opCLC:
+    case opSEC:
+    case opCLV:
+      memset(R, operation == opSEC, Lanes);
+      assign((operation == opCLV) ? overflow : carry, R);
+      break;
+
+    case opCLI:
+    case opSEI:
+    case opCLD:
+      for (int lane = 0; lane < Lanes; lane++) {
+        R[lane] = (operation == opSEI) ? P[lane] | 0x04 :
+                  (operation == opCLI) ? P[lane] & ~0x04 : P[lane] & ~0x08;
+      }
+      assign(P, R);
+      break;
+
+    case opPHA:
+      push(A);
+      break;
+
+    case opPHP: // pushed with B and the reserved bit set
+      status(R);
+      for (int lane = 0; lane < Lanes; lane++) {
+        R[lane] |= 0x30;
+      }
+      push(R);
+      break;
+
+    case opPLA:
+      pull(R);
+      assign(A, R);
+      setZN(R);
+      break;
+
+    case opPLP: { // as CPU::setStatus(), decimal mode leaves lockstep
+      pull(R);
+      uint8_t decimal[Lanes];
+      for (int lane = 0; lane < Lanes; lane++) {
+        C[lane] = R[lane] & 0x01;
+        M[lane] = ~R[lane] & 0x02;
+        V[lane] = R[lane] & 0x40;
+        decimal[lane] = (R[lane] & 0x08) ? active[lane] : 0x00;
+      }
+      assign(P, R);
+      assign(carry, C);
+      assign(resultZ, M);
+      assign(overflow, V);
+      assign(resultN, R);
+      pc = next;
+      if (any(decimal)) {
+        syncPC();
+        for (int lane = 0; lane < Lanes; lane++) {
+          if (decimal[lane]) {
+            peel(lane);
+          }
+        }
+        split = true;
+      }
+    }
+    return;
+
+    case opBPL: case opBMI: case opBVC: case opBVS:
+    case opBCC: case opBCS: case opBNE: case opBEQ: {
+      uint8_t taken[Lanes];
+      for (int lane = 0; lane < Lanes; lane++) {
+        bool flag = (operation == opBPL) or (operation == opBMI) ? resultN[lane] & 0x80 :
+                    (operation == opBVC) or (operation == opBVS) ? overflow[lane] != 0 :
+                    (operation == opBCC) or (operation == opBCS) ? carry[lane] != 0 :
+                                                                   resultZ[lane] == 0;
+        bool branchIfSet = (operation == opBMI) or (operation == opBVS) or
+                           (operation == opBCS) or (operation == opBEQ);
+        taken[lane] = (flag == branchIfSet) ? active[lane] : 0x00;
+      }
+      uint16_t target = next + int8_t(operand);
+      if (not any(taken)) {
+        pc = next;
+      } else if (same(taken)) {
+        jump(target);
+      } else {
+        uint16_t targets[Lanes];
+        for (int lane = 0; lane < Lanes; lane++) {
+          targets[lane] = taken[lane] ? target : next;
+        }
+        jump(targets);
+      }
+    }
+    return;
+
+    case opJMP:
+      if (mode == Indirect) { // the pointer does not cross pages (NMOS)
+        auto & low = mem[operand];
+        auto & high = mem[(operand & 0xFF00) | uint8_t(operand + 1)];
+        uint16_t targets[Lanes];
+        for (int lane = 0; lane < Lanes; lane++) {
+          targets[lane] = low.lane[lane] | high.lane[lane] << 8;
+        }
+        jump(targets);
+      } else {
+        jump(operand);
+      }
+      return;
+
+    case opJSR: // pushes the address of its last byte
+      memset(R, (next - 1) >> 8, Lanes);
+      push(R);
+      memset(R, (next - 1) & 0xFF, Lanes);
+      push(R);
+      jump(operand);
+      return;
+
+    case opRTS: {
+      uint16_t targets[Lanes];
+      pull(R);
+      pull(M);
+      for (int lane = 0; lane < Lanes; lane++) {
+        targets[lane] = (R[lane] | M[lane] << 8) + 1;
+      }
+      jump(targets);
+    }
+    return;
+
+    default: // NOP
+      break;
+  }
+  pc = next;
+}
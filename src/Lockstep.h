@@ -0,0 +1,182 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Many 6502s running the same program on different data
+///
+/// For fuzzing and parameter sweeps. Each of the Lanes CPUs has its own
+/// registers and 64K of RAM. The registers are arrays over the lanes
+/// (A[lane], X[lane], ...) and the memory is interleaved, the bytes of all
+/// lanes at an address are adjacent. An instruction is decoded once and
+/// done for all lanes with loops the compiler turns into vector operations
+/// (make AVX2=1 for 32 lanes per operation), a load or store at the same
+/// address in all lanes is one vector move.
+///
+/// Lanes that branch differently are masked: the lanes with the lowest PC
+/// run while the others wait, which joins them again at the end of an if
+/// statement or loop. A lane that waits more than MaxDrift instructions,
+/// runs into code that differs from the other lanes' or into an
+/// instruction not done here (decimal mode, BRK, RTI, undocumented
+/// opcodes) continues alone on a scalar CPU.
+///
+/// NMOS 6502 on plain RAM, no interrupts, cycles are not counted
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <CPU.h>
+#include <Memory.h>
+#include <Opcodes.h>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Lockstep {
+public:
+  static constexpr int Lanes{64};        ///< two AVX2 registers of bytes
+  static constexpr uint32_t MaxDrift{1024}; ///< instructions a lane may wait
+
+  struct Registers {
+    uint8_t A, X, Y, S;
+    uint8_t P; ///< status register, as CPU::Status
+    uint16_t PC;
+  };
+
+  Lockstep();
+  ~Lockstep();
+
+  Lockstep(const Lockstep &) = delete;
+  Lockstep & operator=(const Lockstep &) = delete;
+
+  // Copy length bytes from data to [address, address + length) of all lanes
+  void loadData(uint16_t address, const uint8_t * data, uint32_t length);
+
+  // Load the snippets into all lanes, see Programs.h
+  void loadSnippets(const std::vector<Snippet> & snippets);
+
+  // The inputs and results of a lane
+  void poke(int lane, uint16_t address, uint8_t value);
+  uint8_t peek(int lane, uint16_t address) const;
+
+  // Clear the registers of all lanes and start them at addr, S = $FF.
+  // The lanes run from here, on the lockstep engine again
+  void reset(uint16_t addr);
+
+  // Run every lane for n more instructions or until it stops. A lane
+  // leaving lockstep runs the rest of its n on the scalar CPU at once
+  void run(uint64_t n);
+
+  Registers getRegisters(int lane) const;
+  CPU::StopReason getStopReason(int lane) const { return reasons[lane]; }
+  uint64_t getInstructionCount(int lane) const;
+
+  // Lane continued on a scalar CPU?
+  bool isScalar(int lane) const { return scalar[lane] != nullptr; }
+
+private:
+  struct Row {
+    uint8_t lane[Lanes];
+  };
+
+  // Where an instruction accesses memory, the same address in all lanes
+  // or one per lane
+  struct Address {
+    bool uniform;
+    uint16_t base;
+    uint16_t lane[Lanes];
+  };
+
+  struct Scalar {
+    Memory mem;
+    CPU cpu;
+    Scalar() : cpu(mem) { }
+  };
+
+  // Instruction handlers, specialized like CPU::execute()
+  typedef void (Lockstep::*Handler)(uint16_t operand, uint16_t next);
+  template <Operation operation, AMode mode> void execute(uint16_t operand, uint16_t next);
+
+  struct Decoded {
+    Handler handler; ///< nullptr if not done in lockstep
+    int length;
+  };
+
+  static const Decoded * decodeTable();
+
+  void step();
+
+  // Pick the active group: the live lanes with the lowest PC
+  void select();
+
+  // Stop the live lanes at their budget
+  void stopAtBudget();
+
+  // PC[] of the active lanes from pc
+  void syncPC();
+
+  // Leave lockstep: stop, or continue on a scalar CPU, at PC[lane]
+  void stop(int lane, CPU::StopReason reason);
+  void peel(int lane);
+
+  // v the same in all active lanes? Any v nonzero?
+  bool same(const uint8_t * v) const;
+  bool same(const uint16_t * v) const;
+  bool any(const uint8_t * v) const;
+
+  template <AMode mode> Address address(uint16_t operand);
+  Address uniform(uint16_t base) const;
+  Address perLane(const uint16_t * addresses) const;
+  Address stack() const;
+  void load(const Address & addr, uint8_t * v) const;
+  void store(const Address & addr, const uint8_t * v);
+  void push(const uint8_t * v);
+  void pull(uint8_t * v);
+
+  // dst = src in the active lanes
+  void assign(uint8_t * dst, const uint8_t * src);
+  void setZN(const uint8_t * v);
+  void status(uint8_t * v) const;
+
+  // Continue at per lane targets, the lanes jumping to pc (the
+  // instruction itself) stop with LoopDetected
+  void jump(const uint16_t * targets);
+  void jump(uint16_t target);
+
+  bool varies(uint16_t address) const { return rowVaries[address >> 6] & (uint64_t(1) << (address & 63)); }
+  void setVaries(uint16_t address) { rowVaries[address >> 6] |= uint64_t(1) << (address & 63); }
+  void clearVaries(uint16_t address) { rowVaries[address >> 6] &= ~(uint64_t(1) << (address & 63)); }
+
+  const Decoded * decoded;           ///< by opcode
+
+  std::vector<Row> mem;              ///< 65536 rows
+  uint64_t rowVaries[65536 / 64]{};  ///< rows written per lane, code is checked
+
+  uint8_t A[Lanes]{}, X[Lanes]{}, Y[Lanes]{}, S[Lanes]{};
+  uint8_t P[Lanes]{};                ///< I, D, B and reserved bits of the status
+  uint8_t carry[Lanes]{};            ///< lazily evaluated flags as in CPU
+  uint8_t resultZ[Lanes]{};
+  uint8_t resultN[Lanes]{};
+  uint8_t overflow[Lanes]{};
+  uint16_t PC[Lanes]{};              ///< current for the lanes not active
+
+  uint8_t live[Lanes]{};             ///< 0xFF while running in lockstep
+  uint8_t active[Lanes]{};           ///< 0xFF in the group executing at pc
+  uint16_t pc{0};                    ///< of the active group
+  int first{Lanes};                  ///< an active lane, Lanes if none
+  bool diverged{false};              ///< live lanes outside the active group?
+  bool full{false};                  ///< all lanes active, no masking
+  bool split{false};                 ///< the step left per lane PCs
+
+  // Counts of the current run(), a live lane has run steps - idle[lane]
+  uint64_t budget{0};                ///< instructions per lane
+  uint64_t steps{0};                 ///< instructions run by the active groups
+  uint64_t idle[Lanes]{};            ///< steps each lane waited
+  uint32_t waiting[Lanes]{};         ///< steps each lane waited since it ran
+  uint64_t limit{0};                 ///< steps when the next lane is at budget
+  uint64_t done[Lanes]{};            ///< instructions of the previous runs
+
+  CPU::StopReason reasons[Lanes];
+
+  std::unique_ptr<Scalar> scalar[Lanes];
+};
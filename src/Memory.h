@@ -7,17 +7,37 @@
 ///
 /// There is support for reading/writing Bytes (8bits) and Words (16bits)
 /// as well as for loading data and code into memory.
+/// Each 256 byte page has a read and a write pointer. RAM and ROM pages are
+/// accessed directly through them, ROM pages write to the RAM below or a
+/// discard page. Banking ROM in and out only changes the pointers.
+/// I/O pages, watched pages and (for writes) pages with decoded
+/// instructions have no pointer, their accesses take a slow path calling
+/// the device handlers and checking the address.
 //===----------------------------------------------------------------------===//
 
 #pragma once
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <string>
 #include <vector>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <unistd.h>
+#include <FileImage.h>
+
+// Notified when memory holding decoded instructions is modified,
+// see Memory::markCode(), and when Memory::isFlat() changes
+class CodeObserver {
+public:
+  virtual void codeModified(uint16_t address, uint32_t length) = 0;
+  virtual void flatChanged(bool flat) = 0;
+};
+
+// Notified when a watched address is accessed, see Memory::addWatch()
+class WatchObserver {
+public:
+  virtual void watchTriggered(uint16_t address, uint8_t value, bool write) = 0;
+};
 
 struct Snippet {
   uint16_t address;
@@ -27,10 +47,143 @@ struct Snippet {
 
 class Memory {
 public:
+  // Kinds of access a watch point triggers on
+  enum Access { Read = 0x02, Write = 0x04 };
+
+  // Device callbacks of I/O pages, see mapIo()
+  typedef std::function<uint8_t(uint16_t address)> ReadHandler;
+  typedef std::function<void(uint16_t address, uint8_t value)> WriteHandler;
+
   uint8_t mem[65536];
 
+  Memory() {
+    mapRam(0x0000, 65536);
+  }
+
+  Memory(const Memory &) = delete; // the page pointers point into mem
+  Memory & operator=(const Memory &) = delete;
+
+  // Plain RAM at [address, address + length), whole pages
+  void mapRam(uint16_t address, uint32_t length) {
+    map(address, length, 0, mem + address, mem + address);
+  }
+
+  // Writes to [address, address + length) are ignored, whole pages. The
+  // contents are loaded with loadBinaryFile() or writeByteRaw()
+  void mapRom(uint16_t address, uint32_t length) {
+    map(address, length, RomPage, mem + address, discard);
+  }
+
+  // Reads of [address, address + length) return the image at data (not
+  // copied), writes go to the RAM below. Whole pages
+  void mapRom(uint16_t address, const uint8_t * data, uint32_t length) {
+    map(address, length, RomPage, data, mem + address);
+  }
+
+  // Reads and writes of [address, address + length) call the handlers,
+  // whole pages. peek() returns the memory below. Zero page and stack are
+  // always RAM
+  void mapIo(uint16_t address, uint32_t length, ReadHandler read, WriteHandler write) {
+    if (io.empty()) {
+      io.resize(256);
+    }
+    for (uint32_t page = address >> 8; page < (address + length) >> 8; page++) {
+      io[page] = {read, write};
+    }
+    mapIo(address, length);
+  }
+
+  // I/O pages with the handlers set before, for bank switching
+  void mapIo(uint16_t address, uint32_t length) {
+    assert((io.size() == 256) and io[address >> 8].read and io[address >> 8].write);
+    map(address, length, IoPage, mem + address, mem + address);
+  }
+
+  // Writes to $00 and $01 also call handler, like the processor port of
+  // the 6510. Reads return the values written
+  void setPortHandler(WriteHandler handler) {
+    port = handler;
+    pageFlags[0] |= PortPage;
+    remap(0);
+  }
+
+  bool isIo(uint16_t address) {
+    return pageFlags[address >> 8] & IoPage;
+  }
+
+  // All pages read mem, no ROM images, I/O, read watch points or port
+  // handler? Then reads can index mem directly, see Bus
+  bool isFlat() const {
+    return nonFlatPages == 0;
+  }
+
   void clear() {
     memset(mem, 0, sizeof(mem));
+    modified(0x0000, sizeof(mem));
+  }
+
+  // Register the (single) observer of code modifications. Pages flagged
+  // for a previous observer are no longer of interest.
+  void setCodeObserver(CodeObserver * obs) {
+    observer = obs;
+    for (int page = 0; page < 256; page++) {
+      pageFlags[page] &= ~CodePage;
+      remap(page);
+    }
+  }
+
+  // Flag the page holding address as containing decoded instructions.
+  // Writes to flagged pages are reported to the CodeObserver.
+  void markCode(uint16_t address) {
+    pageFlags[address >> 8] |= CodePage;
+    remap(address >> 8);
+  }
+
+  // Register the (single) observer of watch points
+  void setWatchObserver(WatchObserver * obs) {
+    watchObserver = obs;
+  }
+
+  // Report reads and/or writes (Access bits) of address to the
+  // WatchObserver. Only readByte(), readWord(), writeByte() and writeWord()
+  // are watched, not peek(), loading or writeByteRaw()
+  void addWatch(uint16_t address, int access) {
+    if (watches.empty()) {
+      watches.assign(65536, 0);
+    }
+    watchCount += (watches[address] == 0);
+    watches[address] |= access & (Read | Write);
+    watchCount -= (watches[address] == 0);
+    pageFlags[address >> 8] |= access & (Read | Write);
+    remap(address >> 8);
+  }
+
+  void removeWatch(uint16_t address, int access) {
+    if (watches.empty()) {
+      return;
+    }
+    watchCount -= (watches[address] != 0);
+    watches[address] &= ~access;
+    watchCount += (watches[address] != 0);
+    uint8_t flags = 0;
+    for (int i = address & 0xFF00; i <= (address | 0xFF); i++) {
+      flags |= watches[i];
+    }
+    pageFlags[address >> 8] = (pageFlags[address >> 8] & ~(Read | Write)) | flags;
+    remap(address >> 8);
+  }
+
+  void clearWatches() {
+    watches.clear();
+    watchCount = 0;
+    for (int page = 0; page < 256; page++) {
+      pageFlags[page] &= ~(Read | Write);
+      remap(page);
+    }
+  }
+
+  bool hasWatches() {
+    return watchCount > 0;
   }
 
   // Clear memory and set program start address to 0x1000
@@ -49,70 +202,267 @@ public:
     }
   }
 
+  // Copy the file to loadAddress in one operation. Files running past
+  // $FFFF are an error
   void loadBinaryFile(std::string fileName, uint16_t loadAddress) {
     printf("Loading file %s\n", fileName.c_str());
-    int fd = open(fileName.c_str(), O_RDONLY);
-    if(fd < 0){
-        printf("error: could not open %s\n", fileName.c_str());
-        exit(1);
-    }
-    uint8_t byte;
-    while ((loadAddress <= 0xFFFF) and (read(fd, &byte, 1) != 0 )) {
-      writeByteRaw(loadAddress++, byte);
+    FileImage image(fileName);
+    if (image.size() > 65536u - loadAddress) {
+      printf("error: %s (%u bytes) does not fit at 0x%04x\n",
+             fileName.c_str(), image.size(), loadAddress);
+      exit(1);
     }
+    loadData(loadAddress, image.data(), image.size());
+  }
+
+  // Copy length bytes from data to [address, address + length)
+  void loadData(uint16_t address, const uint8_t * data, uint32_t length) {
+    assert(address + length <= 65536);
+    if (length == 0)
+      return;
+    memcpy(mem + address, data, length);
+    modified(address, length);
   }
 
   void dump(uint16_t address, uint16_t bytes) {
     printf("%04X: ", address);
     for (int i = 0; i < bytes; i++) {
-      printf("%02X ", mem[address + i]);
+      printf("%02X ", peek(address + i));
     }
     printf("\n");
   }
 
+  // Reads without watch point checks or device reads, for instruction
+  // fetch and debugging
+  uint8_t peek(uint16_t address) {
+    return readData[address >> 8][address & 0xFF];
+  }
+
+  uint16_t peekWord(uint16_t address) {
+    return peek(address) + peek(address + 1) * 256;
+  }
+
   uint8_t readByte(uint16_t address) {
-    return mem[address];
+    const uint8_t * page = reads[address >> 8];
+    if (page == nullptr)
+      return readSlow(address);
+    return page[address & 0xFF];
   }
 
+  // Loading: writes mem, the RAM or ROM loaded in place and the memory
+  // below image ROM and I/O pages
   void writeByteRaw(uint16_t address, uint8_t value) {
     mem[address] = value;
+    if (pageFlags[address >> 8])
+      modified(address, 1);
   }
 
   void writeByte(uint16_t address, uint8_t value) {
-    if (isRom(address))
-      return;
+    uint8_t * page = writes[address >> 8];
+    if (page == nullptr)
+      return writeSlow(address, value);
+    page[address & 0xFF] = value;
+  }
+
+  // Zero page and stack, always RAM. Only watch points, decoded
+  // instructions and (for zero page writes below 2) the port take the
+  // slow path
+  uint8_t readZeroPage(uint8_t address) {
+    if (reads[0] == nullptr)
+      return readSlow(address);
+    return mem[address];
+  }
+
+  void writeZeroPage(uint8_t address, uint8_t value) {
+    if (address < zeroPageSlow)
+      return writeSlow(address, value);
     mem[address] = value;
   }
 
+  uint8_t readStack(uint8_t s) {
+    if (reads[1] == nullptr)
+      return readSlow(0x100 | s);
+    return mem[0x100 | s];
+  }
+
+  void writeStack(uint8_t s, uint8_t value) {
+    if (writes[1] == nullptr)
+      return writeSlow(0x100 | s, value);
+    mem[0x100 | s] = value;
+  }
+
+  // Words wrap around at $FFFF like on the CPU
   uint16_t readWord(uint16_t address) {
-    assert(address < 0xFFFF);
-    return mem[address] + mem[address + 1] * 256;
+    return readByte(address) + readByte(address + 1) * 256;
   }
 
   void writeWord(uint16_t address, uint16_t value) {
-    if (isRom(address))
-      return;
-    assert(address < 0xFFFF);
-    mem[address] = value & 0xFF;
-    mem[address + 1] = value >> 8;
+    writeByte(address, value & 0xFF);
+    writeByte(address + 1, value >> 8);
   }
 
-  bool isRom(uint16_t address) {
-    return false;
-    if (address >= 0xE000)
-      return true;
+  // No watch points or I/O in [address, address + length), and if it is
+  // written (access) no ROM without RAM below or port? Then copy(), fill()
+  // and reading through readPointer() are the same as byte accesses
+  bool isPlain(uint16_t address, uint32_t length, int access = Read | Write) {
+    uint8_t mask = ((access & Read) ? (ReadWatchPage | IoPage) : 0) |
+                   ((access & Write) ? (WriteWatchPage | IoPage | PortPage) : 0);
+    for (uint32_t page = address >> 8; page <= (address + length - 1) >> 8; page++) {
+      if ((pageFlags[page] & mask) or ((access & Write) and (writeData[page] == discard)))
+        return false;
+    }
+    return true;
+  }
 
-    if ((address >= 0xA000) and (address < 0xBFFF))
-      return true;
+  // Host memory read at [address, address + length), if it is contiguous
+  const uint8_t * readPointer(uint16_t address, uint32_t length) {
+    for (uint32_t page = (address >> 8) + 1; page <= (address + length - 1) >> 8; page++) {
+      if (readData[page] != readData[page - 1] + 256)
+        return nullptr;
+    }
+    return readData[address >> 8] + (address & 0xFF);
+  }
 
-    if ((address >= 0xD000) and (address <= 0xDFFF))
-      return true;
-    return false;
+  // writeByte() for [dst, dst + length), overlapping ranges are copied
+  // like memmove(). For loops executed at once, see CPU::recognizeLoop()
+  void copy(uint16_t dst, uint16_t src, uint16_t length) {
+    assert((dst + length <= 65536) and (src + length <= 65536));
+    const uint8_t * from = readPointer(src, length);
+    if (from != nullptr) {
+      memmove(mem + dst, from, length);
+    } else if (dst < src) {
+      for (int i = 0; i < length; i++)
+        mem[dst + i] = peek(src + i);
+    } else {
+      for (int i = length - 1; i >= 0; i--)
+        mem[dst + i] = peek(src + i);
+    }
+    modified(dst, length);
+  }
+
+  void fill(uint16_t dst, uint8_t value, uint16_t length) {
+    assert(dst + length <= 65536);
+    memset(mem + dst, value, length);
+    modified(dst, length);
   }
 
 private:
+  friend class JIT; // generated code uses the page pointers
+
+  // Page flags, the watch flags are the Access bits
+  enum PageFlag { CodePage = 0x01, ReadWatchPage = Read, WriteWatchPage = Write,
+                  RomPage = 0x08, IoPage = 0x10, PortPage = 0x20 };
+
+  struct IoHandlers {
+    ReadHandler read;
+    WriteHandler write;
+  };
+
+  const uint8_t * reads[256];         ///< page data for reads, or slow path
+  uint8_t * writes[256];              ///< page data for writes, or slow path
+  const uint8_t * readData[256]{};    ///< page data read (mem or ROM image)
+  uint8_t * writeData[256]{};         ///< page data written (mem or discard)
+  uint8_t discard[256];               ///< written by writes to ROM pages
+  uint8_t pageFlags[256]{};           ///< per 256 byte page PageFlag bits
+  bool flatPages[256]{};              ///< pages reading mem without checks
+  int zeroPageSlow{0};                ///< zero page writes below take the slow path
+  int nonFlatPages{256};
+  std::vector<IoHandlers> io;         ///< by page, if any I/O is mapped
+  WriteHandler port;                  ///< called on writes to $00 and $01
+  CodeObserver * observer{nullptr};   ///< notified on writes to code pages
+  WatchObserver * watchObserver{nullptr}; ///< notified on watched accesses
+  std::vector<uint8_t> watches;       ///< Access bits by address, if any
+  int watchCount{0};                  ///< addresses with Access bits set
+
   void load(uint16_t address, std::vector<uint8_t> & program) {
     assert(address + program.size() < 65536);
     memcpy(mem + address, program.data(), program.size());
+    modified(address, program.size());
+  }
+
+  // Set the kind of memory of the pages and the data read and written
+  // (consecutive pages from read and write, or discard), keeping the watch
+  // and code flags. Decoded instructions no longer visible are reported
+  void map(uint16_t address, uint32_t length, uint8_t kind, const uint8_t * read,
+           uint8_t * write) {
+    assert(((address & 0xFF) == 0) and ((length & 0xFF) == 0) and (address + length <= 65536));
+    assert((kind == 0) or (address >= 0x200));
+    for (uint32_t page = address >> 8; page < (address + length) >> 8; page++) {
+      bool moved = (readData[page] != read);
+      pageFlags[page] = (pageFlags[page] & ~(RomPage | IoPage)) | kind;
+      readData[page] = read;
+      writeData[page] = write;
+      remap(page);
+      if (moved and (pageFlags[page] & CodePage))
+        modified(page << 8, 256);
+      read += 256;
+      write += (write == discard) ? 0 : 256;
+    }
+  }
+
+  // Page pointers from the page flags. Writes to code pages only need the
+  // slow path if they change what is read
+  void remap(int page) {
+    uint8_t flags = pageFlags[page];
+    bool code = (flags & CodePage) and (writeData[page] == readData[page]);
+    reads[page] = (flags & (ReadWatchPage | IoPage)) ? nullptr : readData[page];
+    writes[page] = (code or (flags & (WriteWatchPage | IoPage | PortPage))) ? nullptr :
+                   writeData[page];
+    if (page == 0) {
+      zeroPageSlow = (flags & (WriteWatchPage | CodePage)) ? 256 : (flags & PortPage) ? 2 : 0;
+    }
+
+    bool flat = (reads[page] == mem + (page << 8)) and not (flags & PortPage);
+    if (flat != flatPages[page]) {
+      bool wasFlat = isFlat();
+      flatPages[page] = flat;
+      nonFlatPages += flat ? -1 : 1;
+      if ((isFlat() != wasFlat) and (observer != nullptr))
+        observer->flatChanged(isFlat());
+    }
+  }
+
+  // Slow paths for the pages without pointer
+  __attribute__((noinline)) uint8_t readSlow(uint16_t address) {
+    uint8_t flags = pageFlags[address >> 8];
+    uint8_t value = (flags & IoPage) ? io[address >> 8].read(address) :
+                    readData[address >> 8][address & 0xFF];
+    if (flags & ReadWatchPage)
+      watched(address, value, Read);
+    return value;
+  }
+
+  __attribute__((noinline)) void writeSlow(uint16_t address, uint8_t value) {
+    int page = address >> 8;
+    uint8_t flags = pageFlags[page];
+    if (flags & IoPage) {
+      io[page].write(address, value);
+    } else {
+      writeData[page][address & 0xFF] = value;
+      if ((flags & PortPage) and (address <= 0x01))
+        port(address, value);
+    }
+    if (flags & WriteWatchPage)
+      watched(address, value, Write);
+    if (not (flags & IoPage) and (writeData[page] == readData[page]))
+      modified(address, 1);
+  }
+
+  __attribute__((noinline, cold)) void watched(uint16_t address, uint8_t value, Access access) {
+    if ((watches[address] & access) and (watchObserver != nullptr))
+      watchObserver->watchTriggered(address, value, access == Write);
+  }
+
+  // Report modification of [address, address + length) if it overlaps
+  // any page with decoded instructions
+  void modified(uint16_t address, uint32_t length) {
+    if (observer == nullptr)
+      return;
+    for (uint32_t page = address >> 8; page <= (address + length - 1) >> 8; page++) {
+      if (pageFlags[page] & CodePage) {
+        observer->codeModified(address, length);
+        return;
+      }
+    }
   }
 };
@@ -5,6 +5,9 @@
 ///
 /// \brief List of implemented 6502 opcodes
 ///
+/// The documented opcodes are shared by all variants. The NMOS 6502 (and
+/// the 2A03, an NMOS core without decimal mode) add the stable undocumented
+/// opcodes, the 65C02 adds its new instructions and addressing modes.
 //===----------------------------------------------------------------------===//
 
 #pragma once
@@ -17,13 +20,84 @@ class CPU;
 enum AMode { Implied,  Accumulator, Immediate,
              ZeroPage, ZeroPageX, ZeroPageY,
              Relative, Absolute,  AbsoluteX, AbsoluteY,
-             Indirect, IndexedIndirect, IndirectIndexed};
+             Indirect, IndexedIndirect, IndirectIndexed,
+             ZeroPageIndirect,        ///< 65C02 (zp)
+             AbsoluteIndexedIndirect, ///< 65C02 JMP (abs,X)
+             ZeroPageRelative};       ///< 65C02 BBR/BBS zp, target
+
+// The operations (mnemonics) of the 6502. Combined with an addressing
+// mode this selects the handler for an opcode, see OPCODE_TABLE below
+enum Operation { opADC, opAND, opASL, opBCC, opBCS, opBEQ, opBIT, opBMI,
+                 opBNE, opBPL, opBRK, opBVC, opBVS, opCLC, opCLD, opCLI,
+                 opCLV, opCMP, opCPX, opCPY, opDEC, opDEX, opDEY, opEOR,
+                 opINC, opINX, opINY, opJMP, opJSR, opLDA, opLDX, opLDY,
+                 opLSR, opNOP, opORA, opPHA, opPHP, opPLA, opPLP, opROL,
+                 opROR, opRTI, opRTS, opSBC, opSEC, opSED, opSEI, opSTA,
+                 opSTX, opSTY, opTAX, opTAY, opTSX, opTXA, opTXS, opTYA,
+                 // NMOS undocumented
+                 opSLO, opRLA, opSRE, opRRA, opSAX, opLAX, opDCP, opISC,
+                 opANC, opALR, opARR, opSBX, opLAS,
+                 // 65C02
+                 opBRA, opPHX, opPHY, opPLX, opPLY, opSTZ, opTRB, opTSB,
+                 opRMB, opSMB, opBBR, opBBS, opWAI, opSTP,
+                 opINVALID};
+
+// The CPU variants, each has its own instruction handlers and opcode table
+// (see CPU::execute), selected when the CPU is constructed
+enum Variant {
+  NMOS6502,  ///< 6502/6510 with the stable undocumented opcodes
+  CMOS65C02, ///< WDC 65C02
+  Ricoh2A03, ///< NES, NMOS without decimal mode
+};
+
+// How the instruction handlers read memory, every variant has handlers for
+// both (see CPU::execute). Writes always go through the page pointers
+enum Bus {
+  Paged, ///< through the page pointers of Memory: ROM images, I/O, watches
+  Flat,  ///< indexing the RAM directly, while Memory::isFlat()
+};
+
+// Differences between the variants the handlers are specialized on
+template <Variant variant> struct VariantTraits {
+  static constexpr bool decimal = (variant != Ricoh2A03); ///< D flag selects BCD
+  static constexpr bool cmos = (variant == CMOS65C02);    ///< 65C02 fixes and timing
+};
+
+// Instruction handlers execute the instruction at PC given its decoded
+// operand, see CPU::operand()
+typedef void (*Handler)(CPU * cpu, uint16_t operand);
 
 struct Opcode {
   uint8_t opcode;
-  std::string mnem;
+  const char * mnem;
+  Operation operation;
   AMode mode;
-  int (*pf)(CPU * cpu, uint8_t & reg);
+  Handler handler;
+};
+
+// An instruction decoded once and cached by its address. Can also be a
+// group of instructions executed by one fused handler (see
+// FUSED_PAIR_TABLE) or a loop (see CPU::recognizeLoop()), then operand is
+// the operand of the first instruction. A loop handler counts the
+// instructions and cycles of iterations after the first itself.
+struct Decoded {
+  Handler handler;
+  uint16_t operand; ///< operand bytes, branch target for Relative mode
+  uint16_t opcode;  ///< the opcode, NotDecoded, FusedGroup or LoopGroup
+  uint8_t length;   ///< number of bytes (opcode + operands)
+  uint8_t count;    ///< number of instructions executed by handler
+  uint8_t cycles;   ///< base cycles of the instruction(s), see Cycles
+};
+
+const uint16_t NotDecoded = 0x100;
+const uint16_t FusedGroup = 0x101;
+const uint16_t LoopGroup = 0x102;
+
+// A sequence of instructions executed by a single handler
+struct Fusion {
+  uint8_t opcodes[3];
+  uint8_t count;     ///< number of instructions, 2 or 3
+  Handler handler;
 };
 
 #define BRK     0x00
@@ -192,3 +266,578 @@ struct Opcode {
 #define SBCAY   0xF9
 #define SBCAX   0xFD
 #define INCAX   0xFE
+
+
+// NMOS undocumented opcodes
+#define SLOIXID 0x03
+#define SLOZP   0x07
+#define ANCI    0x0B
+#define SLOA    0x0F
+#define SLOIDIX 0x13
+#define SLOZX   0x17
+#define SLOAY   0x1B
+#define SLOAX   0x1F
+#define RLAIXID 0x23
+#define RLAZP   0x27
+#define ANCI2   0x2B
+#define RLAA    0x2F
+#define RLAIDIX 0x33
+#define RLAZX   0x37
+#define RLAAY   0x3B
+#define RLAAX   0x3F
+#define SREIXID 0x43
+#define SREZP   0x47
+#define ALRI    0x4B
+#define SREA    0x4F
+#define SREIDIX 0x53
+#define SREZX   0x57
+#define SREAY   0x5B
+#define SREAX   0x5F
+#define RRAIXID 0x63
+#define RRAZP   0x67
+#define ARRI    0x6B
+#define RRAA    0x6F
+#define RRAIDIX 0x73
+#define RRAZX   0x77
+#define RRAAY   0x7B
+#define RRAAX   0x7F
+#define SAXIXID 0x83
+#define SAXZP   0x87
+#define SAXA    0x8F
+#define SAXZY   0x97
+#define LAXIXID 0xA3
+#define LAXZP   0xA7
+#define LAXA    0xAF
+#define LAXIDIX 0xB3
+#define LAXZY   0xB7
+#define LASAY   0xBB
+#define LAXAY   0xBF
+#define DCPIXID 0xC3
+#define DCPZP   0xC7
+#define SBXI    0xCB
+#define DCPA    0xCF
+#define DCPIDIX 0xD3
+#define DCPZX   0xD7
+#define DCPAY   0xDB
+#define DCPAX   0xDF
+#define ISCIXID 0xE3
+#define ISCZP   0xE7
+#define SBCI2   0xEB
+#define ISCA    0xEF
+#define ISCIDIX 0xF3
+#define ISCZX   0xF7
+#define ISCAY   0xFB
+#define ISCAX   0xFF
+
+// 65C02 opcodes, RMB, SMB, BBR and BBS for bit 0 (the bit number is in the
+// high nibble, + 0x10 for each bit)
+#define TSBZP   0x04
+#define RMB     0x07
+#define TSBA    0x0C
+#define BBR     0x0F
+#define ORAIZ   0x12
+#define TRBZP   0x14
+#define INCACC  0x1A
+#define TRBA    0x1C
+#define ANDIZ   0x32
+#define BITZX   0x34
+#define DECACC  0x3A
+#define BITAX   0x3C
+#define EORIZ   0x52
+#define PHY     0x5A
+#define STZZP   0x64
+#define ADCIZ   0x72
+#define STZZX   0x74
+#define PLY     0x7A
+#define JMPIX   0x7C
+#define BRA     0x80
+#define SMB     0x87
+#define BITI    0x89
+#define BBS     0x8F
+#define STAIZ   0x92
+#define STZA    0x9C
+#define STZAX   0x9E
+#define LDAIZ   0xB2
+#define WAI     0xCB
+#define CMPIZ   0xD2
+#define PHX     0xDA
+#define STP     0xDB
+#define SBCIZ   0xF2
+#define PLX     0xFA
+
+
+// https://www.masswerk.at/6502/6502_instruction_set.html
+// The single description of all implemented opcodes: opcode, operation and
+// addressing mode. Expanded with a macro X(opcode, operation, mode) to
+// generate the opcode table and the specialized instruction handlers.
+#define OPCODE_TABLE(X) \
+  X(BRK,       BRK,  Implied)         \
+  X(ORAIXID,   ORA,  IndexedIndirect) \
+  X(ORAZP,     ORA,  ZeroPage)        \
+  X(ASLZP,     ASL,  ZeroPage)        \
+  X(PHP,       PHP,  Implied)         \
+  X(ORAI,      ORA,  Immediate)       \
+  X(ASLACC,    ASL,  Accumulator)     \
+  X(ORAA,      ORA,  Absolute)        \
+  X(ASLA,      ASL,  Absolute)        \
+                                      \
+  X(BPL,       BPL,  Relative)        \
+  X(ORAIDIX,   ORA,  IndirectIndexed) \
+  X(ORAZX,     ORA,  ZeroPageX)       \
+  X(ASLZX,     ASL,  ZeroPageX)       \
+  X(CLC,       CLC,  Implied)         \
+  X(ORAAY,     ORA,  AbsoluteY)       \
+  X(ORAAX,     ORA,  AbsoluteX)       \
+  X(ASLAX,     ASL,  AbsoluteX)       \
+                                      \
+  X(JSR,       JSR,  Absolute)        \
+  X(ANDIXID,   AND,  IndexedIndirect) \
+  X(BITZP,     BIT,  ZeroPage)        \
+  X(ANDZP,     AND,  ZeroPage)        \
+  X(ROLZP,     ROL,  ZeroPage)        \
+  X(PLP,       PLP,  Implied)         \
+  X(ANDI,      AND,  Immediate)       \
+  X(ROLACC,    ROL,  Accumulator)     \
+  X(BITA,      BIT,  Absolute)        \
+  X(ANDA,      AND,  Absolute)        \
+  X(ROLA,      ROL,  Absolute)        \
+                                      \
+  X(BMI,       BMI,  Relative)        \
+  X(ANDIDIX,   AND,  IndirectIndexed) \
+  X(ANDZX,     AND,  ZeroPageX)       \
+  X(ROLZX,     ROL,  ZeroPageX)       \
+  X(SEC,       SEC,  Implied)         \
+  X(ANDAY,     AND,  AbsoluteY)       \
+  X(ANDAX,     AND,  AbsoluteX)       \
+  X(ROLAX,     ROL,  AbsoluteX)       \
+                                      \
+  X(RTI,       RTI,  Implied)         \
+  X(EORIXID,   EOR,  IndexedIndirect) \
+  X(EORZP,     EOR,  ZeroPage)        \
+  X(LSRZP,     LSR,  ZeroPage)        \
+  X(PHA,       PHA,  Implied)         \
+  X(EORI,      EOR,  Immediate)       \
+  X(LSR,       LSR,  Accumulator)     \
+  X(JMPA,      JMP,  Absolute)        \
+  X(EORA,      EOR,  Absolute)        \
+  X(LSRA,      LSR,  Absolute)        \
+                                      \
+  X(BVC,       BVC,  Relative)        \
+  X(EORIDIX,   EOR,  IndirectIndexed) \
+  X(EORZX,     EOR,  ZeroPageX)       \
+  X(LSRZX,     LSR,  ZeroPageX)       \
+  X(CLINT,     CLI,  Implied)         \
+  X(EORAY,     EOR,  AbsoluteY)       \
+  X(EORAX,     EOR,  AbsoluteX)       \
+  X(LSRAX,     LSR,  AbsoluteX)       \
+                                      \
+  X(RTS,       RTS,  Implied)         \
+  X(ADCIXID,   ADC,  IndexedIndirect) \
+  X(ADCZP,     ADC,  ZeroPage)        \
+  X(RORZP,     ROR,  ZeroPage)        \
+  X(PLA,       PLA,  Implied)         \
+  X(ADCI,      ADC,  Immediate)       \
+  X(RORACC,    ROR,  Accumulator)     \
+  X(JMPI,      JMP,  Indirect)        \
+  X(ADCA,      ADC,  Absolute)        \
+  X(RORA,      ROR,  Absolute)        \
+                                      \
+  X(BVS,       BVS,  Relative)        \
+  X(ADCIDIX,   ADC,  IndirectIndexed) \
+  X(ADCZX,     ADC,  ZeroPageX)       \
+  X(RORZX,     ROR,  ZeroPageX)       \
+  X(SEI,       SEI,  Implied)         \
+  X(ADCAY,     ADC,  AbsoluteY)       \
+  X(ADCAX,     ADC,  AbsoluteX)       \
+  X(RORAX,     ROR,  AbsoluteX)       \
+                                      \
+  X(STAIXID,   STA,  IndexedIndirect) \
+  X(STYZP,     STY,  ZeroPage)        \
+  X(STAZP,     STA,  ZeroPage)        \
+  X(STXZP,     STX,  ZeroPage)        \
+  X(DEY,       DEY,  Implied)         \
+  X(TXA,       TXA,  Implied)         \
+  X(STYA,      STY,  Absolute)        \
+  X(STAA,      STA,  Absolute)        \
+  X(STXA,      STX,  Absolute)        \
+                                      \
+  X(BCC,       BCC,  Relative)        \
+  X(STAIDIX,   STA,  IndirectIndexed) \
+  X(STYZX,     STY,  ZeroPageX)       \
+  X(STAZX,     STA,  ZeroPageX)       \
+  X(STXZY,     STX,  ZeroPageY)       \
+  X(TYA,       TYA,  Implied)         \
+  X(STAAY,     STA,  AbsoluteY)       \
+  X(TXS,       TXS,  Implied)         \
+  X(STAAX,     STA,  AbsoluteX)       \
+                                      \
+  X(LDYI,      LDY,  Immediate)       \
+  X(LDAIXID,   LDA,  IndexedIndirect) \
+  X(LDXI,      LDX,  Immediate)       \
+  X(LDYZP,     LDY,  ZeroPage)        \
+  X(LDAZP,     LDA,  ZeroPage)        \
+  X(LDXZP,     LDX,  ZeroPage)        \
+  X(TAY,       TAY,  Implied)         \
+  X(LDAI,      LDA,  Immediate)       \
+  X(TAX,       TAX,  Implied)         \
+  X(LDYA,      LDY,  Absolute)        \
+  X(LDAA,      LDA,  Absolute)        \
+  X(LDXA,      LDX,  Absolute)        \
+                                      \
+  X(BCS,       BCS,  Relative)        \
+  X(LDAIDIX,   LDA,  IndirectIndexed) \
+  X(LDYZX,     LDY,  ZeroPageX)       \
+  X(LDAZX,     LDA,  ZeroPageX)       \
+  X(LDXZY,     LDX,  ZeroPageY)       \
+  X(CLV,       CLV,  Implied)         \
+  X(LDAAY,     LDA,  AbsoluteY)       \
+  X(TSX,       TSX,  Implied)         \
+  X(LDYAX,     LDY,  AbsoluteX)       \
+  X(LDAAX,     LDA,  AbsoluteX)       \
+  X(LDXAY,     LDX,  AbsoluteY)       \
+                                      \
+  X(CPYI,      CPY,  Immediate)       \
+  X(CMPIXID,   CMP,  IndexedIndirect) \
+  X(CPYZP,     CPY,  ZeroPage)        \
+  X(CMPZP,     CMP,  ZeroPage)        \
+  X(DECZP,     DEC,  ZeroPage)        \
+  X(INY,       INY,  Implied)         \
+  X(CMPI,      CMP,  Immediate)       \
+  X(DEX,       DEX,  Implied)         \
+  X(CPYA,      CPY,  Absolute)        \
+  X(CMPA,      CMP,  Absolute)        \
+  X(DECA,      DEC,  Absolute)        \
+                                      \
+  X(BNE,       BNE,  Relative)        \
+  X(CMPIDIX,   CMP,  IndirectIndexed) \
+  X(CMPZX,     CMP,  ZeroPageX)       \
+  X(DECZX,     DEC,  ZeroPageX)       \
+  X(CLD,       CLD,  Implied)         \
+  X(CMPAY,     CMP,  AbsoluteY)       \
+  X(CMPAX,     CMP,  AbsoluteX)       \
+  X(DECAX,     DEC,  AbsoluteX)       \
+                                      \
+  X(CPXI,      CPX,  Immediate)       \
+  X(SBCIXID,   SBC,  IndexedIndirect) \
+  X(CPXZP,     CPX,  ZeroPage)        \
+  X(SBCZP,     SBC,  ZeroPage)        \
+  X(INCZP,     INC,  ZeroPage)        \
+  X(INX,       INX,  Implied)         \
+  X(SBCI,      SBC,  Immediate)       \
+  X(SBCA,      SBC,  Absolute)        \
+  X(INCA,      INC,  Absolute)        \
+  X(NOP,       NOP,  Implied)         \
+  X(CPXA,      CPX,  Absolute)        \
+                                      \
+  X(BEQ,       BEQ,  Relative)        \
+  X(SBCIDIX,   SBC,  IndirectIndexed) \
+  X(SBCZX,     SBC,  ZeroPageX)       \
+  X(INCZX,     INC,  ZeroPageX)       \
+  X(SED,       SED,  Implied)         \
+  X(SBCAY,     SBC,  AbsoluteY)       \
+  X(SBCAX,     SBC,  AbsoluteX)       \
+  X(INCAX,     INC,  AbsoluteX)
+
+
+// The stable undocumented opcodes of the NMOS 6502 (also in the 2A03),
+// same format as OPCODE_TABLE. The unused opcodes are NOPs reading their
+// operand. Opcodes that lock up the CPU (JAM) or depend on the chip
+// (ANE, LXA, SHA, SHX, SHY, TAS) are left out, they halt with
+// IllegalOpcode.
+#define ILLEGAL_OPCODE_TABLE(X) \
+  X(SLOIXID,  SLO,  IndexedIndirect) \
+  X(SLOZP,    SLO,  ZeroPage)        \
+  X(SLOA,     SLO,  Absolute)        \
+  X(SLOIDIX,  SLO,  IndirectIndexed) \
+  X(SLOZX,    SLO,  ZeroPageX)       \
+  X(SLOAY,    SLO,  AbsoluteY)       \
+  X(SLOAX,    SLO,  AbsoluteX)       \
+                                     \
+  X(RLAIXID,  RLA,  IndexedIndirect) \
+  X(RLAZP,    RLA,  ZeroPage)        \
+  X(RLAA,     RLA,  Absolute)        \
+  X(RLAIDIX,  RLA,  IndirectIndexed) \
+  X(RLAZX,    RLA,  ZeroPageX)       \
+  X(RLAAY,    RLA,  AbsoluteY)       \
+  X(RLAAX,    RLA,  AbsoluteX)       \
+                                     \
+  X(SREIXID,  SRE,  IndexedIndirect) \
+  X(SREZP,    SRE,  ZeroPage)        \
+  X(SREA,     SRE,  Absolute)        \
+  X(SREIDIX,  SRE,  IndirectIndexed) \
+  X(SREZX,    SRE,  ZeroPageX)       \
+  X(SREAY,    SRE,  AbsoluteY)       \
+  X(SREAX,    SRE,  AbsoluteX)       \
+                                     \
+  X(RRAIXID,  RRA,  IndexedIndirect) \
+  X(RRAZP,    RRA,  ZeroPage)        \
+  X(RRAA,     RRA,  Absolute)        \
+  X(RRAIDIX,  RRA,  IndirectIndexed) \
+  X(RRAZX,    RRA,  ZeroPageX)       \
+  X(RRAAY,    RRA,  AbsoluteY)       \
+  X(RRAAX,    RRA,  AbsoluteX)       \
+                                     \
+  X(DCPIXID,  DCP,  IndexedIndirect) \
+  X(DCPZP,    DCP,  ZeroPage)        \
+  X(DCPA,     DCP,  Absolute)        \
+  X(DCPIDIX,  DCP,  IndirectIndexed) \
+  X(DCPZX,    DCP,  ZeroPageX)       \
+  X(DCPAY,    DCP,  AbsoluteY)       \
+  X(DCPAX,    DCP,  AbsoluteX)       \
+                                     \
+  X(ISCIXID,  ISC,  IndexedIndirect) \
+  X(ISCZP,    ISC,  ZeroPage)        \
+  X(ISCA,     ISC,  Absolute)        \
+  X(ISCIDIX,  ISC,  IndirectIndexed) \
+  X(ISCZX,    ISC,  ZeroPageX)       \
+  X(ISCAY,    ISC,  AbsoluteY)       \
+  X(ISCAX,    ISC,  AbsoluteX)       \
+                                     \
+  X(SAXIXID,  SAX,  IndexedIndirect) \
+  X(SAXZP,    SAX,  ZeroPage)        \
+  X(SAXA,     SAX,  Absolute)        \
+  X(SAXZY,    SAX,  ZeroPageY)       \
+  X(LAXIXID,  LAX,  IndexedIndirect) \
+  X(LAXZP,    LAX,  ZeroPage)        \
+  X(LAXA,     LAX,  Absolute)        \
+  X(LAXIDIX,  LAX,  IndirectIndexed) \
+  X(LAXZY,    LAX,  ZeroPageY)       \
+  X(LAXAY,    LAX,  AbsoluteY)       \
+                                     \
+  X(ANCI,     ANC,  Immediate)       \
+  X(ANCI2,    ANC,  Immediate)       \
+  X(ALRI,     ALR,  Immediate)       \
+  X(ARRI,     ARR,  Immediate)       \
+  X(SBXI,     SBX,  Immediate)       \
+  X(SBCI2,    SBC,  Immediate)       \
+  X(LASAY,    LAS,  AbsoluteY)       \
+                                     \
+  X(0x1A,     NOP,  Implied)         \
+  X(0x3A,     NOP,  Implied)         \
+  X(0x5A,     NOP,  Implied)         \
+  X(0x7A,     NOP,  Implied)         \
+  X(0xDA,     NOP,  Implied)         \
+  X(0xFA,     NOP,  Implied)         \
+  X(0x80,     NOP,  Immediate)       \
+  X(0x82,     NOP,  Immediate)       \
+  X(0x89,     NOP,  Immediate)       \
+  X(0xC2,     NOP,  Immediate)       \
+  X(0xE2,     NOP,  Immediate)       \
+  X(0x04,     NOP,  ZeroPage)        \
+  X(0x44,     NOP,  ZeroPage)        \
+  X(0x64,     NOP,  ZeroPage)        \
+  X(0x14,     NOP,  ZeroPageX)       \
+  X(0x34,     NOP,  ZeroPageX)       \
+  X(0x54,     NOP,  ZeroPageX)       \
+  X(0x74,     NOP,  ZeroPageX)       \
+  X(0xD4,     NOP,  ZeroPageX)       \
+  X(0xF4,     NOP,  ZeroPageX)       \
+  X(0x0C,     NOP,  Absolute)        \
+  X(0x1C,     NOP,  AbsoluteX)       \
+  X(0x3C,     NOP,  AbsoluteX)       \
+  X(0x5C,     NOP,  AbsoluteX)       \
+  X(0x7C,     NOP,  AbsoluteX)       \
+  X(0xDC,     NOP,  AbsoluteX)       \
+  X(0xFC,     NOP,  AbsoluteX)      
+
+// The 65C02 additions to OPCODE_TABLE. The unused opcodes are NOPs of
+// one to three bytes.
+#define CMOS_OPCODE_TABLE(X) \
+  X(ORAIZ,    ORA,  ZeroPageIndirect)        \
+  X(ANDIZ,    AND,  ZeroPageIndirect)        \
+  X(EORIZ,    EOR,  ZeroPageIndirect)        \
+  X(ADCIZ,    ADC,  ZeroPageIndirect)        \
+  X(STAIZ,    STA,  ZeroPageIndirect)        \
+  X(LDAIZ,    LDA,  ZeroPageIndirect)        \
+  X(CMPIZ,    CMP,  ZeroPageIndirect)        \
+  X(SBCIZ,    SBC,  ZeroPageIndirect)        \
+                                             \
+  X(BITI,     BIT,  Immediate)               \
+  X(BITZX,    BIT,  ZeroPageX)               \
+  X(BITAX,    BIT,  AbsoluteX)               \
+  X(INCACC,   INC,  Accumulator)             \
+  X(DECACC,   DEC,  Accumulator)             \
+  X(TSBZP,    TSB,  ZeroPage)                \
+  X(TSBA,     TSB,  Absolute)                \
+  X(TRBZP,    TRB,  ZeroPage)                \
+  X(TRBA,     TRB,  Absolute)                \
+  X(STZZP,    STZ,  ZeroPage)                \
+  X(STZZX,    STZ,  ZeroPageX)               \
+  X(STZA,     STZ,  Absolute)                \
+  X(STZAX,    STZ,  AbsoluteX)               \
+                                             \
+  X(BRA,      BRA,  Relative)                \
+  X(JMPIX,    JMP,  AbsoluteIndexedIndirect) \
+  X(PHX,      PHX,  Implied)                 \
+  X(PHY,      PHY,  Implied)                 \
+  X(PLX,      PLX,  Implied)                 \
+  X(PLY,      PLY,  Implied)                 \
+  X(WAI,      WAI,  Implied)                 \
+  X(STP,      STP,  Implied)                 \
+                                             \
+  X(RMB,      RMB,  ZeroPage)                \
+  X(RMB + 0x10, RMB,  ZeroPage)              \
+  X(RMB + 0x20, RMB,  ZeroPage)              \
+  X(RMB + 0x30, RMB,  ZeroPage)              \
+  X(RMB + 0x40, RMB,  ZeroPage)              \
+  X(RMB + 0x50, RMB,  ZeroPage)              \
+  X(RMB + 0x60, RMB,  ZeroPage)              \
+  X(RMB + 0x70, RMB,  ZeroPage)              \
+  X(SMB,      SMB,  ZeroPage)                \
+  X(SMB + 0x10, SMB,  ZeroPage)              \
+  X(SMB + 0x20, SMB,  ZeroPage)              \
+  X(SMB + 0x30, SMB,  ZeroPage)              \
+  X(SMB + 0x40, SMB,  ZeroPage)              \
+  X(SMB + 0x50, SMB,  ZeroPage)              \
+  X(SMB + 0x60, SMB,  ZeroPage)              \
+  X(SMB + 0x70, SMB,  ZeroPage)              \
+  X(BBR,      BBR,  ZeroPageRelative)        \
+  X(BBR + 0x10, BBR,  ZeroPageRelative)      \
+  X(BBR + 0x20, BBR,  ZeroPageRelative)      \
+  X(BBR + 0x30, BBR,  ZeroPageRelative)      \
+  X(BBR + 0x40, BBR,  ZeroPageRelative)      \
+  X(BBR + 0x50, BBR,  ZeroPageRelative)      \
+  X(BBR + 0x60, BBR,  ZeroPageRelative)      \
+  X(BBR + 0x70, BBR,  ZeroPageRelative)      \
+  X(BBS,      BBS,  ZeroPageRelative)        \
+  X(BBS + 0x10, BBS,  ZeroPageRelative)      \
+  X(BBS + 0x20, BBS,  ZeroPageRelative)      \
+  X(BBS + 0x30, BBS,  ZeroPageRelative)      \
+  X(BBS + 0x40, BBS,  ZeroPageRelative)      \
+  X(BBS + 0x50, BBS,  ZeroPageRelative)      \
+  X(BBS + 0x60, BBS,  ZeroPageRelative)      \
+  X(BBS + 0x70, BBS,  ZeroPageRelative)      \
+                                             \
+  X(0x03,     NOP,  Implied)                 \
+  X(0x13,     NOP,  Implied)                 \
+  X(0x23,     NOP,  Implied)                 \
+  X(0x33,     NOP,  Implied)                 \
+  X(0x43,     NOP,  Implied)                 \
+  X(0x53,     NOP,  Implied)                 \
+  X(0x63,     NOP,  Implied)                 \
+  X(0x73,     NOP,  Implied)                 \
+  X(0x83,     NOP,  Implied)                 \
+  X(0x93,     NOP,  Implied)                 \
+  X(0xA3,     NOP,  Implied)                 \
+  X(0xB3,     NOP,  Implied)                 \
+  X(0xC3,     NOP,  Implied)                 \
+  X(0xD3,     NOP,  Implied)                 \
+  X(0xE3,     NOP,  Implied)                 \
+  X(0xF3,     NOP,  Implied)                 \
+  X(0x0B,     NOP,  Implied)                 \
+  X(0x1B,     NOP,  Implied)                 \
+  X(0x2B,     NOP,  Implied)                 \
+  X(0x3B,     NOP,  Implied)                 \
+  X(0x4B,     NOP,  Implied)                 \
+  X(0x5B,     NOP,  Implied)                 \
+  X(0x6B,     NOP,  Implied)                 \
+  X(0x7B,     NOP,  Implied)                 \
+  X(0x8B,     NOP,  Implied)                 \
+  X(0x9B,     NOP,  Implied)                 \
+  X(0xAB,     NOP,  Implied)                 \
+  X(0xBB,     NOP,  Implied)                 \
+  X(0xEB,     NOP,  Implied)                 \
+  X(0xFB,     NOP,  Implied)                 \
+  X(0x02,     NOP,  Immediate)               \
+  X(0x22,     NOP,  Immediate)               \
+  X(0x42,     NOP,  Immediate)               \
+  X(0x62,     NOP,  Immediate)               \
+  X(0x82,     NOP,  Immediate)               \
+  X(0xC2,     NOP,  Immediate)               \
+  X(0xE2,     NOP,  Immediate)               \
+  X(0x44,     NOP,  ZeroPage)                \
+  X(0x54,     NOP,  ZeroPageX)               \
+  X(0xD4,     NOP,  ZeroPageX)               \
+  X(0xF4,     NOP,  ZeroPageX)               \
+  X(0x5C,     NOP,  Absolute)                \
+  X(0xDC,     NOP,  Absolute)                \
+  X(0xFC,     NOP,  Absolute)               
+
+// Instruction sequences common in hot loops, executed by one fused handler
+// (CPU::fused) when found in the decode cache. Only the last instruction
+// may be a branch. Expanded with X(opcode, operation, mode, ...) for each
+// instruction. Use sim6502 --pairs to find the hottest pairs of a workload.
+#define FUSED_TRIPLE_TABLE(X) \
+  X(INX,  INX, Implied,   CPXI, CPX, Immediate,  BNE, BNE, Relative) \
+  X(INY,  INY, Implied,   CPYI, CPY, Immediate,  BNE, BNE, Relative)
+
+#define FUSED_COMPARE(X, opcode, operation, mode) \
+  X(opcode, operation, mode,  BNE, BNE, Relative) \
+  X(opcode, operation, mode,  BEQ, BEQ, Relative) \
+  X(opcode, operation, mode,  BCC, BCC, Relative) \
+  X(opcode, operation, mode,  BCS, BCS, Relative)
+
+#define FUSED_PAIR_TABLE(X) \
+  X(DEX,     DEX, Implied,          BNE,     BNE, Relative)        \
+  X(DEY,     DEY, Implied,          BNE,     BNE, Relative)        \
+  X(INX,     INX, Implied,          BNE,     BNE, Relative)        \
+  X(INY,     INY, Implied,          BNE,     BNE, Relative)        \
+  X(LDAIDIX, LDA, IndirectIndexed,  STAIDIX, STA, IndirectIndexed) \
+  X(CLC,     CLC, Implied,          ADCI,    ADC, Immediate)       \
+  X(CLC,     CLC, Implied,          ADCZP,   ADC, ZeroPage)        \
+  X(CLC,     CLC, Implied,          ADCA,    ADC, Absolute)        \
+  X(SEC,     SEC, Implied,          SBCI,    SBC, Immediate)       \
+  X(SEC,     SEC, Implied,          SBCZP,   SBC, ZeroPage)        \
+  X(SEC,     SEC, Implied,          SBCA,    SBC, Absolute)        \
+  FUSED_COMPARE(X, CMPI,  CMP, Immediate)                          \
+  FUSED_COMPARE(X, CMPZP, CMP, ZeroPage)                           \
+  FUSED_COMPARE(X, CMPA,  CMP, Absolute)                           \
+  FUSED_COMPARE(X, CPXI,  CPX, Immediate)                          \
+  FUSED_COMPARE(X, CPXZP, CPX, ZeroPage)                           \
+  FUSED_COMPARE(X, CPXA,  CPX, Absolute)                           \
+  FUSED_COMPARE(X, CPYI,  CPY, Immediate)                          \
+  FUSED_COMPARE(X, CPYZP, CPY, ZeroPage)                           \
+  FUSED_COMPARE(X, CPYA,  CPY, Absolute)
+
+
+// Base cycles for each opcode (NMOS 6502, undocumented opcodes included).
+// Reads with AbsoluteX, AbsoluteY and IndirectIndexed addressing take one
+// cycle more when the indexed address is on another page than the base
+// address. Taken branches take one cycle more, two if the target is on
+// another page than the next instruction.
+const uint8_t Cycles[256] = {
+//0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+  7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6, // 0
+  2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 1
+  6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6, // 2
+  2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 3
+  6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6, // 4
+  2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 5
+  6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6, // 6
+  2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 7
+  2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4, // 8
+  2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5, // 9
+  2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4, // A
+  2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4, // B
+  2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6, // C
+  2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // D
+  2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6, // E
+  2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7  // F
+};
+
+// Base cycles for each opcode on the 65C02. Indexed reads crossing a page
+// take one cycle more, like the NMOS 6502, and so do shifts with AbsoluteX
+// addressing and ADC and SBC in decimal mode.
+const uint8_t CyclesCMOS[256] = {
+//0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+  7, 6, 2, 1, 5, 3, 5, 5, 3, 2, 2, 1, 6, 4, 6, 5, // 0
+  2, 5, 5, 1, 5, 4, 6, 5, 2, 4, 2, 1, 6, 4, 6, 5, // 1
+  6, 6, 2, 1, 3, 3, 5, 5, 4, 2, 2, 1, 4, 4, 6, 5, // 2
+  2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 2, 1, 4, 4, 6, 5, // 3
+  6, 6, 2, 1, 3, 3, 5, 5, 3, 2, 2, 1, 3, 4, 6, 5, // 4
+  2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 3, 1, 8, 4, 6, 5, // 5
+  6, 6, 2, 1, 3, 3, 5, 5, 4, 2, 2, 1, 6, 4, 6, 5, // 6
+  2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 4, 1, 6, 4, 6, 5, // 7
+  2, 6, 2, 1, 3, 3, 3, 5, 2, 2, 2, 1, 4, 4, 4, 5, // 8
+  2, 6, 5, 1, 4, 4, 4, 5, 2, 5, 2, 1, 4, 5, 5, 5, // 9
+  2, 6, 2, 1, 3, 3, 3, 5, 2, 2, 2, 1, 4, 4, 4, 5, // A
+  2, 5, 5, 1, 4, 4, 4, 5, 2, 4, 2, 1, 4, 4, 4, 5, // B
+  2, 6, 2, 1, 3, 3, 5, 5, 2, 2, 2, 3, 4, 4, 6, 5, // C
+  2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 3, 3, 4, 4, 7, 5, // D
+  2, 6, 2, 1, 3, 3, 5, 5, 2, 2, 2, 1, 4, 4, 6, 5, // E
+  2, 5, 5, 1, 4, 4, 6, 5, 2, 4, 4, 1, 4, 4, 7, 5  // F
+};
+
+// Longest instruction (undocumented NMOS read-modify-write with
+// IndirectIndexed addressing, 65C02 NOP $5C), see CPU::runCycles()
+const int MaxCycles = 8;
@@ -0,0 +1,77 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Cycle ordered event queue for devices
+///
+/// Devices (timers, video, ...) schedule callbacks at a CPU cycle count.
+/// The events are kept in a binary min-heap, the run loops only look at
+/// the earliest one, see CPU::run()
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class Scheduler {
+public:
+  // Called with the cycle the event was scheduled at, the CPU cycle count
+  // can be a few cycles later
+  typedef std::function<void(uint64_t cycle)> Callback;
+
+  static constexpr uint64_t Never{UINT64_MAX}; ///< next() with no events
+
+  // Call callback at the first instruction boundary at or after cycle.
+  // Events at the same cycle are called in the order they were scheduled.
+  // Returns an id for cancel()
+  uint64_t schedule(uint64_t cycle, Callback callback) {
+    events.push_back({cycle, nextId, callback});
+    std::push_heap(events.begin(), events.end(), later);
+    return nextId++;
+  }
+
+  // Remove a scheduled event, ids of events already called are ignored
+  void cancel(uint64_t id) {
+    auto it = std::find_if(events.begin(), events.end(),
+                           [id](const Event & event) { return event.id == id; });
+    if (it != events.end()) {
+      events.erase(it);
+      std::make_heap(events.begin(), events.end(), later);
+    }
+  }
+
+  void clear() { events.clear(); }
+
+  // Cycle of the earliest event
+  uint64_t next() const { return events.empty() ? Never : events.front().cycle; }
+
+  // Call the events due at cycle now in order. Events scheduled by the
+  // callbacks are called too if they are due
+  void runDue(uint64_t now) {
+    while (next() <= now) {
+      std::pop_heap(events.begin(), events.end(), later);
+      Event event = events.back();
+      events.pop_back();
+      event.callback(event.cycle);
+    }
+  }
+
+private:
+  struct Event {
+    uint64_t cycle;
+    uint64_t id;       ///< increasing, orders events at the same cycle
+    Callback callback;
+  };
+
+  // Heap order, the earliest event is at the front
+  static bool later(const Event & a, const Event & b) {
+    return (a.cycle > b.cycle) or ((a.cycle == b.cycle) and (a.id > b.id));
+  }
+
+  std::vector<Event> events; ///< binary min-heap
+  uint64_t nextId{1};
+};
@@ -10,6 +10,8 @@
 #include <ncurses.h>
 #include <src/pet/Hooks.h>
 #include <src/pet/gfx.h>
+#include <poll.h>
+#include <unistd.h>
 #include <fstream>
 #include <streambuf>
 #include <iostream>
@@ -78,9 +80,45 @@ bool Hooks::getChar(int & ch) {
 }
 
 
+// Sleeps until stdin is readable, ncurses reads the key
+void Hooks::waitForKey(std::chrono::milliseconds timeout) {
+  struct pollfd fds{STDIN_FILENO, POLLIN, 0};
+  poll(&fds, 1, timeout.count());
+}
+
+
+void Hooks::startJiffyTimer(uint64_t period) {
+  jiffyPeriod = period;
+  cpu.schedule(cpu.getCycleCount() + period, [this](uint64_t cycle) { jiffyTimer(cycle); });
+}
+
+// The line stays active until the interrupt is acknowledged
+void Hooks::jiffyTimer(uint64_t cycle) {
+  irqActive = true;
+  cpu.setIRQ(true);
+  cpu.schedule(cycle + jiffyPeriod, [this](uint64_t cycle) { jiffyTimer(cycle); });
+}
+
+bool Hooks::jiffyAcknowledge() {
+  bool pending = irqActive;
+  irqActive = false;
+  cpu.setIRQ(false);
+  return pending;
+}
+
+
 void Hooks::printScreen(int X, int Y, uint16_t screenaddr, bool drawPixmap) {
   char buffer[1024];
   if (drawPixmap) {
+    std::vector<uint8_t> screen(X * Y);
+    for (int i = 0; i < X * Y; i++) {
+      screen[i] = mem.peek(screenaddr + i);
+    }
+    if (screen == shown) { // nothing to redraw
+      return;
+    }
+    shown = screen;
+
     gfxp->gfx_clear();
   }
 
@@ -89,10 +127,10 @@ void Hooks::printScreen(int X, int Y, uint16_t screenaddr, bool drawPixmap) {
     int i = 0;
     for (int x = 0; x < X; x++) {
       uint16_t addr = screenaddr + y*X + x;
-      buffer[i++] = charToAscii(mem.readByte(addr));
+      buffer[i++] = charToAscii(mem.peek(addr));
 
       if (drawPixmap) {
-        plotChar(mem.readByte(addr), x, y, 0x8000);
+        plotChar(mem.peek(addr), x, y, 0x8000);
       }
     }
     buffer[i++] = 0;
@@ -115,7 +153,7 @@ void Hooks::plotChar(uint8_t ch, int X, int Y, uint16_t charromaddr) {
   uint16_t yoff = Y * 8;
 
   for (int i = 0; i < 8; i++) {
-    uint8_t line = mem.readByte(charaddr + i);
+    uint8_t line = mem.peek(charaddr + i);
     if (line & 0x01)
       gfxp->gfx_point(xoff + 7, yoff + i);
     if (line & 0x02)
@@ -152,7 +190,6 @@ void Hooks::load(std::string program) {
     else
       typeKey(ch);
 
-    cpu.clearInstructionCount();
     cpu.run(40000);
   }
 }
@@ -13,6 +13,8 @@
 #include <CPU.h>
 #include <Memory.h>
 #include <pet/gfx.h>
+#include <chrono>
+#include <vector>
 
 class Hooks {
 public:
@@ -25,11 +27,21 @@ public:
 
   void typeKey(int key);
   bool getChar(int & read);
+  void waitForKey(std::chrono::milliseconds timeout); // or timeout
   bool handleKey(int ch);
   char charToAscii(uint8_t charcode);
   void load(std::string program);
   void loadFile();
 
+  // IRQ every period cycles like the VIA/CIA timer driving the kernal's
+  // jiffy clock, cursor blink and keyboard scan
+  void startJiffyTimer(uint64_t period);
+
+  // Called by the I/O read handler of the timer's interrupt register, the
+  // kernal reads it before RTI. Releases the IRQ line, returns true if the
+  // timer interrupt was pending
+  bool jiffyAcknowledge();
+
 
 private:
   WINDOW *win;  // ncurses window
@@ -37,5 +49,10 @@ private:
   uint8_t Xres; // width in characters
   uint8_t Yres; // height in characters
   GFX * gfxp;   // ptr to bitmapped screen (X11)
+  std::vector<uint8_t> shown; // screen memory last drawn
   CPU & cpu;
+  uint64_t jiffyPeriod{0};    // cycles between timer interrupts
+  bool irqActive{false};      // timer holds the IRQ line
+
+  void jiffyTimer(uint64_t cycle);
 };
@@ -0,0 +1,42 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief ROM images built into the emulators (Roms.S), or read from files
+/// given on the command line
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <FileImage.h>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+extern "C" const uint8_t c64Kernal[0x2000];
+extern "C" const uint8_t c64Basic[0x2000];
+extern "C" const uint8_t c64Chars[0x1000];
+extern "C" const uint8_t vic20Kernal[0x2000];
+extern "C" const uint8_t vic20Basic[0x2000];
+extern "C" const uint8_t vic20Chars[0x1000];
+
+class Rom {
+public:
+  // The built-in image, or size bytes of fileName if not empty
+  template <uint32_t size>
+  Rom(const uint8_t (& builtIn)[size], std::string fileName) : image(builtIn) {
+    if (fileName != "") {
+      printf("Loading file %s\n", fileName.c_str());
+      file.reset(new FileImage(fileName, size));
+      image = file->data();
+    }
+  }
+
+  const uint8_t * data() const { return image; }
+
+private:
+  const uint8_t * image;
+  std::unique_ptr<FileImage> file;
+};
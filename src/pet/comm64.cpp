@@ -14,6 +14,10 @@
 
 #include <CPU.h>
 #include <pet/Hooks.h>
+#include <pet/Roms.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #ifdef Success
 #undef Success
@@ -21,20 +25,32 @@
 #endif
 
 
+const uint64_t ClockHz{985248}; ///< PAL C64
+const int JiffyHz{60};          ///< kernal timer interrupts per second
+const int SliceMs{10};          ///< machine time run between screen updates
+const int LineCycles{63};       ///< PAL VIC-II raster line
+const int RasterLines{312};
+
 int main(int argc, char *argv[]) {
   Memory mem;
   CPU cpu(mem);
   CLI::App app{"C64 Emulator"};
 
   bool Debug = false;
+  std::string kernalFile, basicFile, charsFile;
   app.add_flag("-d,--debug", Debug, "enable debug");
+  app.add_option("--kernal", kernalFile, "kernal ROM file (default built in)");
+  app.add_option("--basic", basicFile, "BASIC ROM file (default built in)");
+  app.add_option("--chars", charsFile, "character ROM file (default built in)");
   CLI11_PARSE(app, argc, argv);
   int ch;
 
-  mem.loadBinaryFile("src/pet/c64/kernal.901227-02.bin", 0xE000);
-  mem.loadBinaryFile("src/pet/c64/c64_chars.bin", 0xD000);
-  mem.loadBinaryFile("src/pet/c64/basic.901226-01.bin", 0xA000);
-  mem.loadBinaryFile("src/pet/c64/c64_chars.bin", 0x8000);
+  Rom kernal(c64Kernal, kernalFile);
+  Rom basic(c64Basic, basicFile);
+  Rom chargen(c64Chars, charsFile);
+  mem.loadData(0x8000, chargen.data(), 0x1000);
+  mem.mapRom(0xA000, basic.data(), 0x2000);
+  mem.mapRom(0xE000, kernal.data(), 0x2000);
   cpu.reset(0x0000);
 
   if (Debug)
@@ -42,16 +58,68 @@ int main(int argc, char *argv[]) {
   //cpu.setTraceAddr(config.traceAddr);
 
   Hooks sys(cpu, mem, 41,26, Debug);
+
+  // I/O chips, the registers repeat over their pages and read back what
+  // was written except for the raster line and the CIA 1 interrupt flags,
+  // which acknowledge the jiffy timer. The colour RAM is the RAM below
+  uint8_t vic[64]{}, sid[32]{}, cia1[16]{}, cia2[16]{};
+  mem.mapIo(0xD000, 0x400, [&](uint16_t addr) -> uint8_t {
+    int line = cpu.getCycleCount() / LineCycles % RasterLines;
+    switch (addr & 0x3F) {
+      case 0x11: return (vic[0x11] & 0x7F) | ((line >> 1) & 0x80);
+      case 0x12: return line;
+      default:   return vic[addr & 0x3F];
+    }
+  }, [&](uint16_t addr, uint8_t value) { vic[addr & 0x3F] = value; });
+  mem.mapIo(0xD400, 0x400, [&](uint16_t addr) { return sid[addr & 0x1F]; },
+            [&](uint16_t addr, uint8_t value) { sid[addr & 0x1F] = value; });
+  mem.mapIo(0xDC00, 0x100, [&](uint16_t addr) -> uint8_t {
+    if ((addr & 0x0F) == 0x0D) {
+      return sys.jiffyAcknowledge() ? 0x81 : 0x00; // timer A
+    }
+    return cia1[addr & 0x0F];
+  }, [&](uint16_t addr, uint8_t value) { cia1[addr & 0x0F] = value; });
+  mem.mapIo(0xDD00, 0x100, [&](uint16_t addr) { return cia2[addr & 0x0F]; },
+            [&](uint16_t addr, uint8_t value) { cia2[addr & 0x0F] = value; });
+
+  // The 6510 port banks BASIC, KERNAL, CHARGEN and I/O in and out: bits 0-2
+  // of $01 (LORAM, HIRAM, CHAREN), bits set as inputs in $00 read as 1.
+  // Writes to banked in ROM go to the RAM below
+  mem.setPortHandler([&](uint16_t addr, uint8_t value) {
+    uint8_t lines = mem.peek(0x01) | ~mem.peek(0x00);
+    bool loram = lines & 0x01, hiram = lines & 0x02, charen = lines & 0x04;
+    if (loram and hiram) {
+      mem.mapRom(0xA000, basic.data(), 0x2000);
+    } else {
+      mem.mapRam(0xA000, 0x2000);
+    }
+    if (hiram) {
+      mem.mapRom(0xE000, kernal.data(), 0x2000);
+    } else {
+      mem.mapRam(0xE000, 0x2000);
+    }
+    if (not (loram or hiram)) {
+      mem.mapRam(0xD000, 0x1000);
+    } else if (charen) {
+      mem.mapIo(0xD000, 0x800);
+      mem.mapRam(0xD800, 0x400);
+      mem.mapIo(0xDC00, 0x200);
+      mem.mapRam(0xDE00, 0x200);
+    } else {
+      mem.mapRom(0xD000, chargen.data(), 0x1000);
+    }
+  });
+
+  mem.writeByte(0xDC01, 0xFF); // CIA 1 keyboard rows, no key pressed
+  sys.startJiffyTimer(ClockHz / JiffyHz);
   int printscr = 5;
+  auto next = std::chrono::steady_clock::now();
   while (1) {
-    cpu.clearInstructionCount();
-    cpu.run(10000);
-
-    mem.writeByte(0xD012, 0); // video scanning
+    bool idle = cpu.runCycles(ClockHz * SliceMs / 1000) == CPU::Idle;
 
     if (not Debug) {
       printscr--;
-      sys.printScreen(40, 25, 0x400, printscr == 0);
+      sys.printScreen(40, 25, 0x400, idle or printscr == 0);
       if (printscr == 0)
         printscr = 5;
     }
@@ -61,6 +129,12 @@ int main(int argc, char *argv[]) {
         return 0;
       }
     }
-    usleep(10000);
+    auto now = std::chrono::steady_clock::now();
+    next = std::max(next + std::chrono::milliseconds(SliceMs), now); // don't catch up after stalls
+    if (idle) { // polling the keyboard, a key ends the wait
+      sys.waitForKey(std::chrono::duration_cast<std::chrono::milliseconds>(next - now));
+    } else {
+      std::this_thread::sleep_until(next);
+    }
   }
 }
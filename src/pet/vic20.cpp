@@ -12,6 +12,10 @@
 
 #include <CPU.h>
 #include <pet/Hooks.h>
+#include <pet/Roms.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #ifdef Success
 #undef Success
@@ -19,20 +23,32 @@
 #endif
 
 
+const uint64_t ClockHz{1108405}; ///< PAL VIC-20
+const int JiffyHz{60};           ///< kernal timer interrupts per second
+const int SliceMs{10};           ///< machine time run between screen updates
+const int LineCycles{71};        ///< PAL VIC raster line
+const int RasterLines{312};
+
 int main(int argc, char *argv[]) {
   Memory mem;
   CPU cpu(mem);
   CLI::App app{"C64 Emulator"};
 
   bool Debug = false;
+  std::string kernalFile, basicFile, charsFile;
   app.add_flag("-d,--debug", Debug, "enable debug");
+  app.add_option("--kernal", kernalFile, "kernal ROM file (default built in)");
+  app.add_option("--basic", basicFile, "BASIC ROM file (default built in)");
+  app.add_option("--chars", charsFile, "character ROM file (default built in)");
   CLI11_PARSE(app, argc, argv);
   int ch;
 
-
-  mem.loadBinaryFile("src/pet/vic20/kernal.DKB_901486-07.bin", 0xE000);
-  mem.loadBinaryFile("src/pet/vic20/vic20basic.bin", 0xC000);
-  mem.loadBinaryFile("src/pet/vic20/characters.DK_901460-03.bin", 0x8000);
+  Rom kernal(vic20Kernal, kernalFile);
+  Rom basic(vic20Basic, basicFile);
+  Rom chars(vic20Chars, charsFile);
+  mem.mapRom(0x8000, chars.data(), 0x1000);
+  mem.mapRom(0xC000, basic.data(), 0x2000);
+  mem.mapRom(0xE000, kernal.data(), 0x2000);
   cpu.reset(0x0000);
 
   if (Debug)
@@ -40,16 +56,38 @@ int main(int argc, char *argv[]) {
   //cpu.setTraceAddr(config.traceAddr);
 
   Hooks sys(cpu, mem, 23,24, Debug);
+
+  // VIC and VIAs, the registers read back what was written except for the
+  // raster line and the VIA 2 timer 1 counter, reading it acknowledges the
+  // jiffy timer. The colour RAM is memory
+  uint8_t vic[16]{}, via[256]{};
+  mem.mapIo(0x9000, 0x100, [&](uint16_t addr) -> uint8_t {
+    int line = cpu.getCycleCount() / LineCycles % RasterLines;
+    switch (addr & 0x0F) {
+      case 0x03: return (vic[0x03] & 0x7F) | ((line & 1) << 7);
+      case 0x04: return line >> 1;
+      default:   return vic[addr & 0x0F];
+    }
+  }, [&](uint16_t addr, uint8_t value) { vic[addr & 0x0F] = value; });
+  mem.mapIo(0x9100, 0x100, [&](uint16_t addr) {
+    if (addr == 0x9124) {
+      sys.jiffyAcknowledge();
+    }
+    return via[addr & 0xFF];
+  }, [&](uint16_t addr, uint8_t value) { via[addr & 0xFF] = value; });
+
+  mem.writeByte(0x9121, 0xFF); // VIA 2 keyboard rows, no key pressed
+  sys.startJiffyTimer(ClockHz / JiffyHz);
   int printscr = 5;
+  auto next = std::chrono::steady_clock::now();
   while (1) {
-    cpu.clearInstructionCount();
-    cpu.run(10000);
+    bool idle = cpu.runCycles(ClockHz * SliceMs / 1000) == CPU::Idle;
 
 
 
     if (not Debug) {
       printscr--;
-      sys.printScreen(22, 23, 0x1000, printscr == 0);
+      sys.printScreen(22, 23, 0x1000, idle or printscr == 0);
       if (printscr == 0)
         printscr = 5;
     }
@@ -59,6 +97,12 @@ int main(int argc, char *argv[]) {
         return 0;
       }
     }
-    usleep(10000);
+    auto now = std::chrono::steady_clock::now();
+    next = std::max(next + std::chrono::milliseconds(SliceMs), now); // don't catch up after stalls
+    if (idle) { // polling the keyboard, a key ends the wait
+      sys.waitForKey(std::chrono::duration_cast<std::chrono::milliseconds>(next - now));
+    } else {
+      std::this_thread::sleep_until(next);
+    }
   }
 }
@@ -10,6 +10,7 @@
 //===----------------------------------------------------------------------===//
 
 #include <cstdio>
+#include <Batch.h>
 #include <Config.h>
 #include <CPU.h>
 #include <Memory.h>
@@ -19,15 +20,39 @@
 Memory mem;
 CPU cpu(mem);
 
+// Run until the program stops and tell why
+void runProgram() {
+  switch (cpu.run(-1)) {
+    case CPU::LoopDetected:
+      printf("loop detected (PC: %04X), exiting ...\n", cpu.PC);
+      break;
+    case CPU::IllegalOpcode:
+      printf("illegal opcode $%02X (PC: %04X), exiting ...\n",
+             mem.peek(cpu.PC - 1), cpu.PC - 1);
+      break;
+    case CPU::Breakpoint:
+      printf("<< BREAK >> (PC: %04X)\n", cpu.PC);
+      break;
+    case CPU::Watchpoint: {
+      auto & hit = cpu.getWatchHit();
+      printf("<< WATCH >> %s $%02X at $%04X (PC: %04X)\n",
+             hit.write ? "write" : "read", hit.value, hit.address, hit.pc);
+    }
+    break;
+    default:
+      break;
+  }
+}
+
 void prgFibonacci() {
     mem.loadSnippets(fibonacci32);
-    cpu.run(-1);
+    runProgram();
     mem.dump(0x0028,  4); // result: largst fib below 2^32
 }
 
 void prgSieve() {
     mem.loadSnippets(sieve);
-    cpu.run(-1);
+    runProgram();
     mem.dump(0x3000, 16); // Primes
     mem.dump(0x3010, 16);
     mem.dump(0x3020, 16);
@@ -35,12 +60,12 @@ void prgSieve() {
 
 void prgWeekday() {
   mem.loadSnippets(weekday);
-  cpu.run(-1);
+  runProgram();
 }
 
 void prgDiv32() {
   mem.loadSnippets(div32);
-  cpu.run(-1);
+  runProgram();
   mem.dump(0x0020, 2);
   mem.dump(0x0022, 4);
   mem.dump(0x0026, 1);
@@ -53,7 +78,7 @@ void functional() {
   mem.loadBinaryFile("test/data/6502_functional_test.bin", 0x0000);
   cpu.reset(0x400);
   cpu.setTraceAddr(0x3469);
-  cpu.run(-1);
+  runProgram();
 }
 
 void selectProgram(Sim6502::Config & cfg) {
@@ -89,26 +114,58 @@ int main(int argc, char * argv[])
   app.add_option("-a,--laddr", config.loadAddr, "strt loading at address");
   app.add_option("-b,--boot", config.bootAddr, "set CPU Program Counter");
   app.add_option("-t,--trace", config.traceAddr, "enable debug at this PC address");
+  app.add_option("--break", config.breakAddrs, "stop at these PC addresses");
+  app.add_option("--watch", config.watchAddrs, "stop on access to these addresses");
   app.add_option("-p,--program", config.programIndex, "choose program to run");
   app.add_flag("-d,--debug", config.debug, "enable debug");
+  app.add_flag("-j,--jit", config.jit, "translate 6502 code to native code (x86-64)");
+  app.add_flag("--pairs", config.pairStats, "print the most executed instruction pairs");
+  app.add_option("--batch", config.batchFile, "run the jobs in this file, results as JSON lines");
+  app.add_option("--threads", config.threads, "batch worker threads (default one per core)");
   CLI11_PARSE(app, argc, argv);
 
+  if (config.batchFile != "") {
+    Sim6502::Batch batch(config.batchFile, config.jit);
+    batch.run(config.threads, stdout);
+    return 0;
+  }
+
   mem.reset();
 
   if (config.debug) {
     cpu.debugOn();
   }
 
+  if (config.pairStats) {
+    cpu.pairStatsOn();
+  }
+
+  for (auto addr : config.breakAddrs) {
+    cpu.addBreakpoint(addr);
+  }
+
+  for (auto addr : config.watchAddrs) {
+    cpu.addWatchpoint(addr, Memory::Read | Memory::Write);
+  }
+
+  if (config.jit and not cpu.jitOn()) {
+    printf("JIT not supported on this platform, using the interpreter\n");
+  }
+
   if (config.filename != "") {
     mem.loadBinaryFile(config.filename, config.loadAddr);
     cpu.reset(config.bootAddr);
     cpu.setTraceAddr(config.traceAddr);
-    cpu.run(-1);
+    runProgram();
   } else {
     cpu.reset(0x1000);
     selectProgram(config);
   }
 
+  if (config.pairStats) {
+    cpu.printPairStats(20);
+  }
+
   //printf("CPU instructions: %llu\n", cpu.getInstructionCount());
   return 0;
 }
@@ -0,0 +1,162 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for batch mode (job lists, worker threads, results)
+///
+//===----------------------------------------------------------------------===//
+
+#include <gtest/gtest.h>
+#include <Batch.h>
+#include <Opcodes.h>
+#include <fstream>
+
+class BatchTest : public ::testing::Test {
+protected:
+  // Counts X down from 5, stores 0x42 at $10 and loops at $1009
+  void SetUp() {
+    std::vector<uint8_t> code{
+      LDXI,  0x05,
+      DEX,
+      BNE,   (256 - 3),
+      LDAI,  0x42,
+      STAZP, 0x10,
+      JMPA,  0x09, 0x10
+    };
+    write(program, std::string(code.begin(), code.end()));
+  }
+
+  void write(std::string fileName, std::string text) {
+    std::ofstream file(fileName, std::ios::binary);
+    file << text;
+  }
+
+  // The result lines of running the jobs
+  std::vector<std::string> run(std::string jobs, int threads, bool jit = false) {
+    write(jobFile, jobs);
+    Sim6502::Batch batch(jobFile, jit);
+    FILE * out = tmpfile();
+    batch.run(threads, out);
+    rewind(out);
+    std::vector<std::string> lines;
+    char line[1024];
+    while (fgets(line, sizeof(line), out)) {
+      lines.push_back(line);
+    }
+    fclose(out);
+    return lines;
+  }
+
+  // The value of key in a result line
+  std::string field(const std::string & line, const std::string & key) {
+    auto start = line.find("\"" + key + "\":") + key.size() + 3;
+    auto end = line.find_first_of(",}", start);
+    if (line[start] == '[') {
+      end = line.find(']', start) + 1;
+    }
+    return line.substr(start, end - start);
+  }
+
+  std::string program{testing::TempDir() + "batchtest.bin"};
+  std::string jobFile{testing::TempDir() + "batchtest.jobs"};
+};
+
+
+TEST_F(BatchTest, JobList) {
+  write(jobFile,
+        "# file load boot budget checks\n"
+        "\n" +
+        program + " 0x1000 0x1000 100 0x10=0x42  # comment\n" +
+        program + "   4096   4098  50c 16=66 0x11=0\n");
+  Sim6502::Batch batch(jobFile);
+  ASSERT_EQ(batch.size(), 2);
+  ASSERT_EQ(batch.job(0).loadAddr, 0x1000);
+  ASSERT_EQ(batch.job(0).bootAddr, 0x1000);
+  ASSERT_EQ(batch.job(0).budget, 100);
+  ASSERT_FALSE(batch.job(0).cycles);
+  ASSERT_EQ(batch.job(0).checks.size(), 1);
+  ASSERT_EQ(batch.job(1).bootAddr, 0x1002);
+  ASSERT_EQ(batch.job(1).budget, 50);
+  ASSERT_TRUE(batch.job(1).cycles);
+  ASSERT_EQ(batch.job(1).checks.size(), 2);
+  ASSERT_EQ(batch.job(1).checks[0].first, 0x10);
+  ASSERT_EQ(batch.job(1).checks[0].second, 66);
+  ASSERT_EQ(batch.job(0).image, batch.job(1).image); // loaded once
+  ASSERT_EQ(batch.job(0).image->size(), 12);
+}
+
+TEST_F(BatchTest, JobListErrors) {
+  for (auto job : {program + " 0x1000 0x1000",
+                   program + " 0x10000 0x1000 100",
+                   program + " 0x1000 0x1000 -1",
+                   program + " 0x1000 0x1000 99999999999999999999999",
+                   program + " 0x1000 0x1000 100c 0x10",
+                   program + " 0x1000 0x1000 100 0x10=0x100",
+                   program + " 0xFFF8 0x1000 100",
+                   program + "-missing 0x1000 0x1000 100"}) {
+    write(jobFile, job + "\n");
+    ASSERT_EXIT(Sim6502::Batch batch(jobFile), ::testing::ExitedWithCode(1), "");
+  }
+}
+
+// The largest budgets run until the program stops, also on a CPU that
+// has counted cycles before
+TEST_F(BatchTest, LargeBudget) {
+  auto lines = run(program + " 0x1000 0x1000 18446744073709551615\n" +
+                   program + " 0x1000 0x1000 18446744073709551615c\n", 1);
+  ASSERT_EQ(lines.size(), 2);
+  for (auto & line : lines) {
+    ASSERT_EQ(field(line, "stop"), "\"LoopDetected\"");
+    ASSERT_EQ(field(line, "instructions"), "14");
+  }
+}
+
+// The workers reuse their CPU and Memory, the results are the same as
+// with one worker and written in job order
+TEST_F(BatchTest, Results) {
+  std::string jobs;
+  for (int i = 0; i < 40; i++) {
+    switch (i % 4) {
+      case 0: jobs += program + " 0x1000 0x1000 100 0x10=0x42\n"; break;
+      case 1: jobs += program + " 0x1000 0x1000 100 0x10=0x42 0x11=0x43\n"; break;
+      case 2: jobs += program + " 0x1000 0x1000 5\n"; break;
+      case 3: jobs += program + " 0x1000 0x1000 20c\n"; break;
+    }
+  }
+  for (bool jit : {false, true}) {
+    auto one = run(jobs, 1, jit);
+    auto four = run(jobs, 4, jit);
+    ASSERT_EQ(one.size(), 40);
+    ASSERT_EQ(four.size(), 40);
+    for (int i = 0; i < 40; i++) {
+      auto & line = four[i];
+      ASSERT_EQ(field(line, "job"), std::to_string(i));
+      ASSERT_EQ(field(line, "file"), "\"" + program + "\"");
+      for (auto key : {"stop", "pc", "instructions", "cycles", "pass", "failed"}) {
+        ASSERT_EQ(field(line, key), field(one[i], key));
+      }
+    }
+    ASSERT_EQ(field(four[0], "stop"), "\"LoopDetected\"");
+    ASSERT_EQ(field(four[0], "pc"), "\"1009\"");
+    ASSERT_EQ(field(four[0], "instructions"), "14");
+    ASSERT_EQ(field(four[0], "pass"), "true");
+    ASSERT_EQ(field(four[0], "failed"), "[]");
+
+    ASSERT_EQ(field(four[1], "stop"), "\"LoopDetected\"");
+    ASSERT_EQ(field(four[1], "pass"), "false");
+    ASSERT_EQ(field(four[1], "failed"), "[{\"address\":\"0011\",\"expected\":\"43\",\"value\":\"00\"}]");
+
+    ASSERT_EQ(field(four[2], "stop"), "\"Budget\"");
+    ASSERT_EQ(field(four[2], "pc"), "\"1002\"");
+    ASSERT_EQ(field(four[2], "instructions"), "5");
+
+    ASSERT_EQ(field(four[3], "stop"), "\"Budget\"");
+    ASSERT_GE(std::stoi(field(four[3], "cycles")), 20);
+  }
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
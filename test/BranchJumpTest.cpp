@@ -31,6 +31,21 @@ TEST_F(BranchTest, JumpSubroutineStackFull) {
   ASSERT_EQ(cpu->PC, 0x2000);
 }
 
+// The return address is pushed and pulled byte by byte, wrapping within
+// the stack page
+TEST_F(BranchTest, JumpSubroutineStackWrap) {
+  mem.writeByte(0x2000, RTS);
+  cpu->S = 0;
+  exec3opcmd(JSR, 0x00, 0x20);
+  ASSERT_EQ(cpu->S, 0xFE);
+  ASSERT_EQ(mem.readByte(0x100), 0x10);
+  ASSERT_EQ(mem.readByte(0x1FF), 0x02);
+  ASSERT_EQ(mem.readByte(0xFF), 0xFF);     // not written
+  cpu->handleInstruction(cpu->getInstruction());
+  ASSERT_EQ(cpu->S, 0x00);
+  ASSERT_EQ(cpu->PC, 0x1003);
+}
+
 TEST_F(BranchTest, JumpSubroutine) {
   //cpu->debugOn();
   mem.writeByte(0x2000, RTS);
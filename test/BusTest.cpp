@@ -0,0 +1,357 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for ROM, I/O, banked pages and file loading
+///
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <Opcodes.h>
+#include <FileImage.h>
+
+class BusTest: public TestBase {
+protected:
+  void load(uint16_t address, std::vector<uint8_t> code) {
+    for (auto byte : code) {
+      mem.writeByte(address++, byte);
+    }
+  }
+
+  // Device at $C000-$C0FF counting the accesses, reads return the low
+  // byte of the address
+  void mapDevice() {
+    mem.mapIo(0xC000, 0x100, [this](uint16_t addr) -> uint8_t {
+      reads++;
+      return addr & 0xFF;
+    }, [this](uint16_t addr, uint8_t value) {
+      writes.push_back({addr, value});
+    });
+  }
+
+  int reads{0};
+  std::vector<std::pair<uint16_t, uint8_t>> writes;
+};
+
+
+TEST_F(BusTest, Rom) {
+  mem.writeByteRaw(0xE000, 0x12);
+  mem.mapRom(0xE000, 0x2000);
+  mem.writeByte(0xE000, 0x34);
+  mem.writeWord(0xE001, 0x5678);
+  ASSERT_EQ(mem.readByte(0xE000), 0x12);
+  ASSERT_EQ(mem.readWord(0xE001), 0x0000);
+  mem.writeByteRaw(0xE001, 0x9A); // loading
+  ASSERT_EQ(mem.readByte(0xE001), 0x9A);
+
+  mem.mapRam(0xE000, 0x2000);
+  mem.writeByte(0xE000, 0x34);
+  ASSERT_EQ(mem.readByte(0xE000), 0x34);
+}
+
+// Stores to ROM are ignored, also with the JIT and in fill loops
+TEST_F(BusTest, RomStores) {
+  for (bool jit : {false, true}) {
+    load(0x1000, {
+      LDAI,  0x42,
+      STAA,  0x00, 0xE0,
+      LDXI,  0x00,
+      STAAX, 0x00, 0xE1, // loop
+      INX,
+      BNE,   (256 - 6),  // to STAAX
+      JMPA,  0x0D, 0x10
+    });
+    mem.mapRom(0xE000, 0x2000);
+    cpu->reset(0x1000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    ASSERT_EQ(cpu->run(2000), CPU::LoopDetected);
+    ASSERT_EQ(mem.readByte(0xE000), 0x00);
+    ASSERT_EQ(mem.readByte(0xE180), 0x00);
+    mem.mapRam(0xE000, 0x2000);
+  }
+}
+
+TEST_F(BusTest, Io) {
+  mapDevice();
+  mem.writeByte(0xC010, 0x55);
+  ASSERT_EQ(writes.size(), 1);
+  ASSERT_EQ(writes[0].first, 0xC010);
+  ASSERT_EQ(writes[0].second, 0x55);
+  ASSERT_EQ(mem.readByte(0xC023), 0x23);
+  ASSERT_EQ(mem.readWord(0xC0FF), 0x00FF); // $C100 is memory
+  ASSERT_EQ(reads, 2);
+  ASSERT_EQ(mem.peek(0xC023), 0x00);       // the memory below
+  ASSERT_EQ(reads, 2);
+  ASSERT_TRUE(mem.isIo(0xC0FF));
+  ASSERT_FALSE(mem.isIo(0xC100));
+}
+
+// Loads and stores of the interpreter, the JIT and the loops call the
+// device for every access
+TEST_F(BusTest, IoInstructions) {
+  mapDevice();
+  for (bool jit : {false, true}) {
+    load(0x1000, {
+      LDAA,  0x10, 0xC0,
+      STAA,  0x20, 0xC0,
+      LDXI,  0x00,
+      LDAAX, 0x00, 0xC0, // loop
+      STAAX, 0x00, 0x30,
+      INX,
+      CPXI,  0x10,
+      BNE,   (256 - 11), // to LDAAX
+      JMPA,  0x13, 0x10
+    });
+    reads = 0;
+    writes.clear();
+    cpu->reset(0x1000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    ASSERT_EQ(cpu->run(2000), CPU::LoopDetected);
+    ASSERT_EQ(reads, 17);
+    ASSERT_EQ(writes.size(), 1);
+    ASSERT_EQ(writes[0].first, 0xC020);
+    ASSERT_EQ(writes[0].second, 0x10);
+    ASSERT_EQ(mem.readByte(0x300F), 0x0F);
+  }
+}
+
+// Polling an I/O register is not an idle loop, the device changes without
+// events
+TEST_F(BusTest, IoPolling) {
+  mem.mapIo(0xC000, 0x100, [this](uint16_t addr) -> uint8_t {
+    return cpu->getCycleCount() >= 50000;
+  }, [](uint16_t addr, uint8_t value) { });
+  load(0x1000, {
+    LDAA,  0x00, 0xC0, // 4
+    BEQ,   (256 - 5),  // 3, to LDAA
+    JMPA,  0x05, 0x10
+  });
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->runCycles(100000), CPU::LoopDetected);
+  ASSERT_LT(cpu->getCycleCount(), 50000 + 3 * MaxCycles);
+}
+
+// Reading the device's interrupt register releases the IRQ line
+TEST_F(BusTest, IrqAcknowledge) {
+  bool active = false;
+  mem.mapIo(0xDC00, 0x100, [&](uint16_t addr) -> uint8_t {
+    uint8_t flags = active ? 0x81 : 0x00;
+    active = false;
+    cpu->setIRQ(false);
+    return flags;
+  }, [](uint16_t addr, uint8_t value) { });
+  load(0x3000, { INY, LDAA, 0x0D, 0xDC, STAZP, 0x40, RTI });
+  load(0xFFFE, { 0x00, 0x30 });
+  load(0x1000, {
+    INX,
+    JMPA,  0x00, 0x10
+  });
+  cpu->PC = 0x1000;
+  cpu->Status.bits.I = 0;
+  cpu->schedule(100, [&](uint64_t cycle) {
+    active = true;
+    cpu->setIRQ(true);
+  });
+  cpu->run(1000);
+  ASSERT_EQ(cpu->Y, 1);
+  ASSERT_EQ(cpu->getInterruptCount(), 1);
+  ASSERT_EQ(mem.readByte(0x40), 0x81);
+}
+
+// ROM images are read in place, writes go to the RAM below
+TEST_F(BusTest, RomImage) {
+  std::vector<uint8_t> rom(0x2000, 0x11);
+  mem.mapRom(0xE000, rom.data(), 0x2000);
+  ASSERT_EQ(mem.readByte(0xE123), 0x11);
+  ASSERT_EQ(mem.peek(0xFFFF), 0x11);
+  mem.writeByte(0xE123, 0x22);
+  ASSERT_EQ(mem.readByte(0xE123), 0x11);
+  ASSERT_EQ(rom[0x123], 0x11);
+  mem.mapRam(0xE000, 0x2000);
+  ASSERT_EQ(mem.readByte(0xE123), 0x22);
+  ASSERT_EQ(mem.peek(0xFFFF), 0x00);
+}
+
+// Code in banked pages is decoded again after a switch, also with the JIT
+TEST_F(BusTest, BankedCode) {
+  std::vector<uint8_t> rom{ LDAI, 0x01, JMPA, 0x02, 0xE0 };
+  rom.resize(0x100);
+  for (bool jit : {false, true}) {
+    load(0xE000, { LDAI, 0x02, JMPA, 0x02, 0xE0 }); // RAM below
+    mem.mapRom(0xE000, rom.data(), 0x100);
+    cpu->reset(0xE000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    ASSERT_EQ(cpu->run(10), CPU::LoopDetected);
+    ASSERT_EQ(cpu->A, 0x01);
+    mem.mapRam(0xE000, 0x100);
+    cpu->PC = 0xE000;
+    ASSERT_EQ(cpu->run(10), CPU::LoopDetected);
+    ASSERT_EQ(cpu->A, 0x02);
+  }
+}
+
+// Writes to $00 and $01 call the port handler, here switching the ROM at
+// $E000 in and out. The charset copy loop reads the ROM image at once
+TEST_F(BusTest, Port) {
+  std::vector<uint8_t> rom(0x2000);
+  for (int i = 0; i < 0x2000; i++) {
+    rom[i] = i * 7;
+  }
+  std::vector<std::pair<uint16_t, uint8_t>> ports;
+  mem.setPortHandler([&](uint16_t addr, uint8_t value) {
+    ports.push_back({addr, value});
+    if (mem.peek(0x01) & 0x02) {
+      mem.mapRom(0xE000, rom.data(), 0x2000);
+    } else {
+      mem.mapRam(0xE000, 0x2000);
+    }
+  });
+  for (bool jit : {false, true}) {
+    load(0x1000, {
+      LDAI,  0x02,
+      STAZP, 0x01,       // ROM in
+      LDXI,  0x00,
+      LDAAX, 0x00, 0xE1, // loop
+      STAAX, 0x00, 0x30,
+      INX,
+      BNE,   (256 - 9),  // to LDAAX
+      LDAI,  0x00,
+      STAZP, 0x01,       // ROM out
+      LDAA,  0x00, 0xE1,
+      JMPA,  0x16, 0x10
+    });
+    ports.clear();
+    mem.writeByte(0xE100, 0x99); // RAM below
+    cpu->reset(0x1000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    ASSERT_EQ(cpu->run(2000), CPU::LoopDetected);
+    ASSERT_EQ(ports.size(), 2);
+    ASSERT_EQ(ports[0].first, 0x01);
+    ASSERT_EQ(ports[0].second, 0x02);
+    ASSERT_EQ(mem.readByte(0x01), 0x00);
+    ASSERT_EQ(cpu->A, 0x99);
+    for (int i = 0; i < 256; i++) {
+      ASSERT_EQ(mem.readByte(0x3000 + i), rom[0x100 + i]);
+    }
+    ASSERT_TRUE(cpu->isLoop(0x1006));
+  }
+}
+
+// Zero page and stack accesses skip the page table, only $00 and $01 call
+// the port handler, also for wrapped indexed addresses and with the JIT
+TEST_F(BusTest, ZeroPagePort) {
+  std::vector<std::pair<uint16_t, uint8_t>> ports;
+  mem.setPortHandler([&](uint16_t addr, uint8_t value) {
+    ports.push_back({addr, value});
+  });
+  for (bool jit : {false, true}) {
+    load(0x1000, {
+      LDAI,   0x07,
+      STAZP,  0x02,
+      LDXI,   0x01,
+      STAZX,  0xFF,       // $00
+      STAZX,  0x80,
+      INCZP,  0x81,
+      PHA,
+      JMPA,   0x0D, 0x10
+    });
+    ports.clear();
+    cpu->reset(0x1000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    ASSERT_EQ(cpu->run(20), CPU::LoopDetected);
+    ASSERT_EQ(ports.size(), 1);
+    ASSERT_EQ(ports[0].first, 0x00);
+    ASSERT_EQ(ports[0].second, 0x07);
+    ASSERT_EQ(mem.peek(0x00), 0x07);
+    ASSERT_EQ(mem.peek(0x02), 0x07);
+    ASSERT_EQ(mem.peek(0x81), 0x08);
+    ASSERT_EQ(mem.peek(0x100 | uint8_t(cpu->S + 1)), 0x07);
+  }
+}
+
+// With only RAM mapped the handlers read it directly, mapping ROM images,
+// I/O or watch points switches to reading through the page pointers
+TEST_F(BusTest, FlatReads) {
+  std::vector<uint8_t> rom(0x100, 0x11);
+  for (bool jit : {false, true}) {
+    load(0x1000, {
+      LDAA,  0x00, 0xE0,
+      JMPA,  0x03, 0x10
+    });
+    mem.writeByte(0xE000, 0x22);
+    ASSERT_TRUE(mem.isFlat());
+    cpu->reset(0x1000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    ASSERT_EQ(cpu->run(10), CPU::LoopDetected);
+    ASSERT_EQ(cpu->A, 0x22);
+
+    mem.mapRom(0xE000, 0x100); // in place
+    ASSERT_TRUE(mem.isFlat());
+    mem.mapRom(0xE000, rom.data(), 0x100);
+    ASSERT_FALSE(mem.isFlat());
+    cpu->PC = 0x1000;
+    ASSERT_EQ(cpu->run(10), CPU::LoopDetected);
+    ASSERT_EQ(cpu->A, 0x11);
+
+    mem.mapRam(0xE000, 0x100);
+    ASSERT_TRUE(mem.isFlat());
+    cpu->addWatchpoint(0xE000, Memory::Read);
+    ASSERT_FALSE(mem.isFlat());
+    cpu->clearWatchpoints();
+    ASSERT_TRUE(mem.isFlat());
+    cpu->PC = 0x1000;
+    ASSERT_EQ(cpu->run(10), CPU::LoopDetected);
+    ASSERT_EQ(cpu->A, 0x22);
+  }
+  mem.setPortHandler([](uint16_t addr, uint8_t value) { });
+  ASSERT_FALSE(mem.isFlat());
+}
+
+// Binary files are copied in place at once, and must fit below $10000
+TEST_F(BusTest, LoadBinaryFile) {
+  FileImage image("test/data/6502_functional_test.bin");
+  ASSERT_EQ(image.size(), 65536);
+  mem.loadBinaryFile("test/data/6502_functional_test.bin", 0x0000);
+  ASSERT_EQ(memcmp(mem.mem, image.data(), 65536), 0);
+  ASSERT_EXIT(mem.loadBinaryFile("test/data/6502_functional_test.bin", 0x0001),
+              ::testing::ExitedWithCode(1), "");
+
+  FileImage chars("src/pet/c64/c64_chars.bin");
+  mem.loadBinaryFile("src/pet/c64/c64_chars.bin", 0xF000);
+  ASSERT_EQ(memcmp(mem.mem + 0xF000, chars.data(), 0x1000), 0);
+}
+
+// Images shorter than the requested size are zero padded
+TEST_F(BusTest, FileImagePadding) {
+  FileImage chars("src/pet/c64/c64_chars.bin");
+  FileImage padded("src/pet/c64/c64_chars.bin", 0x2000);
+  ASSERT_EQ(chars.size(), 0x1000);
+  ASSERT_EQ(padded.size(), 0x2000);
+  ASSERT_EQ(memcmp(padded.data(), chars.data(), 0x1000), 0);
+  for (int i = 0x1000; i < 0x2000; i++) {
+    ASSERT_EQ(padded.data()[i], 0);
+  }
+  mem.mapRom(0xE000, padded.data(), 0x2000);
+  ASSERT_EQ(mem.readByte(0xE000 + 0x123), chars.data()[0x123]);
+  ASSERT_EQ(mem.readByte(0xFFFF), 0);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
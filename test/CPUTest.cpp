@@ -10,6 +10,7 @@
 #include <TestBase.h>
 #include <Memory.h>
 #include <CPU.h>
+#include <Opcodes.h>
 
 class CPUTest: public TestBase {};
 
@@ -209,6 +210,146 @@ TEST_F(CPUTest, ShiftsROL) {
   ASSERT_EQ(cpu->Status.bits.C, 1);
 }
 
+// Flags pulled with PLP are pushed unchanged by PHP, also when Z and N
+// are both set
+TEST_F(CPUTest, StatusPullPush) {
+  for (int val = 0; val < 256; val++) {
+    load({LDAI, uint8_t(val), PHA, PLP, PHP, PLA});
+    cpu->reset(0x1000);
+    cpu->run(5);
+    ASSERT_EQ(cpu->A, val | 0x30);
+    ASSERT_EQ(cpu->Status.mask, val & ~0x02); // Z cleared by PLA
+  }
+}
+
+TEST_F(CPUTest, BreakpointAddr) {
+  load({LDXI, 0x03, DEX, BNE, (256 - 3), NOP, NOP});
+  cpu->reset(0x1000);
+  cpu->addBreakpoint(0x1005);
+  ASSERT_EQ(cpu->run(100), CPU::Breakpoint);
+  ASSERT_EQ(cpu->PC, 0x1005);
+  ASSERT_EQ(cpu->getInstructionCount(), 7);
+}
+
+TEST_F(CPUTest, BreakpointRegs) {
+  load({LDXI, 0x03, DEX, BNE, (256 - 3), NOP, NOP});
+  cpu->reset(0x1000);
+  cpu->setBreakpointRegs(0x00, 0x01, 0x00);
+  ASSERT_EQ(cpu->run(100), CPU::Breakpoint);
+  ASSERT_EQ(cpu->X, 0x01);
+  ASSERT_EQ(cpu->PC, 0x1003);
+  ASSERT_EQ(cpu->getInstructionCount(), 4);
+}
+
+// run() counts from the current instruction count, no reset needed
+TEST_F(CPUTest, StopBudget) {
+  load({LDXI, 0x00, INX, JMPA, 0x02, 0x10});
+  cpu->reset(0x1000);
+  ASSERT_EQ(cpu->run(5), CPU::Budget);
+  ASSERT_EQ(cpu->X, 2);
+  ASSERT_EQ(cpu->run(4), CPU::Budget);
+  ASSERT_EQ(cpu->X, 4);
+  ASSERT_EQ(cpu->getInstructionCount(), 9);
+}
+
+TEST_F(CPUTest, StopLoopDetected) {
+  load({LDXI, 0x00, BEQ, (256 - 2), JMPA, 0x04, 0x10});
+  cpu->reset(0x1000);
+  ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+  ASSERT_EQ(cpu->PC, 0x1002);
+  ASSERT_EQ(cpu->getInstructionCount(), 2);
+
+  cpu->reset(0x1004);
+  ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+  ASSERT_EQ(cpu->PC, 0x1004);
+  ASSERT_EQ(cpu->getInstructionCount(), 3);
+}
+
+TEST_F(CPUTest, StopIllegalOpcode) {
+  load({LDXI, 0x00, INX, 0x02, INX});
+  cpu->reset(0x1000);
+  ASSERT_EQ(cpu->run(100), CPU::IllegalOpcode);
+  ASSERT_EQ(cpu->PC, 0x1004);
+  ASSERT_EQ(cpu->X, 1);
+
+  ASSERT_EQ(cpu->run(1), CPU::Budget); // can continue after the opcode
+  ASSERT_EQ(cpu->X, 2);
+}
+
+// Break points inside a fused DEX; BNE and at the loop start
+TEST_F(CPUTest, BreakpointFused) {
+  load({LDXI, 0x03, DEX, BNE, (256 - 3), NOP, NOP});
+  cpu->reset(0x1000);
+  cpu->run(3); // DEX; BNE decoded as a group
+  cpu->addBreakpoint(0x1003);
+  cpu->addBreakpoint(0x1006);
+  ASSERT_EQ(cpu->run(100), CPU::Breakpoint);
+  ASSERT_EQ(cpu->PC, 0x1003);
+  ASSERT_EQ(cpu->X, 1);
+
+  cpu->removeBreakpoint(0x1003);
+  ASSERT_EQ(cpu->run(100), CPU::Breakpoint);
+  ASSERT_EQ(cpu->PC, 0x1006);
+  ASSERT_EQ(cpu->getInstructionCount(), 8);
+}
+
+// Address break point with a register condition, unset registers match
+TEST_F(CPUTest, BreakpointCondition) {
+  load({LDXI, 0x03, DEX, BNE, (256 - 3), NOP, NOP});
+  cpu->reset(0x1000);
+  cpu->addBreakpoint(0x1002);
+  cpu->setBreakpointRegs(CPU::AnyValue, 0x01, CPU::AnyValue);
+  ASSERT_EQ(cpu->run(100), CPU::Breakpoint);
+  ASSERT_EQ(cpu->PC, 0x1002);
+  ASSERT_EQ(cpu->X, 1);
+  ASSERT_EQ(cpu->getInstructionCount(), 5);
+
+  cpu->clearBreakpoints();
+  ASSERT_EQ(cpu->run(3), CPU::Budget);
+  ASSERT_EQ(cpu->PC, 0x1006);
+}
+
+// Data accesses stop after the instruction, operand fetches don't
+TEST_F(CPUTest, WatchpointRead) {
+  load({LDAI, 0x20, LDXA, 0x01, 0x10, INX, LDYA, 0x40, 0x20, NOP});
+  cpu->reset(0x1000);
+  cpu->jitOn();
+  cpu->addWatchpoint(0x1001, Memory::Read); // operand of LDAI
+  cpu->addWatchpoint(0x2040, Memory::Read);
+  cpu->addWatchpoint(0x2041, Memory::Read); // same page, not accessed
+  ASSERT_EQ(cpu->run(100), CPU::Watchpoint);
+  ASSERT_EQ(cpu->PC, 0x1005);
+  ASSERT_EQ(cpu->getWatchHit().address, 0x1001);
+  ASSERT_EQ(cpu->getWatchHit().value, 0x20);
+  ASSERT_EQ(cpu->getWatchHit().write, false);
+  ASSERT_EQ(cpu->getWatchHit().pc, 0x1002);
+
+  ASSERT_EQ(cpu->run(100), CPU::Watchpoint);
+  ASSERT_EQ(cpu->PC, 0x1009);
+  ASSERT_EQ(cpu->getWatchHit().address, 0x2040);
+  ASSERT_EQ(cpu->getWatchHit().value, 0x40);
+  ASSERT_EQ(cpu->getWatchHit().pc, 0x1006);
+  ASSERT_EQ(cpu->getInstructionCount(), 4);
+}
+
+TEST_F(CPUTest, WatchpointWrite) {
+  load({LDXI, 0x03, STXZP, 0x80, DEX, BNE, (256 - 5), NOP});
+  cpu->reset(0x1000);
+  cpu->addWatchpoint(0x0080, Memory::Read | Memory::Write);
+  ASSERT_EQ(cpu->run(100), CPU::Watchpoint);
+  ASSERT_EQ(cpu->getWatchHit().value, 0x03);
+  ASSERT_EQ(cpu->getWatchHit().write, true);
+  ASSERT_EQ(cpu->getWatchHit().pc, 0x1002);
+
+  cpu->removeWatchpoint(0x0080, Memory::Write);
+  ASSERT_EQ(cpu->run(9), CPU::Budget);
+  ASSERT_EQ(cpu->PC, 0x1008);
+  ASSERT_EQ(mem.peek(0x0080), 0x01);
+
+  cpu->clearWatchpoints();
+  ASSERT_FALSE(mem.hasWatches());
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
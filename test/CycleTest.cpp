@@ -0,0 +1,140 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for cycle counting
+///
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <Opcodes.h>
+
+class CycleTest: public TestBase {
+protected:
+  void load(uint16_t address, std::vector<uint8_t> code) {
+    for (auto byte : code) {
+      mem.writeByte(address++, byte);
+    }
+  }
+};
+
+
+TEST_F(CycleTest, BaseCycles) {
+  load(0x1000, {
+    LDAI,  0x01,       // 2
+    STAA,  0x00, 0x30, // 4
+    LDXI,  0x02,       // 2
+    INX,               // 2
+    NOP,               // 2
+    JMPA,  0x00, 0x20  // 3
+  });
+  cpu->PC = 0x1000;
+  cpu->run(6);
+  ASSERT_EQ(cpu->getCycleCount(), 15);
+}
+
+// Indexed reads crossing a page take one cycle more, writes do not
+TEST_F(CycleTest, PageCrossing) {
+  load(0x1000, {
+    LDXI,    0x10,       // 2
+    LDAAX,   0xF0, 0x20, // 4 + 1, $2100
+    LDAAX,   0x00, 0x20, // 4
+    STAAX,   0xF0, 0x20, // 5
+    LDYI,    0xF0,       // 2
+    LDAIDIX, 0x10,       // 5 + 1, ($10) = $1110, $1200
+    LDYI,    0x01,       // 2
+    CMPIDIX, 0x10        // 5, $1111
+  });
+  cpu->PC = 0x1000;
+  cpu->run(8);
+  ASSERT_EQ(cpu->getCycleCount(), 2 + 5 + 4 + 5 + 2 + 6 + 2 + 5);
+}
+
+// Taken branches take one cycle more, two if the target is on another page
+TEST_F(CycleTest, Branches) {
+  load(0x1000, {
+    LDXI,  0x00,       // 2
+    BNE,   0x10,       // 2, not taken
+    BEQ,   0x00,       // 3, taken
+    JMPA,  0xFC, 0x10  // 3
+  });
+  load(0x10FC, {
+    BEQ,   0x10        // 4, taken to $110E
+  });
+  cpu->PC = 0x1000;
+  cpu->run(5);
+  ASSERT_EQ(cpu->PC, 0x110E);
+  ASSERT_EQ(cpu->getCycleCount(), 2 + 2 + 3 + 3 + 4);
+}
+
+// Stops at the first instruction boundary at or after the cycle budget
+TEST_F(CycleTest, RunCycles) {
+  load(0x1000, {
+    LDXI,  0x00,       // 2
+    DEX,               // 2
+    BNE,   (256 - 3),  // 3, to DEX
+  });
+  cpu->PC = 0x1000;
+  cpu->runCycles(100);
+  ASSERT_EQ(cpu->getCycleCount(), 102);
+  ASSERT_EQ(cpu->getInstructionCount(), 41);
+
+  cpu->runCycles(10);
+  ASSERT_EQ(cpu->getCycleCount(), 112);
+  ASSERT_EQ(cpu->getInstructionCount(), 45);
+}
+
+// Polling loops writing only values memory already holds are skipped
+TEST_F(CycleTest, IdleLoop) {
+  load(0x1000, {
+    LDAZP, 0x00,       // 3, (like the kernal waiting on $C6)
+    STAZP, 0x40,       // 3
+    BEQ,   (256 - 6),  // 3, to LDAZP
+    JMPA,  0x06, 0x10  // loops on itself
+  });
+  mem.writeByte(0x40, 0x00);
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->runCycles(90), CPU::Budget); // first pass sets A and flags
+  ASSERT_EQ(cpu->runCycles(9000), CPU::Idle);
+  ASSERT_EQ(cpu->getCycleCount(), 9090);
+  ASSERT_EQ(cpu->getInstructionCount(), 3030);
+  ASSERT_EQ(cpu->PC, 0x1000);
+
+  mem.writeByte(0x00, 0x01);
+  ASSERT_EQ(cpu->runCycles(9000), CPU::LoopDetected);
+  ASSERT_EQ(cpu->PC, 0x1006);
+}
+
+// A jump to itself stops the idle loop probe, counted once like run()
+TEST_F(CycleTest, IdleProbeLoopDetected) {
+  load(0x1000, {
+    JMPA,  0x00, 0x10  // 3
+  });
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->runCycles(1000), CPU::LoopDetected);
+  ASSERT_EQ(cpu->PC, 0x1000);
+  ASSERT_EQ(cpu->getInstructionCount(), 1);
+  ASSERT_EQ(cpu->getCycleCount(), 3);
+}
+
+// Loops changing memory or registers are run
+TEST_F(CycleTest, NotIdle) {
+  load(0x1000, {
+    INCZP, 0x40,       // 5
+    LDAZP, 0x00,       // 3
+    BEQ,   (256 - 6),  // 3, to INCZP
+  });
+  mem.writeByte(0x40, 0x00);
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->runCycles(1100), CPU::Budget);
+  ASSERT_EQ(cpu->getCycleCount(), 1100);
+  ASSERT_EQ(mem.readByte(0x40), 100);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
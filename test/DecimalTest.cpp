@@ -0,0 +1,94 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for decimal mode ADC and SBC
+///
+/// All (C, A, M) are checked: the tables against DecimalALU::add() and
+/// subtract(), and the instructions against them
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <DecimalALU.h>
+#include <Opcodes.h>
+
+class DecimalTest: public TestBase {
+protected:
+  // Run ADC # or SBC # for all (C, A, M) in decimal mode, returns the
+  // number of results differing from DecimalALU
+  int mismatches(Variant v, uint8_t opcode) {
+    delete cpu;
+    cpu = new CPU(mem, v);
+    cpu->reset(0x1000);
+    mem.writeByte(0x1000, opcode);
+    int count = 0;
+    for (int i = 0; i < 2 * 256 * 256; i++) {
+      uint8_t c = i >> 16, a = i >> 8, m = i;
+      DecimalALU::Result r = (opcode == ADCI) ? DecimalALU::add(a, m, c) :
+                                                DecimalALU::subtract(a, m, c);
+      uint8_t z = (v == CMOS65C02) ? DecimalALU::value(r) : DecimalALU::resultZ(r);
+      uint8_t n = (v == CMOS65C02) ? DecimalALU::value(r) : DecimalALU::resultN(r);
+      mem.writeByte(0x1001, m);
+      cpu->PC = 0x1000;
+      cpu->A = a;
+      cpu->Status.mask = 0x08 | c;
+      cpu->handleInstruction(opcode);
+      count += (cpu->A != DecimalALU::value(r)) or
+               (cpu->Status.bits.C != DecimalALU::carry(r)) or
+               (cpu->Status.bits.O != DecimalALU::overflow(r)) or
+               (cpu->Status.bits.Z != (z == 0)) or
+               (cpu->Status.bits.N != (n >> 7));
+    }
+    return count;
+  }
+};
+
+
+TEST_F(DecimalTest, Reference) {
+  auto r = DecimalALU::add(0x99, 0x01, 0);
+  ASSERT_EQ(DecimalALU::value(r), 0x00);
+  ASSERT_EQ(DecimalALU::carry(r), 1);
+  ASSERT_EQ(DecimalALU::resultZ(r), 0x9A); // NMOS Z from the binary sum
+  r = DecimalALU::add(0x58, 0x46, 1);
+  ASSERT_EQ(DecimalALU::value(r), 0x05);
+  ASSERT_EQ(DecimalALU::carry(r), 1);
+  r = DecimalALU::add(0x12, 0x34, 0);
+  ASSERT_EQ(DecimalALU::value(r), 0x46);
+  ASSERT_EQ(DecimalALU::carry(r), 0);
+  r = DecimalALU::subtract(0x46, 0x12, 1);
+  ASSERT_EQ(DecimalALU::value(r), 0x34);
+  ASSERT_EQ(DecimalALU::carry(r), 1);
+  r = DecimalALU::subtract(0x40, 0x13, 1);
+  ASSERT_EQ(DecimalALU::value(r), 0x27);
+  r = DecimalALU::subtract(0x32, 0x02, 0);
+  ASSERT_EQ(DecimalALU::value(r), 0x29);
+  r = DecimalALU::subtract(0x12, 0x21, 1);
+  ASSERT_EQ(DecimalALU::value(r), 0x91);
+  ASSERT_EQ(DecimalALU::carry(r), 0);
+}
+
+TEST_F(DecimalTest, Tables) {
+  auto & alu = DecimalALU::get();
+  int count = 0;
+  for (int i = 0; i < 2 * 256 * 256; i++) {
+    uint8_t c = i >> 16, a = i >> 8, m = i;
+    count += (alu.adc(a, m, c) != DecimalALU::add(a, m, c)) or
+             (alu.sbc(a, m, c) != DecimalALU::subtract(a, m, c));
+  }
+  ASSERT_EQ(count, 0);
+}
+
+TEST_F(DecimalTest, Instructions) {
+  ASSERT_EQ(mismatches(NMOS6502, ADCI), 0);
+  ASSERT_EQ(mismatches(NMOS6502, SBCI), 0);
+  ASSERT_EQ(mismatches(CMOS65C02, ADCI), 0);
+  ASSERT_EQ(mismatches(CMOS65C02, SBCI), 0);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,142 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for the decode cache and self-modifying code
+///
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <Opcodes.h>
+
+class DecodeTest: public TestBase {
+protected:
+  void load(uint16_t address, std::vector<uint8_t> code) {
+    for (auto byte : code) {
+      mem.writeByte(address++, byte);
+    }
+  }
+};
+
+
+// Program patches the operand of an instruction it has already executed
+TEST_F(DecodeTest, SelfModifyingOperand) {
+  load(0x1000, {
+    LDXI,  0x00,       // patched to LDX #$2A
+    CPXI,  0x2A,
+    BEQ,   0x08,       // to done
+    LDAI,  0x2A,
+    STAA,  0x01, 0x10, // patch operand of LDX
+    JMPA,  0x00, 0x10,
+    JMPA,  0x0E, 0x10  // done
+  });
+  cpu->PC = 0x1000;
+  cpu->run(100);
+  ASSERT_EQ(cpu->X, 0x2A);
+  ASSERT_EQ(cpu->PC, 0x100E);
+  ASSERT_EQ(cpu->getInstructionCount(), 10);
+}
+
+// Program replaces an instruction it has already executed
+TEST_F(DecodeTest, SelfModifyingOpcode) {
+  load(0x1000, {
+    INX,               // patched to INY
+    LDAI,  INY,
+    STAA,  0x00, 0x10,
+    CPYI,  0x01,
+    BNE,   (256 - 10), // to INX/INY
+    NOP
+  });
+  cpu->PC = 0x1000;
+  cpu->run(10);
+  ASSERT_EQ(cpu->X, 1);
+  ASSERT_EQ(cpu->Y, 1);
+  ASSERT_EQ(cpu->PC, 0x100A);
+}
+
+// Memory written between runs (e.g. by a program loader)
+TEST_F(DecodeTest, ExternalWrite) {
+  load(0x1000, {LDAI, 0x01, NOP});
+  cpu->PC = 0x1000;
+  cpu->run(2);
+  ASSERT_EQ(cpu->A, 0x01);
+
+  mem.writeByte(0x1001, 0x02);
+  cpu->PC = 0x1000;
+  cpu->run(2);
+  ASSERT_EQ(cpu->A, 0x02);
+
+  mem.writeWord(0x1000, LDXI + 0x0300);
+  cpu->PC = 0x1000;
+  cpu->run(2);
+  ASSERT_EQ(cpu->X, 0x03);
+}
+
+// Instruction whose operand is in the next page
+TEST_F(DecodeTest, PageCrossingInstruction) {
+  load(0x10FE, {LDAI, 0x01, NOP});
+  cpu->PC = 0x10FE;
+  cpu->run(2);
+  ASSERT_EQ(cpu->A, 0x01);
+
+  mem.writeByte(0x10FF, 0x05);
+  cpu->PC = 0x10FE;
+  cpu->run(2);
+  ASSERT_EQ(cpu->A, 0x05);
+
+  load(0x10FE, {LDAA, 0x05, 0x20, NOP});
+  cpu->PC = 0x10FE;
+  cpu->run(2);
+  ASSERT_EQ(cpu->A, 0x05);
+
+  mem.writeByte(0x2105, 0x77);
+  mem.writeByte(0x1100, 0x21);
+  cpu->PC = 0x10FE;
+  cpu->run(2);
+  ASSERT_EQ(cpu->A, 0x77);
+  ASSERT_EQ(cpu->PC, 0x1102);
+}
+
+// Fused DEX; BNE is split when the budget ends inside the group
+TEST_F(DecodeTest, FusedBudget) {
+  load(0x1000, {
+    LDXI,  0x03,
+    DEX,
+    BNE,   (256 - 3),  // to DEX
+    NOP
+  });
+  cpu->PC = 0x1000;
+  cpu->run(2);
+  ASSERT_EQ(cpu->getInstructionCount(), 2);
+  ASSERT_EQ(cpu->X, 2);
+  ASSERT_EQ(cpu->PC, 0x1003);
+
+  cpu->run(5);
+  ASSERT_EQ(cpu->X, 0);
+  ASSERT_EQ(cpu->PC, 0x1005);
+}
+
+// Program replaces the branch of a fused CMP; BNE
+TEST_F(DecodeTest, FusedBranchModified) {
+  load(0x1000, {
+    LDAI,  0x01,
+    CMPI,  0x01,
+    BNE,   0x08,       // patched to BEQ, to done
+    LDXI,  BEQ,
+    STXA,  0x04, 0x10,
+    JMPA,  0x00, 0x10,
+    NOP                // done
+  });
+  cpu->PC = 0x1000;
+  cpu->run(9);
+  ASSERT_EQ(cpu->getInstructionCount(), 9);
+  ASSERT_EQ(cpu->PC, 0x100E);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,240 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for IRQ, NMI and scheduled events
+///
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <Opcodes.h>
+#include <Scheduler.h>
+
+class InterruptTest: public TestBase {
+protected:
+  void load(uint16_t address, std::vector<uint8_t> code) {
+    for (auto byte : code) {
+      mem.writeByte(address++, byte);
+    }
+  }
+
+  // IRQ handler at $3000 counts in Y, NMI handler at $3010 loads $55
+  void loadHandlers() {
+    load(0x3000, { INY, RTI });
+    load(0x3010, { LDAI, 0x55, RTI });
+    load(0xFFFA, { 0x10, 0x30 });
+    load(0xFFFE, { 0x00, 0x30 });
+  }
+};
+
+
+TEST_F(InterruptTest, SchedulerOrder) {
+  Scheduler events;
+  std::vector<int> called;
+  events.schedule(30, [&](uint64_t cycle) { called.push_back(3); });
+  events.schedule(10, [&](uint64_t cycle) { called.push_back(1); });
+  uint64_t id = events.schedule(20, [&](uint64_t cycle) { called.push_back(0); });
+  events.schedule(10, [&](uint64_t cycle) {
+    called.push_back(2);
+    events.schedule(cycle + 5, [&](uint64_t cycle) { called.push_back(cycle); });
+  });
+  events.cancel(id);
+  ASSERT_EQ(events.next(), 10);
+
+  events.runDue(9);
+  ASSERT_TRUE(called.empty());
+  events.runDue(25);
+  ASSERT_EQ(called, std::vector<int>({1, 2, 15}));
+  ASSERT_EQ(events.next(), 30);
+  events.runDue(100);
+  ASSERT_EQ(called, std::vector<int>({1, 2, 15, 3}));
+  ASSERT_TRUE(events.next() == Scheduler::Never);
+}
+
+// Events are called at the first instruction boundary at or after their
+// cycle, in fused groups too
+TEST_F(InterruptTest, EventTiming) {
+  load(0x1000, {
+    LDXI,  0x00,
+    DEX,               // loop
+    BNE,   (256 - 3),  // to DEX
+    JMPA,  0x00, 0x10
+  });
+  std::vector<std::pair<uint64_t, uint64_t>> called; // scheduled, actual
+  auto record = [&](uint64_t cycle) {
+    called.push_back({cycle, cpu->getCycleCount()});
+  };
+  cpu->schedule(100, record);
+  cpu->schedule(50, record);
+  cpu->schedule(1234, record);
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->run(1000), CPU::Budget);
+  ASSERT_EQ(called.size(), 3);
+  uint64_t last = 0;
+  for (auto & call : called) {
+    ASSERT_GE(call.first, last);
+    ASSERT_GE(call.second, call.first);
+    ASSERT_LT(call.second, call.first + MaxCycles);
+    last = call.first;
+  }
+}
+
+// The IRQ is held off by the I flag and taken again after RTI while the
+// line is active
+TEST_F(InterruptTest, IrqLevel) {
+  loadHandlers();
+  load(0x1000, {
+    INX,
+    JMPA,  0x00, 0x10
+  });
+  cpu->PC = 0x1000;
+  cpu->Status.bits.I = 1;
+  cpu->setIRQ(true);
+  cpu->run(10);
+  ASSERT_EQ(cpu->X, 5);
+  ASSERT_EQ(cpu->getInterruptCount(), 0);
+
+  cpu->Status.bits.I = 0;
+  uint64_t cycles = cpu->getCycleCount();
+  cpu->run(1);
+  ASSERT_EQ(cpu->Y, 1);
+  ASSERT_EQ(cpu->getCycleCount() - cycles, 7 + 2);
+  ASSERT_EQ(cpu->Status.bits.I, 1);
+  ASSERT_EQ(mem.readByte(0x1FF), 0x10);              // return address
+  ASSERT_EQ(mem.readByte(0x1FE), 0x00);
+  ASSERT_EQ(mem.readByte(0x1FD) & 0x34, 0x20);       // B and I clear
+
+  cpu->run(2); // RTI, taken again
+  ASSERT_EQ(cpu->Y, 2);
+  ASSERT_EQ(cpu->getInterruptCount(), 2);
+
+  cpu->run(1); // RTI
+  cpu->setIRQ(false);
+  cpu->run(100);
+  ASSERT_EQ(cpu->Y, 2);
+  ASSERT_EQ(cpu->getInterruptCount(), 2);
+  ASSERT_EQ(cpu->S, 0xFF);
+}
+
+// Taken right after CLI clears the flag, also with the JIT
+TEST_F(InterruptTest, IrqAfterCli) {
+  for (bool jit : {false, true}) {
+    load(0x1000, {
+      INX,
+      INX,
+      CLINT,
+      INX,
+      JMPA,  0x03, 0x10
+    });
+    load(0x3000, { STXZP, 0x40, JMPA, 0x02, 0x30 });
+    load(0xFFFE, { 0x00, 0x30 });
+    cpu->reset(0x1000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    cpu->Status.bits.I = 1;
+    cpu->setIRQ(true);
+    ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+    ASSERT_EQ(cpu->PC, 0x3002);
+    ASSERT_EQ(mem.readByte(0x40), 2);
+    ASSERT_EQ(mem.readWord(0x1FE), 0x1003);
+    cpu->setIRQ(false);
+  }
+}
+
+// A held IRQ masked by I does not split the run into single instructions,
+// PLP clearing I ends the stretch
+TEST_F(InterruptTest, MaskedIrqStretches) {
+  for (bool jit : {false, true}) {
+    load(0x1000, {
+      LDYI,  0x28,
+      DEX,               // $1002
+      BNE,   (256 - 3),
+      DEY,
+      BNE,   (256 - 6),
+      LDAI,  0x00,
+      PHA,
+      PLP,
+      INX,               // $100C
+      JMPA,  0x0D, 0x10
+    });
+    load(0x3000, { STXZP, 0x40, JMPA, 0x02, 0x30 });
+    load(0xFFFE, { 0x00, 0x30 });
+    cpu->reset(0x1000);
+    if (jit) {
+      cpu->jitOn();
+    }
+    cpu->Status.bits.I = 1;
+    cpu->setIRQ(true);
+    uint64_t stretches = cpu->getStretchCount();
+    uint64_t instructions = cpu->getInstructionCount();
+    ASSERT_EQ(cpu->run(100000), CPU::LoopDetected);
+    ASSERT_LT(cpu->getStretchCount() - stretches, 10);
+    ASSERT_EQ(cpu->PC, 0x3002);
+    ASSERT_EQ(mem.readByte(0x40), 0);                  // before INX
+    ASSERT_EQ(mem.readWord(0x1FE), 0x100C);
+    ASSERT_EQ(cpu->getInstructionCount() - instructions, 1 + 0x28 * (256 * 2 + 2) + 3 + 2);
+    cpu->setIRQ(false);
+  }
+}
+
+// The NMI is taken once per activation, also with I set
+TEST_F(InterruptTest, NmiEdge) {
+  loadHandlers();
+  load(0x1000, {
+    INX,
+    JMPA,  0x00, 0x10
+  });
+  cpu->PC = 0x1000;
+  cpu->Status.bits.I = 1;
+  cpu->setNMI(true);
+  cpu->run(1);
+  ASSERT_EQ(cpu->A, 0x55);
+  cpu->run(1); // RTI
+  ASSERT_EQ(cpu->PC, 0x1000);
+
+  cpu->A = 0;
+  cpu->setNMI(true);
+  cpu->run(100);
+  ASSERT_EQ(cpu->A, 0);
+  ASSERT_EQ(cpu->getInterruptCount(), 1);
+
+  cpu->setNMI(false);
+  cpu->setNMI(true);
+  cpu->run(1);
+  ASSERT_EQ(cpu->A, 0x55);
+  ASSERT_EQ(cpu->getInterruptCount(), 2);
+}
+
+// Idle loops are skipped up to the next event
+TEST_F(InterruptTest, IdleUntilEvent) {
+  load(0x1000, {
+    LDAZP, 0x00,       // 3, wait for $00
+    BEQ,   (256 - 4),  // 3, to LDAZP
+    JMPA,  0x04, 0x10  // loops on itself
+  });
+  int count = 0;
+  std::function<void(uint64_t)> tick = [&](uint64_t cycle) {
+    if (++count == 15) {
+      mem.writeByte(0x00, 1);
+    }
+    cpu->schedule(cycle + 1000, tick);
+  };
+  cpu->schedule(1000, tick);
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->runCycles(10000), CPU::Idle);
+  ASSERT_EQ(count, 9); // the event at 10000 is called by the next run
+  ASSERT_LT(cpu->getCycleCount() - 10000, MaxCycles);
+
+  ASSERT_EQ(cpu->runCycles(10000), CPU::LoopDetected);
+  ASSERT_EQ(count, 15);
+  ASSERT_LT(cpu->getCycleCount(), 15000 + 4 * MaxCycles);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,239 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for the basic block compiler
+///
+/// Tests pass trivially on hosts where the JIT is not supported
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <Opcodes.h>
+
+class JITTest: public TestBase {
+protected:
+  void load(Memory & memory, uint16_t address, std::vector<uint8_t> code) {
+    for (auto byte : code) {
+      memory.writeByte(address++, byte);
+    }
+  }
+};
+
+
+// Block patches an instruction later in the same block
+TEST_F(JITTest, SelfModifyingBlock) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  load(mem, 0x1000, {
+    LDAI,  0x2A,
+    STAA,  0x06, 0x10, // patch operand of LDX
+    LDXI,  0x00,
+    JMPA,  0x07, 0x10
+  });
+  cpu->PC = 0x1000;
+  cpu->run(100);
+  ASSERT_EQ(cpu->X, 0x2A);
+  ASSERT_EQ(cpu->PC, 0x1007);
+  ASSERT_EQ(cpu->getInstructionCount(), 4);
+}
+
+// Loop running inside a block stops when the budget is used
+TEST_F(JITTest, LoopBudget) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  load(mem, 0x1000, {
+    LDXI,  0x00,
+    DEX,
+    BNE,   (256 - 3),  // to DEX
+    NOP
+  });
+  cpu->PC = 0x1000;
+  cpu->run(50);
+  ASSERT_EQ(cpu->getInstructionCount(), 50);
+  ASSERT_EQ(cpu->X, 256 - 25);
+  ASSERT_EQ(cpu->PC, 0x1003);
+  ASSERT_EQ(cpu->getCycleCount(), 2 + 24 * (2 + 3) + 2);
+
+  cpu->run(1 + 2 * 256 - 50);
+  ASSERT_EQ(cpu->X, 0);
+  ASSERT_EQ(cpu->PC, 0x1005);
+}
+
+// Native ADC and SBC give the same result and flags as the interpreter
+TEST_F(JITTest, AddSubtract) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  Memory refmem;
+  CPU ref(refmem);
+  refmem.reset();
+
+  for (int a = 0; a < 256; a += 3) {
+    for (int m = 0; m < 256; m += 5) {
+      for (uint8_t carry : {CLC, SEC}) {
+        for (uint8_t op : {ADCI, SBCI}) {
+          std::vector<uint8_t> code{carry, LDAI, uint8_t(a), op, uint8_t(m), JMPA, 0x00, 0x20};
+          load(mem, 0x1000, code);
+          load(refmem, 0x1000, code);
+          cpu->reset(0x1000);
+          ref.reset(0x1000);
+          cpu->run(4);
+          ref.run(4);
+          ASSERT_EQ(cpu->A, ref.A) << "a " << a << " m " << m;
+          ASSERT_EQ(cpu->Status.mask, ref.Status.mask) << "a " << a << " m " << m;
+        }
+      }
+    }
+  }
+}
+
+// Decimal mode ADC and SBC from an I/O register read it once, like the
+// binary ones (the read can acknowledge an interrupt)
+TEST_F(JITTest, DecimalIoRead) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  int reads = 0;
+  mem.mapIo(0xDC00, 0x100, [&](uint16_t addr) -> uint8_t {
+    reads++;
+    return 0x19;
+  }, [](uint16_t addr, uint8_t value) { });
+  for (uint8_t mode : {CLD, SED}) {
+    for (uint8_t op : {ADCA, SBCA}) {
+      load(mem, 0x1000, {mode, CLC, LDAI, 0x01, op, 0x0D, 0xDC, CLD, JMPA, 0x08, 0x10});
+      reads = 0;
+      cpu->reset(0x1000);
+      ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+      ASSERT_EQ(reads, 1);
+      if (mode == SED) {
+        ASSERT_EQ(cpu->A, (op == ADCA) ? 0x20 : 0x81); // BCD 01 + 19, 01 - 19 - 1
+      }
+    }
+  }
+}
+
+// Native PLP and PHP keep all flags
+TEST_F(JITTest, StatusPullPush) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  for (int val = 0; val < 256; val++) {
+    load(mem, 0x1000, {LDAI, uint8_t(val), PHA, PLP, PHP, PLA, JMPA, 0x00, 0x20});
+    cpu->reset(0x1000);
+    cpu->run(6);
+    ASSERT_EQ(cpu->A, val | 0x30);
+    ASSERT_EQ(cpu->Status.mask, val & ~0x02); // Z cleared by PLA
+  }
+}
+
+// Native indirect loads read the high byte of a pointer at $FF from $00
+TEST_F(JITTest, ZeroPagePointerWrap) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  mem.writeByte(0x00, 0x30);
+  mem.writeByte(0xFF, 0x40);
+  mem.writeByte(0x3040, 0x11);
+  mem.writeByte(0x3041, 0x22);
+  load(mem, 0x1000, {
+    LDXI,    0x01,
+    LDAIXID, 0xFE,     // ($FF)
+    TAY,               // 0x11
+    LDAIDIX, 0xFF,     // ($FF),Y
+    JMPA,    0x07, 0x10
+  });
+  mem.writeByte(0x3051, 0x33);
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+  ASSERT_EQ(cpu->Y, 0x11);
+  ASSERT_EQ(cpu->A, 0x33);
+}
+
+// Native indexed loads count page crossings like the interpreter
+TEST_F(JITTest, PageCrossCycles) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  Memory refmem;
+  CPU ref(refmem);
+  refmem.reset();
+  for (int i = 0; i < 256; i++) { // same zero page pointers as mem
+    refmem.writeByte(i, i);
+  }
+
+  for (int index = 0; index < 256; index += 7) {
+    for (uint8_t low : {0x00, 0x80, 0xF0, 0xFF}) {
+      std::vector<uint8_t> code{LDXI, uint8_t(index), LDYI, uint8_t(index),
+                                LDAAX, low, 0x20, ADCAY, low, 0x20,
+                                CMPIDIX, uint8_t(low & 0x7E), JMPA, 0x00, 0x20};
+      load(mem, 0x1000, code);
+      load(refmem, 0x1000, code);
+      cpu->reset(0x1000);
+      ref.reset(0x1000);
+      uint64_t start = cpu->getCycleCount();
+      uint64_t refstart = ref.getCycleCount();
+      cpu->run(6);
+      ref.run(6);
+      ASSERT_EQ(cpu->getCycleCount() - start, ref.getCycleCount() - refstart)
+        << "index " << index << " low " << int(low);
+    }
+  }
+}
+
+// Translated jumps and branches to themselves stop the run
+TEST_F(JITTest, LoopDetected) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  load(mem, 0x1000, {
+    LDXI,  0x00,
+    BEQ,   (256 - 2),  // to itself
+    JMPA,  0x04, 0x10  // to itself
+  });
+  cpu->PC = 0x1000;
+  ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+  ASSERT_EQ(cpu->PC, 0x1002);
+
+  cpu->PC = 0x1004;
+  ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+  ASSERT_EQ(cpu->PC, 0x1004);
+  ASSERT_EQ(cpu->getInstructionCount(), 3);
+}
+
+// Blocks end at break points, also inside loops running natively
+TEST_F(JITTest, Breakpoints) {
+  if (not cpu->jitOn()) {
+    return;
+  }
+  load(mem, 0x1000, {
+    LDXI,  0x05,
+    DEX,
+    INY,
+    BNE,   (256 - 4),  // to DEX
+    NOP
+  });
+  cpu->PC = 0x1000;
+  cpu->run(4); // translate
+  cpu->PC = 0x1000;
+  cpu->addBreakpoint(0x1003);
+  ASSERT_EQ(cpu->run(100), CPU::Breakpoint);
+  ASSERT_EQ(cpu->PC, 0x1003);
+  ASSERT_EQ(cpu->X, 4);
+
+  cpu->removeBreakpoint(0x1003);
+  cpu->addBreakpoint(0x1002);
+  ASSERT_EQ(cpu->run(100), CPU::Breakpoint);
+  ASSERT_EQ(cpu->PC, 0x1002);
+  ASSERT_EQ(cpu->X, 4);
+  ASSERT_EQ(cpu->Y, 2);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -242,6 +242,18 @@ TEST_F(LDATest, IndirectIndex) {
 }
 
 
+// A pointer at $FF has its high byte at $00, not $100 (0xAA)
+TEST_F(LDATest, ZeroPagePointerWrap) {
+  cpu->X = 1;
+  LDA2(LDAIXID, cpu->A, 0xFE, 0xFF, 0, 1); // ($FF) = $00FF
+  cpu->X = 0x80;
+  LDA2(LDAIXID, cpu->A, 0x7F, 0xFF, 0, 1);
+  cpu->Y = 0;
+  LDA2(LDAIDIX, cpu->A, 0xFF, 0xFF, 0, 1);
+  cpu->Y = 1;
+  LDA2(LDAIDIX, cpu->A, 0xFF, 0xAA, 0, 1); // $0100
+}
+
 
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,292 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for the lockstep lanes, checked against the CPU
+///
+//===----------------------------------------------------------------------===//
+
+#include <gtest/gtest.h>
+#include <Lockstep.h>
+#include <Programs.h>
+#include <random>
+
+class LockstepTest : public ::testing::Test {
+protected:
+  // The program at start and an input byte per lane at $10
+  void load(std::vector<uint8_t> code, uint16_t address = 0x1000) {
+    program = code;
+    start = address;
+    lanes.loadData(start, program.data(), program.size());
+    lanes.reset(start);
+    for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+      lanes.poke(lane, 0x10, input(lane));
+    }
+  }
+
+  virtual uint8_t input(int lane) { return lane; }
+
+  // Run lane on a CPU for the same budgets and compare the results, zero
+  // page and stack included
+  void check(int lane, std::vector<uint64_t> budgets) {
+    Memory mem;
+    mem.clear();
+    CPU cpu(mem);
+    setup(lane, mem);
+    cpu.reset(start);
+    CPU::StopReason reason = CPU::Budget;
+    for (auto n : budgets) {
+      if (reason == CPU::Budget) { // stopped lanes stay stopped
+        reason = cpu.run(n);
+      }
+    }
+    auto regs = lanes.getRegisters(lane);
+    ASSERT_EQ(lanes.getStopReason(lane), reason) << "lane " << lane;
+    ASSERT_EQ(lanes.getInstructionCount(lane), cpu.getInstructionCount()) << "lane " << lane;
+    ASSERT_EQ(regs.PC, cpu.PC) << "lane " << lane;
+    ASSERT_EQ(regs.A, cpu.A) << "lane " << lane;
+    ASSERT_EQ(regs.X, cpu.X) << "lane " << lane;
+    ASSERT_EQ(regs.Y, cpu.Y) << "lane " << lane;
+    ASSERT_EQ(regs.S, cpu.S) << "lane " << lane;
+    ASSERT_EQ(regs.P, cpu.Status.mask) << "lane " << lane;
+    for (int address = 0; address < 0x200; address++) {
+      ASSERT_EQ(lanes.peek(lane, address), mem.peek(address)) << "lane " << lane << " address " << address;
+    }
+  }
+
+  virtual void setup(int lane, Memory & mem) {
+    mem.loadData(start, program.data(), program.size());
+    mem.writeByte(0x10, input(lane));
+  }
+
+  void run(std::vector<uint64_t> budgets) {
+    for (auto n : budgets) {
+      lanes.run(n);
+    }
+    for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+      check(lane, budgets);
+    }
+  }
+
+  Lockstep lanes;
+  std::vector<uint8_t> program;
+  uint16_t start{0x1000};
+};
+
+
+// Loops of different lengths, the lanes wait for each other and join
+// again after the loop
+TEST_F(LockstepTest, Reconverge) {
+  load({
+    LDXZP, 0x10,
+    INX,
+    DEX,         // $1003
+    BNE,   (256 - 3),
+    LDYI,  0x07,
+    STYZP, 0x11,
+    JMPA,  0x0A, 0x10
+  });
+  run({10000});
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    ASSERT_FALSE(lanes.isScalar(lane));
+    ASSERT_EQ(lanes.getStopReason(lane), CPU::LoopDetected);
+    ASSERT_EQ(lanes.peek(lane, 0x11), 0x07);
+  }
+}
+
+// Some lanes take a subroutine call, the stack and flags are per lane
+TEST_F(LockstepTest, Subroutine) {
+  load({
+    LDAZP, 0x10,
+    ANDI,  0x01,
+    BEQ,   0x03,
+    JSR,   0x10, 0x10,
+    PHP,         // $1009
+    PLA,
+    STAZP, 0x12,
+    JMPA,  0x0D, 0x10,
+    LSRZP, 0x10, // $1010
+    SEC,
+    ADCI,  0x80,
+    CLV,
+    RTS
+  });
+  run({10000});
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    ASSERT_FALSE(lanes.isScalar(lane));
+  }
+}
+
+// Lanes running out of budget stop, the next run() continues them
+TEST_F(LockstepTest, Budget) {
+  load({
+    LDXZP, 0x10,
+    INX,
+    DEX,
+    BNE,   (256 - 3),
+    JMPA,  0x06, 0x10
+  });
+  run({5, 1, 20, 100});
+  ASSERT_EQ(lanes.getStopReason(0), CPU::LoopDetected);
+  ASSERT_EQ(lanes.getStopReason(Lockstep::Lanes - 1), CPU::Budget);
+}
+
+// Decimal mode is done on a scalar CPU
+TEST_F(LockstepTest, DecimalPeels) {
+  load({
+    LDAZP, 0x10,
+    ANDI,  0x03,
+    BEQ,   0x01,
+    SED,
+    CLC,         // $1007
+    ADCI,  0x19,
+    STAZP, 0x11,
+    CLD,
+    JMPA,  0x0D, 0x10
+  });
+  run({10000});
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    ASSERT_EQ(lanes.isScalar(lane), (lane & 3) != 0) << "lane " << lane;
+  }
+  ASSERT_EQ(lanes.peek(4, 0x11), 0x19);
+  ASSERT_EQ(lanes.peek(5, 0x11), 0x20); // 01 + 19 in BCD
+
+  // reset() takes them back, with their memory
+  lanes.reset(0x1000);
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    ASSERT_FALSE(lanes.isScalar(lane));
+  }
+  ASSERT_EQ(lanes.peek(5, 0x11), 0x20);
+}
+
+// Code a lane changed on the scalar CPU is checked after reset()
+TEST_F(LockstepTest, ResetAfterPeel) {
+  load({
+    LDAZP, 0x10,
+    ANDI,  0x01,
+    BEQ,   0x07,
+    SED,         // odd lanes, on the scalar CPU
+    LDAZP, 0x10,
+    STAA,  0x41, 0x10,
+    CLD,
+    JMPA,  0x0D, 0x10 // $100D
+  });
+  lanes.loadData(0x1040, std::vector<uint8_t>{LDYI, 0x00, JMPA, 0x42, 0x10}.data(), 5);
+  lanes.run(1000);
+  ASSERT_TRUE(lanes.isScalar(5));
+  ASSERT_EQ(lanes.peek(5, 0x1041), 0x05);
+
+  lanes.reset(0x1040);
+  lanes.run(1000);
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    ASSERT_EQ(lanes.getStopReason(lane), CPU::LoopDetected);
+    ASSERT_EQ(lanes.getRegisters(lane).Y, (lane & 1) ? lane : 0) << "lane " << lane;
+    ASSERT_EQ(lanes.isScalar(lane), (lane & 1) != 0) << "lane " << lane;
+  }
+}
+
+// A lane whose code differs from the others' continues alone
+class PerLaneCode : public LockstepTest {
+protected:
+  void setup(int lane, Memory & mem) override {
+    LockstepTest::setup(lane, mem);
+    if (lane == 3) {
+      mem.writeByte(0x1001, 0x55);
+    }
+  }
+};
+
+TEST_F(PerLaneCode, Peels) {
+  load({
+    LDAI,  0x42,
+    STAZP, 0x11,
+    JMPA,  0x04, 0x10
+  });
+  lanes.poke(3, 0x1001, 0x55);
+  run({10000});
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    ASSERT_EQ(lanes.isScalar(lane), lane == 3);
+    ASSERT_EQ(lanes.peek(lane, 0x11), (lane == 3) ? 0x55 : 0x42);
+  }
+}
+
+// Code written by the program (self modifying) is checked as well
+TEST_F(LockstepTest, SelfModifying) {
+  load({
+    LDAZP, 0x10,
+    STAA,  0x08, 0x10,
+    LDXI,  0x00,
+    LDYI,  0x01, // $1007, the operand is the input
+    JMPA,  0x09, 0x10
+  });
+  run({10000});
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    ASSERT_EQ(lanes.isScalar(lane), lane != 0);
+    ASSERT_EQ(lanes.getRegisters(lane).Y, lane);
+  }
+}
+
+// Lanes waiting more than MaxDrift instructions continue alone
+TEST_F(LockstepTest, Drift) {
+  load({
+    LDAZP, 0x10,
+    BEQ,   0x0A,
+    LDXI,  0x00, // $1004
+    LDYI,  0x03,
+    DEX,         // $1008
+    BNE,   (256 - 3),
+    DEY,
+    BNE,   (256 - 6),
+    JMPA,  0x0E, 0x10
+  });
+  run({10000});
+  ASSERT_TRUE(lanes.isScalar(0));
+  ASSERT_FALSE(lanes.isScalar(1));
+}
+
+// Random div32 arguments, with and without overflow
+class Div32 : public LockstepTest {
+protected:
+  void SetUp() override {
+    std::mt19937 rng(6502);
+    for (auto & lane : arguments) {
+      for (auto & byte : lane) {
+        byte = rng();
+      }
+    }
+    for (int lane = 0; lane < Lockstep::Lanes; lane += 2) {
+      arguments[lane][1] |= 0x80; // no overflow
+      arguments[lane][5] = 0;
+    }
+  }
+
+  void setup(int lane, Memory & mem) override {
+    LockstepTest::setup(lane, mem);
+    for (auto & snippet : div32) {
+      mem.loadData(snippet.address, snippet.data.data(), snippet.data.size());
+    }
+    mem.loadData(VARN, arguments[lane], 6);
+  }
+
+  uint8_t arguments[Lockstep::Lanes][6];
+};
+
+TEST_F(Div32, SameAsCPU) {
+  lanes.loadSnippets(div32);
+  load({
+    JSR,   0x00, 0x10,
+    JMPA,  0x03, 0x0F
+  }, 0x0F00);
+  for (int lane = 0; lane < Lockstep::Lanes; lane++) {
+    for (int i = 0; i < 6; i++) {
+      lanes.poke(lane, VARN + i, arguments[lane][i]);
+    }
+  }
+  run({100, 10000});
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,301 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for loops executed at once
+///
+/// Every program is also run one instruction at a time by a reference CPU,
+/// registers, flags, memory and counts must be the same
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <Opcodes.h>
+
+class LoopTest: public TestBase {
+protected:
+  Memory refmem;
+
+  void load(uint16_t address, std::vector<uint8_t> code) {
+    for (auto byte : code) {
+      mem.writeByte(address++, byte);
+    }
+  }
+
+  // Run n instructions from 0x1000 and compare with the reference
+  void compare(uint64_t n, bool jit = false) {
+    memcpy(refmem.mem, mem.mem, sizeof(mem.mem));
+    CPU ref(refmem);
+    ref.reset(0x1000);
+    ref.A = cpu->A;
+    ref.X = cpu->X;
+    ref.Y = cpu->Y;
+    ref.S = cpu->S;
+    ref.Status.mask = cpu->Status.mask;
+    cpu->PC = 0x1000;
+    uint64_t instructions = cpu->getInstructionCount();
+    uint64_t cycles = cpu->getCycleCount();
+    if (jit) {
+      cpu->jitOn();
+    }
+
+    CPU::StopReason reason = cpu->run(n);
+    uint64_t executed = 0; // not counted by handleInstruction()
+    bool running = true;
+    while (running and (executed < n)) {
+      running = ref.handleInstruction(ref.getInstruction());
+      executed++;
+    }
+    ASSERT_EQ(reason == CPU::Budget, running);
+    ASSERT_EQ(cpu->PC, ref.PC);
+    ASSERT_EQ(cpu->A, ref.A);
+    ASSERT_EQ(cpu->X, ref.X);
+    ASSERT_EQ(cpu->Y, ref.Y);
+    ASSERT_EQ(cpu->Status.mask, ref.Status.mask);
+    ASSERT_EQ(cpu->getInstructionCount() - instructions, executed);
+    ASSERT_EQ(cpu->getCycleCount() - cycles, ref.getCycleCount());
+    ASSERT_EQ(memcmp(mem.mem, refmem.mem, sizeof(mem.mem)), 0);
+  }
+};
+
+
+// memcpy() in Programs.h, copying 4 bytes
+TEST_F(LoopTest, CopyIndirect) {
+  load(0x1000, {
+    LDYI,    0xFF,
+    LDXI,    0x00,       // 256 bytes
+    LDAIDIX, 0xF0,       // loop
+    STAIDIX, 0xF2,
+    DEY,
+    DEX,
+    BNE,     (256 - 8),  // to loop
+    JMPA,    0x0C, 0x10
+  });
+  mem.writeByte(0xF0, 0x80); // $2080, crosses a page
+  mem.writeByte(0xF1, 0x20);
+  mem.writeByte(0xF2, 0x00); // $3000
+  mem.writeByte(0xF3, 0x30);
+  for (int i = 0; i < 256; i++) {
+    mem.writeByte(0x2080 + i, 255 - i);
+  }
+  compare(2000);
+  ASSERT_TRUE(cpu->isLoop(0x1004));
+  ASSERT_EQ(cpu->getInstructionCount(), 2 + 256 * 5 + 1);
+  ASSERT_EQ(mem.readByte(0x3000), mem.readByte(0x2080));
+  ASSERT_EQ(mem.readByte(0x30FF), mem.readByte(0x217F));
+}
+
+// Kernal style: count up to a limit in zero page
+TEST_F(LoopTest, CopyAbsolute) {
+  load(0x1000, {
+    LDXI,   0x10,
+    LDAAX,  0xE8, 0x20,  // loop, crosses a page at x = 0x18
+    STAAX,  0x00, 0x40,
+    INX,
+    CPXZP,  0x80,
+    BNE,    (256 - 11),  // to loop
+    JMPA,   0x0D, 0x10
+  });
+  mem.writeByte(0x80, 0xC0);
+  compare(1000);
+  ASSERT_TRUE(cpu->isLoop(0x1002));
+  ASSERT_EQ(mem.readByte(0x4010), 0xF8);
+  ASSERT_EQ(mem.readByte(0x40BF), mem.readByte(0x21A7));
+}
+
+// Copying to higher addresses in the same direction repeats the first
+// bytes, not like memmove()
+TEST_F(LoopTest, CopyOverlapping) {
+  load(0x1000, {
+    LDXI,   0x00,
+    LDAAX,  0x00, 0x20,  // loop
+    STAAX,  0x04, 0x20,
+    INX,
+    CPXI,   0x40,
+    BNE,    (256 - 11),  // to loop
+    JMPA,   0x0D, 0x10
+  });
+  compare(1000);
+  ASSERT_EQ(mem.readByte(0x2043), 0x03);
+}
+
+// Copying to lower addresses in the same direction is a memmove()
+TEST_F(LoopTest, CopyDown) {
+  load(0x1000, {
+    LDYI,   0x00,
+    LDAAY,  0x04, 0x20,  // loop
+    STAAY,  0x00, 0x20,
+    INY,
+    CPYI,   0x40,
+    BNE,    (256 - 11),  // to loop
+    JMPA,   0x0D, 0x10
+  });
+  compare(1000);
+  ASSERT_EQ(mem.readByte(0x203F), 0x43);
+}
+
+// Fill screen lines like the kernal, two stores, counting down
+TEST_F(LoopTest, Fill) {
+  load(0x1000, {
+    LDYI,    0x27,
+    LDAI,    0x20,       // loop
+    STAIDIX, 0xD1,
+    LDAI,    0x0E,
+    STAIDIX, 0xF3,
+    DEY,
+    BPL,     (256 - 11), // to loop
+    JMPA,    0x0D, 0x10
+  });
+  mem.writeByte(0xD1, 0x00); // $0400
+  mem.writeByte(0xD2, 0x04);
+  mem.writeByte(0xF3, 0x00); // $D800
+  mem.writeByte(0xF4, 0xD8);
+  compare(1000);
+  ASSERT_TRUE(cpu->isLoop(0x1002));
+  ASSERT_EQ(mem.readByte(0x0427), 0x20);
+  ASSERT_EQ(mem.readByte(0xD800), 0x0E);
+}
+
+// The high byte of a pointer at $FF is at $00
+TEST_F(LoopTest, CopyPointerWrap) {
+  load(0x1000, {
+    LDYI,    0x27,
+    LDAIDIX, 0xFF,       // loop
+    STAAY,   0x00, 0x30,
+    DEY,
+    BPL,     (256 - 8),  // to loop
+    JMPA,    0x0A, 0x10
+  });
+  mem.writeByte(0xFF, 0x80); // $2080
+  mem.writeByte(0x00, 0x20);
+  compare(1000);
+  ASSERT_TRUE(cpu->isLoop(0x1002));
+  ASSERT_EQ(mem.readByte(0x3000), 0x80);
+  ASSERT_EQ(mem.readByte(0x3027), 0xA7);
+}
+
+// Stores to the compared limit are executed one at a time
+TEST_F(LoopTest, FillLimit) {
+  load(0x1000, {
+    LDYI,    0x00,
+    LDAI,    0x00,
+    STAAY,   0x00, 0x00, // loop
+    INY,
+    CPYZP,   0x08,       // $40, until it is cleared
+    BNE,     (256 - 8),  // to loop
+    JMPA,    0x0C, 0x10
+  });
+  mem.writeByte(0x08, 0x40);
+  compare(2000);
+  ASSERT_EQ(cpu->Y, 0x00);
+  ASSERT_EQ(mem.readByte(0xFF), 0x00);
+}
+
+// Compare until the first difference, like the kernal checking for a
+// cartridge
+TEST_F(LoopTest, Compare) {
+  load(0x1000, {
+    LDXI,   0x40,
+    LDAAX,  0xFF, 0x2F,  // loop
+    CMPAX,  0xFF, 0x1F,
+    BNE,    0x04,        // to done
+    DEX,
+    BNE,    (256 - 11),  // to loop
+    NOP,
+    JMPA,   0x10, 0x10   // done
+  });
+  for (int i = 0; i < 0x40; i++) {
+    mem.writeByte(0x3000 + i, i);
+  }
+  compare(1000);
+  ASSERT_TRUE(cpu->isLoop(0x1002));
+  ASSERT_EQ(cpu->X, 0x00);
+
+  mem.writeByte(0x3010, 0x77); // 0x2010 is 0x10
+  cpu->reset(0x1000);
+  compare(1000);
+  ASSERT_EQ(cpu->X, 0x11);
+}
+
+// Search for the value in A
+TEST_F(LoopTest, Search) {
+  load(0x1000, {
+    LDXI,   0x70,
+    LDAI,   0x33,
+    CMPAX,  0x00, 0x20,  // loop
+    BEQ,    0x03,        // to done
+    DEX,
+    BPL,    (256 - 8),   // to loop
+    JMPA,   0x0C, 0x10   // done
+  });
+  compare(1000);
+  ASSERT_TRUE(cpu->isLoop(0x1004));
+  ASSERT_EQ(cpu->X, 0x33);
+}
+
+// Delay loops have no memory accesses
+TEST_F(LoopTest, Delay) {
+  load(0x1000, {
+    LDXI,   0x00,
+    DEX,                 // loop
+    BNE,    (256 - 3),   // to loop
+    JMPA,   0x05, 0x10
+  });
+  compare(1000);
+  ASSERT_TRUE(cpu->isLoop(0x1002));
+  ASSERT_EQ(cpu->getInstructionCount(), 1 + 2 * 256 + 1);
+}
+
+// The budget ends inside the loop
+TEST_F(LoopTest, Budget) {
+  load(0x1000, {
+    LDYI,    0x00,
+    LDAAY,   0x00, 0x20, // loop
+    STAAY,   0x00, 0x30,
+    INY,
+    BNE,     (256 - 9),  // to loop
+    JMPA,    0x0B, 0x10
+  });
+  for (uint64_t n : {3, 50, 51, 52, 53, 500, 1022}) {
+    cpu->reset(0x1000);
+    compare(n);
+  }
+}
+
+// Copying over the loop runs it one iteration at a time
+TEST_F(LoopTest, SelfModifying) {
+  load(0x1000, {
+    LDXI,   0x00,
+    LDAAX,  0x00, 0x20,  // loop
+    STAAX,  0xF0, 0x0F,  // reaches the loop at x = 0x12
+    INX,
+    CPXI,   0x40,
+    BNE,    (256 - 11),  // to loop
+    JMPA,   0x0D, 0x10
+  });
+  for (int i = 0; i < 0x40; i++) {
+    mem.writeByte(0x2000 + i, NOP);
+  }
+  compare(1000);
+}
+
+// Same results when the JIT runs the code around the loops
+TEST_F(LoopTest, Jit) {
+  load(0x1000, {
+    LDYI,    0x00,
+    LDAAY,   0x00, 0x20, // loop
+    STAAY,   0x00, 0x30,
+    INY,
+    BNE,     (256 - 9),  // to loop
+    JMPA,    0x0B, 0x10
+  });
+  compare(1000, true);
+  ASSERT_TRUE(cpu->isLoop(0x1002));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
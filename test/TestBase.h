@@ -12,6 +12,7 @@
 #include <gtest/gtest.h>
 #include <CPU.h>
 #include <Memory.h>
+#include <vector>
 
 
 class TestBase : public ::testing::Test {
@@ -33,6 +34,13 @@ protected:
   void TearDown( ) { }
 
 public:
+  // Copy code to memory at addr
+  void load(std::vector<uint8_t> code, uint16_t addr = 0x1000) {
+    for (auto byte : code) {
+      mem.writeByte(addr++, byte);
+    }
+  }
+
   void exec(uint8_t opcode) {
     cpu->PC = 0x1000;
     uint8_t inst = cpu->getInstruction();
@@ -0,0 +1,313 @@
+// Copyright (C) 2020 Morten Jagd Christensen, LICENSE: BSD2
+//===----------------------------------------------------------------------===//
+///
+/// \file
+///
+/// \brief Unit tests for the NMOS 6502, 65C02 and 2A03 variants
+///
+//===----------------------------------------------------------------------===//
+
+#include <TestBase.h>
+#include <Memory.h>
+#include <CPU.h>
+#include <Opcodes.h>
+
+class VariantTest: public TestBase {
+protected:
+  void load(uint16_t address, std::vector<uint8_t> code) {
+    for (auto byte : code) {
+      mem.writeByte(address++, byte);
+    }
+  }
+
+  // Replace the CPU, registers are reset and PC is 0x1000
+  void variant(Variant v) {
+    delete cpu;
+    cpu = new CPU(mem, v);
+    cpu->reset(0x1000);
+  }
+};
+
+
+// The stable undocumented opcodes, one at a time
+TEST_F(VariantTest, NmosUndocumented) {
+  cpu->reset(0x1000);
+  load(0x1000, {
+    LAXZP,  0x10,        // A = X = $10
+    LDAI,   0xF0,
+    LDXI,   0x3C,
+    SAXZP,  0x80,        // $80 = $30
+    SBXI,   0x10,        // X = $20, C
+    LDAI,   0x80,
+    DCPZP,  0x81,        // $81 = $80, equal
+    LDAI,   0x10,
+    ISCZP,  0x05,        // $05 = $06, A = $0A
+    LDAI,   0x01,
+    SLOZP,  0x40,        // $40 = $80, A = $81
+    LDAI,   0xFF,
+    RLAZP,  0xC0,        // C set, $C0 = $81, A = $81, C
+    LDAI,   0x03,
+    SREZP,  0x03,        // $03 = $01, A = $02, C
+    LDAI,   0x01,
+    RRAZP,  0x02,        // $02 = $81, A = $82
+  });
+  cpu->run(1);
+  ASSERT_EQ(cpu->A, 0x10);
+  ASSERT_EQ(cpu->X, 0x10);
+
+  cpu->run(3);
+  ASSERT_EQ(mem.readByte(0x80), 0x30);
+  cpu->run(1);
+  ASSERT_EQ(cpu->X, 0x20);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+
+  cpu->run(2);
+  ASSERT_EQ(mem.readByte(0x81), 0x80);
+  ASSERT_EQ(cpu->Status.bits.Z, 1);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+
+  cpu->run(2);
+  ASSERT_EQ(mem.readByte(0x05), 0x06);
+  ASSERT_EQ(cpu->A, 0x0A);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+
+  cpu->run(2);
+  ASSERT_EQ(mem.readByte(0x40), 0x80);
+  ASSERT_EQ(cpu->A, 0x81);
+  ASSERT_EQ(cpu->Status.bits.C, 0);
+  ASSERT_EQ(cpu->Status.bits.N, 1);
+
+  cpu->Status.bits.C = 1;
+  cpu->run(2);
+  ASSERT_EQ(mem.readByte(0xC0), 0x81);
+  ASSERT_EQ(cpu->A, 0x81);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+
+  cpu->run(2);
+  ASSERT_EQ(mem.readByte(0x03), 0x01);
+  ASSERT_EQ(cpu->A, 0x02);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+
+  cpu->run(2);
+  ASSERT_EQ(mem.readByte(0x02), 0x81);
+  ASSERT_EQ(cpu->A, 0x82);
+  ASSERT_EQ(cpu->Status.bits.C, 0);
+}
+
+TEST_F(VariantTest, NmosImmediate) {
+  cpu->reset(0x1000);
+  cpu->A = 0xF0;
+  exec2opcmd(ANCI, 0x80);
+  ASSERT_EQ(cpu->A, 0x80);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+  ASSERT_EQ(cpu->Status.bits.N, 1);
+
+  cpu->A = 0xFF;
+  exec2opcmd(ALRI, 0x03);
+  ASSERT_EQ(cpu->A, 0x01);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+
+  cpu->A = 0xFF;
+  exec2opcmd(ARRI, 0xC0);   // C set: $E0, C = bit 6, V = bit 6 ^ bit 5
+  ASSERT_EQ(cpu->A, 0xE0);
+  ASSERT_EQ(cpu->Status.bits.C, 1);
+  ASSERT_EQ(cpu->Status.bits.O, 0);
+  ASSERT_EQ(cpu->Status.bits.N, 1);
+
+  cpu->A = 0x40;
+  cpu->Status.bits.C = 0;
+  exec2opcmd(ARRI, 0xFF);   // $20
+  ASSERT_EQ(cpu->A, 0x20);
+  ASSERT_EQ(cpu->Status.bits.C, 0);
+  ASSERT_EQ(cpu->Status.bits.O, 1);
+
+  cpu->A = 0x10;
+  cpu->Status.bits.C = 1;
+  exec2opcmd(SBCI2, 0x01);
+  ASSERT_EQ(cpu->A, 0x0F);
+
+  cpu->S = 0xF3;
+  mem.writeByte(0x2010, 0x3E);
+  cpu->Y = 0x10;
+  exec3opcmd(LASAY, 0x00, 0x20);
+  ASSERT_EQ(cpu->A, 0x32);
+  ASSERT_EQ(cpu->X, 0x32);
+  ASSERT_EQ(cpu->S, 0x32);
+}
+
+// Unused opcodes are NOPs of one to three bytes reading their operand,
+// JAM still stops the CPU
+TEST_F(VariantTest, NmosNops) {
+  cpu->reset(0x1000);
+  load(0x1000, {
+    0x1A,                // 2
+    0x80, 0x55,          // 2
+    0x04, 0x10,          // 3
+    0x14, 0x10,          // 4
+    0x0C, 0x00, 0x20,    // 4
+    0x1C, 0xF8, 0x20,    // 4 + 1, X = $10
+    0x02                 // JAM
+  });
+  cpu->X = 0x10;
+  ASSERT_EQ(cpu->run(6), CPU::Budget);
+  ASSERT_EQ(cpu->PC, 0x100D);
+  ASSERT_EQ(cpu->getCycleCount(), 2 + 2 + 3 + 4 + 4 + 5);
+  ASSERT_EQ(cpu->X, 0x10);
+  ASSERT_EQ(cpu->run(1), CPU::IllegalOpcode);
+}
+
+// JMP ($xxFF) takes the high byte from the same page on the NMOS 6502
+TEST_F(VariantTest, JmpIndirectPage) {
+  for (auto v : {NMOS6502, CMOS65C02, Ricoh2A03}) {
+    variant(v);
+    load(0x3000, { JMPI, 0xFF, 0x10 });
+    load(0x10FF, { 0x34, 0x56 });
+    load(0x1000, { 0x12 });
+    cpu->PC = 0x3000;
+    cpu->run(1);
+    ASSERT_EQ(cpu->PC, (v == CMOS65C02) ? 0x5634 : 0x1234);
+    ASSERT_EQ(cpu->getCycleCount(), (v == CMOS65C02) ? 6 : 5);
+  }
+}
+
+// Decimal mode: N and Z from the result on the 65C02, binary on the 2A03
+TEST_F(VariantTest, Decimal) {
+  for (auto v : {NMOS6502, CMOS65C02, Ricoh2A03}) {
+    variant(v);
+    load(0x1000, {
+      SED,
+      CLC,
+      LDAI,  0x99,
+      ADCI,  0x01,
+      STAZP, 0x40,
+      SEC,
+      LDAI,  0x10,
+      SBCI,  0x01
+    });
+    cpu->run(4);
+    ASSERT_EQ(cpu->A, (v == Ricoh2A03) ? 0x9A : 0x00);
+    ASSERT_EQ(cpu->Status.bits.C, (v == Ricoh2A03) ? 0 : 1);
+    ASSERT_EQ(cpu->Status.bits.Z, (v == CMOS65C02) ? 1 : 0);
+    ASSERT_EQ(cpu->getCycleCount(), (v == CMOS65C02) ? 9 : 8);
+
+    cpu->run(4);
+    ASSERT_EQ(cpu->A, (v == Ricoh2A03) ? 0x0F : 0x09);
+    ASSERT_EQ(cpu->getCycleCount(), (v == CMOS65C02) ? 9 + 10 : 8 + 9);
+  }
+}
+
+// The 65C02 instructions and addressing modes, also with the JIT
+TEST_F(VariantTest, Cmos) {
+  for (bool jit : {false, true}) {
+    SetUp();
+    variant(CMOS65C02);
+    if (jit) {
+      cpu->jitOn();
+    }
+    load(0x1000, {
+      LDXI,      0x02,
+      BRA,       0x02,       // over INX INX
+      INX,
+      INX,
+      STZZP,     0x40,       // $40 = 0
+      LDAI,      0x0F,
+      TSBZP,     0x41,       // $41 = $4F
+      TRBZP,     0x42,       // $42 = $40
+      PHX,
+      PLY,                   // Y = 2
+      INCACC,                // A = $10
+      LDAIZ,     0x50,       // ($50) = $5150
+      STAIZ,     0xFF,       // ($FF) wraps to $00, $00FF
+      SMB + 0x70, 0x43,      // $43 = $C3
+      RMB,       0x45,       // $45 = $44
+      BBS + 0x70, 0x43, 0x02, // to BBR
+      INX,
+      INX,
+      BBR,       0x45, 0x02, // to LDXI
+      INX,
+      INX,
+      LDXI,      0x84,
+      BITI,      0x08,       // Z only
+      JMPIX,     0x00, 0x30  // ($3084)
+    });
+    load(0x5150, { 0x77 });
+    load(0x3084, { 0x00, 0x11 });
+    load(0x1100, { JMPA, 0x00, 0x11 });
+    ASSERT_EQ(cpu->run(100), CPU::LoopDetected);
+    ASSERT_EQ(cpu->PC, 0x1100);
+    ASSERT_EQ(cpu->A, 0x77);
+    ASSERT_EQ(cpu->X, 0x84);
+    ASSERT_EQ(cpu->Y, 0x02);
+    ASSERT_EQ(cpu->Status.bits.Z, 1);
+    ASSERT_EQ(cpu->Status.bits.N, 1);
+    ASSERT_EQ(mem.readByte(0x40), 0x00);
+    ASSERT_EQ(mem.readByte(0x41), 0x4F);
+    ASSERT_EQ(mem.readByte(0x42), 0x40);
+    ASSERT_EQ(mem.readByte(0x43), 0xC3);
+    ASSERT_EQ(mem.readByte(0x45), 0x44);
+    ASSERT_EQ(mem.readByte(0xFF), 0x77);
+    ASSERT_EQ(cpu->S, 0xFF);
+  }
+}
+
+// BRK and interrupts clear D on the 65C02
+TEST_F(VariantTest, CmosBrk) {
+  for (auto v : {NMOS6502, CMOS65C02}) {
+    variant(v);
+    load(0x1000, { SED, BRK });
+    load(0x3000, { JMPA, 0x00, 0x30 });
+    load(0xFFFE, { 0x00, 0x30 });
+    ASSERT_EQ(cpu->run(10), CPU::LoopDetected);
+    ASSERT_EQ(cpu->Status.bits.D, (v == CMOS65C02) ? 0 : 1);
+    ASSERT_EQ(mem.readByte(0x1FD) & 0x08, 0x08);
+  }
+}
+
+TEST_F(VariantTest, CmosCycles) {
+  variant(CMOS65C02);
+  load(0x1000, {
+    0x03,                // 1
+    0x02, 0x55,          // 2
+    0x44, 0x10,          // 3
+    0x5C, 0x00, 0x20,    // 8
+    0xDC, 0x00, 0x20,    // 4
+    LDXI,  0x10,         // 2
+    ASLAX, 0xF8, 0x20,   // 6 + 1
+    ASLAX, 0x00, 0x20,   // 6
+  });
+  cpu->run(8);
+  ASSERT_EQ(cpu->PC, 0x1013);
+  ASSERT_EQ(cpu->getCycleCount(), 1 + 2 + 3 + 8 + 4 + 2 + 7 + 6);
+}
+
+// WAI waits for an interrupt, also with IRQ masked. STP stops the CPU
+TEST_F(VariantTest, CmosWaiStp) {
+  variant(CMOS65C02);
+  load(0x1000, {
+    SEI,
+    WAI,
+    INX,
+    STP
+  });
+  ASSERT_EQ(cpu->runCycles(1000), CPU::Idle);
+  ASSERT_EQ(cpu->PC, 0x1001);
+  cpu->setIRQ(true);
+  ASSERT_EQ(cpu->run(10), CPU::Halted);
+  ASSERT_EQ(cpu->X, 1);
+  ASSERT_EQ(cpu->PC, 0x1003);
+  ASSERT_EQ(cpu->getInterruptCount(), 0);
+}
+
+// The 65C02 has no undocumented opcodes, the 2A03 has
+TEST_F(VariantTest, OpcodeCount) {
+  int nmos = cpu->getNumOpcodes();
+  variant(CMOS65C02);
+  ASSERT_EQ(cpu->getNumOpcodes(), 256);
+  variant(Ricoh2A03);
+  ASSERT_EQ(cpu->getNumOpcodes(), nmos);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}